@@ -0,0 +1,362 @@
+#include "apng.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "records.h"
+#include "util.h"
+
+#define PNG_SIGNATURE_BYTES 8
+#define PNG_IHDR_BYTES 13
+#define APNG_FCTL_BYTES 26
+
+// Limits on what the header fields may claim, which are checked before
+// anything is allocated. Frames are laid side by side, one REF entry each.
+#define APNG_CANVAS_MAX 4096
+#define APNG_PIXELS_MAX (256 * 1024 * 1024)
+
+#define APNG_DISPOSE_NONE 0
+#define APNG_DISPOSE_BACKGROUND 1
+#define APNG_DISPOSE_PREVIOUS 2
+#define APNG_BLEND_SOURCE 0
+
+static const uint8_t k_png_signature[PNG_SIGNATURE_BYTES] =
+{
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+};
+
+// Position and handling of one animation frame, from its fcTL chunk.
+typedef struct ApngFrame
+{
+	int w, h, x, y;
+	uint8_t dispose;
+	uint8_t blend;
+} ApngFrame;
+
+// A standalone PNG datastream is assembled for each frame's image data, so that
+// it can be decoded with LodePNG as usual.
+static struct
+{
+	const uint8_t *ihdr;
+	const uint8_t *plte;
+	const uint8_t *trns;
+	uint8_t *dat;
+	size_t bytes;
+	bool error;
+	// Decoded frame pixels, reused from frame to frame.
+	uint8_t *px;
+	size_t px_size;
+} s_stream;
+
+static void stream_begin(const ApngFrame *frame)
+{
+	free(s_stream.dat);
+	s_stream.bytes = PNG_SIGNATURE_BYTES;
+	s_stream.dat = malloc(s_stream.bytes);
+	s_stream.error = !s_stream.dat;
+	if (s_stream.error) return;
+	memcpy(s_stream.dat, k_png_signature, PNG_SIGNATURE_BYTES);
+
+	// The frame's own size replaces the canvas size in the header.
+	uint8_t ihdr[PNG_IHDR_BYTES];
+	memcpy(ihdr, lodepng_chunk_data_const(s_stream.ihdr), PNG_IHDR_BYTES);
+	set_uint32be(ihdr, frame->w);
+	set_uint32be(ihdr + 4, frame->h);
+	s_stream.error |= lodepng_chunk_create(&s_stream.dat, &s_stream.bytes,
+	                                       PNG_IHDR_BYTES, "IHDR", ihdr) != 0;
+	if (s_stream.plte)
+	{
+		s_stream.error |= lodepng_chunk_append(&s_stream.dat, &s_stream.bytes,
+		                                       s_stream.plte) != 0;
+	}
+	if (s_stream.trns)
+	{
+		s_stream.error |= lodepng_chunk_append(&s_stream.dat, &s_stream.bytes,
+		                                       s_stream.trns) != 0;
+	}
+}
+
+static void stream_add_idat(const uint8_t *dat, unsigned int len)
+{
+	if (s_stream.error || !s_stream.dat) return;
+	s_stream.error |= lodepng_chunk_create(&s_stream.dat, &s_stream.bytes,
+	                                       len, "IDAT", dat) != 0;
+}
+
+// Decodes the assembled frame and composites it onto canvas. Returns false on
+// error. changed is set if any canvas pixel took on a new value.
+static bool stream_finish(const ApngFrame *frame, uint8_t *canvas, int cw,
+                          LodePNGState *state, bool *changed)
+{
+	if (!s_stream.error)
+	{
+		s_stream.error |= lodepng_chunk_create(&s_stream.dat, &s_stream.bytes,
+		                                       0, "IEND", NULL) != 0;
+	}
+	if (s_stream.error)
+	{
+		printf("Couldn't assemble APNG frame data.\n");
+		return false;
+	}
+
+	unsigned int w, h;
+	if (!decode_png_into(s_stream.dat, s_stream.bytes,
+	                     &s_stream.px, &s_stream.px_size, &w, &h, state))
+	{
+		return false;
+	}
+	const uint8_t *px = s_stream.px;
+
+	for (int y = 0; y < frame->h; y++)
+	{
+		const uint8_t *src = &px[y * frame->w];
+		uint8_t *line = &canvas[frame->x + ((frame->y + y) * cw)];
+		for (int x = 0; x < frame->w; x++)
+		{
+			// Index 0 is transparent, so it is skipped when blending over.
+			if (frame->blend != APNG_BLEND_SOURCE && src[x] == 0) continue;
+			if (line[x] == src[x]) continue;
+			line[x] = src[x];
+			*changed = true;
+		}
+	}
+	return true;
+}
+
+// Clears or restores the area of the frame after it has been displayed.
+static void dispose_frame(const ApngFrame *frame, uint8_t *canvas, int cw,
+                          const uint8_t *saved, bool *changed)
+{
+	if (frame->dispose == APNG_DISPOSE_NONE) return;
+	for (int y = 0; y < frame->h; y++)
+	{
+		uint8_t *line = &canvas[frame->x + ((frame->y + y) * cw)];
+		const uint8_t *restore = saved ? &saved[y * frame->w] : NULL;
+		for (int x = 0; x < frame->w; x++)
+		{
+			const uint8_t val = restore ? restore[x] : 0;
+			if (line[x] == val) continue;
+			line[x] = val;
+			*changed = true;
+		}
+	}
+}
+
+static bool read_fctl(const uint8_t *chunk, int cw, int ch, bool first,
+                      ApngFrame *frame)
+{
+	if (lodepng_chunk_length(chunk) < APNG_FCTL_BYTES) return false;
+	const uint8_t *dat = lodepng_chunk_data_const(chunk);
+	frame->w = get_uint32be(dat + 4);
+	frame->h = get_uint32be(dat + 8);
+	frame->x = get_uint32be(dat + 12);
+	frame->y = get_uint32be(dat + 16);
+	frame->dispose = dat[24];
+	frame->blend = dat[25];
+	if (frame->w <= 0 || frame->h <= 0 || frame->x < 0 || frame->y < 0 ||
+	    frame->x >= cw || frame->y >= ch ||
+	    frame->w > cw - frame->x || frame->h > ch - frame->y)
+	{
+		return false;
+	}
+	// The first frame has nothing to go back to.
+	if (first && frame->dispose == APNG_DISPOSE_PREVIOUS)
+	{
+		frame->dispose = APNG_DISPOSE_BACKGROUND;
+	}
+	return true;
+}
+
+bool apng_is_animated(const char *fname)
+{
+	uint8_t *png;
+	size_t fsize;
+	if (lodepng_load_file(&png, &fsize, fname)) return false;
+	bool ret = false;
+	if (fsize > PNG_SIGNATURE_BYTES &&
+	    memcmp(png, k_png_signature, PNG_SIGNATURE_BYTES) == 0)
+	{
+		const uint8_t *end = png + fsize;
+		const uint8_t *chunk = png + PNG_SIGNATURE_BYTES;
+		// acTL must come before the image data.
+		while (chunk + 12 <= end && !lodepng_chunk_type_equals(chunk, "IDAT"))
+		{
+			if (lodepng_chunk_type_equals(chunk, "acTL"))
+			{
+				ret = true;
+				break;
+			}
+			chunk = lodepng_chunk_next_const(chunk, end);
+		}
+	}
+	free(png);
+	return ret;
+}
+
+uint8_t *apng_load_frames(const char *fname,
+                          unsigned int *png_w, unsigned int *png_h,
+                          int *frame_w, int *frame_h, bool **unchanged,
+                          LodePNGState *state)
+{
+	uint8_t *png;
+	size_t fsize;
+	int error = lodepng_load_file(&png, &fsize, fname);
+	if (error)
+	{
+		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
+		return NULL;
+	}
+
+	uint8_t *ret = NULL;
+	uint8_t *canvas = NULL;
+	uint8_t *saved = NULL;
+	*unchanged = NULL;
+	memset(&s_stream, 0, sizeof(s_stream));
+	lodepng_state_init(state);
+
+	// The canvas size and the chunks shared by all frames come first.
+	const uint8_t *end = png + fsize;
+	const uint8_t *chunk = png + PNG_SIGNATURE_BYTES;
+	uint32_t frame_count = 0;
+	for (const uint8_t *c = chunk; c + 12 <= end; c = lodepng_chunk_next_const(c, end))
+	{
+		if (lodepng_chunk_type_equals(c, "IEND")) break;
+		if (lodepng_chunk_type_equals(c, "IHDR")) s_stream.ihdr = c;
+		else if (lodepng_chunk_type_equals(c, "PLTE")) s_stream.plte = c;
+		else if (lodepng_chunk_type_equals(c, "tRNS")) s_stream.trns = c;
+		else if (lodepng_chunk_type_equals(c, "acTL") && lodepng_chunk_length(c) >= 8)
+		{
+			frame_count = get_uint32be(lodepng_chunk_data_const(c));
+		}
+	}
+	if (!s_stream.ihdr || lodepng_chunk_length(s_stream.ihdr) < PNG_IHDR_BYTES ||
+	    frame_count == 0)
+	{
+		printf("%s is not a valid APNG.\n", fname);
+		goto done;
+	}
+	if (frame_count > PCG_REF_MAX_COUNT)
+	{
+		printf("%s has %u frames; at most %d are supported.\n", fname,
+		       frame_count, PCG_REF_MAX_COUNT);
+		goto done;
+	}
+
+	const uint8_t *ihdr = lodepng_chunk_data_const(s_stream.ihdr);
+	const uint32_t canvas_w = get_uint32be(ihdr);
+	const uint32_t canvas_h = get_uint32be(ihdr + 4);
+	if (canvas_w == 0 || canvas_h == 0 ||
+	    canvas_w > APNG_CANVAS_MAX || canvas_h > APNG_CANVAS_MAX ||
+	    (size_t)canvas_w * canvas_h * frame_count > APNG_PIXELS_MAX)
+	{
+		printf("%s has an unsupported canvas of %u x %u (%u frames).\n", fname,
+		       canvas_w, canvas_h, frame_count);
+		goto done;
+	}
+	const int cw = canvas_w;
+	const int ch = canvas_h;
+	const size_t canvas_size = (size_t)cw * ch;
+	canvas = calloc(canvas_size, 1);
+	saved = malloc(canvas_size);
+	*unchanged = calloc(frame_count, sizeof(bool));
+	ret = calloc(canvas_size, frame_count);
+	if (!canvas || !saved || !*unchanged || !ret)
+	{
+		printf("Couldn't allocate APNG frame buffers.\n");
+		goto error;
+	}
+	*png_w = cw * frame_count;
+	*png_h = ch;
+	*frame_w = cw;
+	*frame_h = ch;
+
+	// Each fcTL starts a frame, whose data is in the IDAT or fdAT chunks that
+	// follow it. An IDAT not preceded by an fcTL is a default image that isn't
+	// part of the animation.
+	ApngFrame frame = {0};
+	int frame_idx = -1;
+	bool changed = false;
+	LodePNGState frame_state;
+	for (; chunk + 12 <= end; chunk = lodepng_chunk_next_const(chunk, end))
+	{
+		const bool is_fctl = lodepng_chunk_type_equals(chunk, "fcTL");
+		const bool is_iend = lodepng_chunk_type_equals(chunk, "IEND");
+		if ((is_fctl || is_iend) && frame_idx >= 0)
+		{
+			// Finish the frame in progress; the first keeps its palette.
+			LodePNGState *st = frame_idx == 0 ? state : &frame_state;
+			if (frame_idx > 0) lodepng_state_init(&frame_state);
+			if (frame.dispose == APNG_DISPOSE_PREVIOUS)
+			{
+				for (int y = 0; y < frame.h; y++)
+				{
+					memcpy(&saved[y * frame.w],
+					       &canvas[frame.x + ((frame.y + y) * cw)], frame.w);
+				}
+			}
+			const bool ok = stream_finish(&frame, canvas, cw, st, &changed);
+			if (frame_idx > 0) lodepng_state_cleanup(&frame_state);
+			if (!ok) goto error;
+			(*unchanged)[frame_idx] = (frame_idx > 0 && !changed);
+			for (int y = 0; y < ch; y++)
+			{
+				memcpy(&ret[((size_t)frame_idx * cw) + ((size_t)y * *png_w)],
+				       &canvas[y * cw], cw);
+			}
+			changed = false;
+			dispose_frame(&frame, canvas, cw,
+			              frame.dispose == APNG_DISPOSE_PREVIOUS ? saved : NULL,
+			              &changed);
+		}
+		if (is_iend) break;
+		if (is_fctl)
+		{
+			if (frame_idx + 1 >= (int)frame_count) break;
+			if (!read_fctl(chunk, cw, ch, frame_idx < 0, &frame))
+			{
+				printf("Invalid frame control for frame %d.\n", frame_idx + 1);
+				goto error;
+			}
+			frame_idx++;
+			stream_begin(&frame);
+		}
+		else if (frame_idx >= 0 && lodepng_chunk_type_equals(chunk, "IDAT"))
+		{
+			stream_add_idat(lodepng_chunk_data_const(chunk),
+			                lodepng_chunk_length(chunk));
+		}
+		else if (frame_idx >= 0 && lodepng_chunk_type_equals(chunk, "fdAT") &&
+		         lodepng_chunk_length(chunk) > 4)
+		{
+			// fdAT is an IDAT preceded by a sequence number.
+			stream_add_idat(lodepng_chunk_data_const(chunk) + 4,
+			                lodepng_chunk_length(chunk) - 4);
+		}
+	}
+	if (frame_idx + 1 != (int)frame_count)
+	{
+		printf("Expected %u APNG frames, found %d.\n", frame_count,
+		       frame_idx + 1);
+		goto error;
+	}
+	printf("Loaded %u APNG frames of %d x %d.\n", frame_count, cw, ch);
+	goto done;
+
+error:
+	free(ret);
+	free(*unchanged);
+	ret = NULL;
+	*unchanged = NULL;
+
+done:
+	free(s_stream.dat);
+	s_stream.dat = NULL;
+	free(s_stream.px);
+	s_stream.px = NULL;
+	free(saved);
+	free(canvas);
+	free(png);
+	return ret;
+}
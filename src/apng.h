@@ -0,0 +1,27 @@
+// APNG input, where each animation frame becomes one REF entry.
+#ifndef APNG_H
+#define APNG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lodepng.h"
+
+// Returns true if fname is a PNG with an animation control (acTL) chunk.
+bool apng_is_animated(const char *fname);
+
+// Decodes every animation frame of fname, compositing each over the last as
+// described by its frame control chunk. Only the sub-rectangle a frame covers
+// is decoded and blended. The result is a sheet one frame tall, with one
+// canvas-sized frame per column, ready to be chopped like any other sheet.
+// frame_w and frame_h are set to the canvas size. unchanged is set to an array
+// with one entry per frame, true where the composite is identical to that of
+// the previous frame, so that its REF entry can be reused as-is.
+// state is initialized, and holds the palette.
+// Free the sheet and unchanged after usage. NULL on error.
+uint8_t *apng_load_frames(const char *fname,
+                          unsigned int *png_w, unsigned int *png_h,
+                          int *frame_w, int *frame_h, bool **unchanged,
+                          LodePNGState *state);
+
+#endif  // APNG_H
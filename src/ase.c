@@ -0,0 +1,414 @@
+#include "ase.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lodepng.h"
+#include "mapfile.h"
+#include "util.h"
+
+#define ASE_HEADER_BYTES 128
+#define ASE_FRAME_HEADER_BYTES 16
+#define ASE_CHUNK_HEADER_BYTES 6
+#define ASE_MAGIC 0xA5E0
+#define ASE_FRAME_MAGIC 0xF1FA
+
+#define ASE_CHUNK_LAYER 0x2004
+#define ASE_CHUNK_CEL 0x2005
+#define ASE_CHUNK_PALETTE 0x2019
+#define ASE_CHUNK_TILESET 0x2023
+
+#define ASE_LAYER_TILEMAP 2
+#define ASE_CEL_COMPRESSED_TILEMAP 3
+#define ASE_TILESET_EMBEDDED 2
+
+#define ASE_TILESET_MAX_COUNT 16
+#define BG_PT_MAX_COUNT 256
+
+// Aseprite data is little-endian.
+static uint16_t get_uint16le(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t get_uint32le(const uint8_t *buf)
+{
+	return get_uint16le(buf) | (get_uint16le(buf + 2) << 16);
+}
+
+typedef struct AseTileset
+{
+	const uint8_t *dat;  // Compressed tileset image.
+	uint32_t bytes;
+	int tile_count;
+	int tw, th;
+} AseTileset;
+
+typedef struct AseTilemap
+{
+	const uint8_t *dat;  // Compressed tile entries.
+	uint32_t bytes;
+	int x, y;  // Cel position in pixels.
+	int w, h;  // Size in tiles.
+	uint32_t id_mask, xflip_mask, yflip_mask, dflip_mask;
+} AseTilemap;
+
+// Everything found in the first frame that the conversion needs.
+static struct
+{
+	int width, height;
+	int layer_count;
+	int tilemap_layer;
+	int tileset_id;
+	AseTileset tilesets[ASE_TILESET_MAX_COUNT];
+	AseTilemap tilemap;
+	bool have_tilemap;
+	uint16_t pal[16];
+} s_ase;
+
+static void read_layer(const uint8_t *dat, uint32_t len)
+{
+	const int layer_idx = s_ase.layer_count++;
+	if (len < 18 || s_ase.tilemap_layer >= 0) return;
+	if (get_uint16le(dat + 2) != ASE_LAYER_TILEMAP) return;
+	const uint32_t name_len = get_uint16le(dat + 16);
+	if (18 + name_len + 4 > len) return;
+	s_ase.tilemap_layer = layer_idx;
+	s_ase.tileset_id = get_uint32le(dat + 18 + name_len);
+}
+
+static void read_palette(const uint8_t *dat, uint32_t len)
+{
+	if (len < 20) return;
+	const uint32_t first = get_uint32le(dat + 4);
+	const uint32_t last = get_uint32le(dat + 8);
+	uint32_t offs = 20;
+	for (uint32_t i = first; i <= last; i++)
+	{
+		if (offs + 6 > len) return;
+		const uint16_t flags = get_uint16le(dat + offs);
+		if (i > 0 && i < 16)
+		{
+			s_ase.pal[i] = rgb_to_x68k(dat[offs + 2], dat[offs + 3],
+			                           dat[offs + 4]);
+		}
+		offs += 6;
+		if (flags & 1)
+		{
+			if (offs + 2 > len) return;
+			offs += 2 + get_uint16le(dat + offs);
+		}
+	}
+}
+
+static void read_tileset(const uint8_t *dat, uint32_t len)
+{
+	if (len < 34) return;
+	const uint32_t id = get_uint32le(dat);
+	const uint32_t flags = get_uint32le(dat + 4);
+	if (id >= ASE_TILESET_MAX_COUNT || !(flags & ASE_TILESET_EMBEDDED)) return;
+	uint32_t offs = 34 + get_uint16le(dat + 32);
+	if (flags & 1) offs += 8;  // External file reference.
+	if (offs + 4 > len) return;
+	AseTileset *tileset = &s_ase.tilesets[id];
+	tileset->tile_count = get_uint32le(dat + 8);
+	tileset->tw = get_uint16le(dat + 12);
+	tileset->th = get_uint16le(dat + 14);
+	tileset->bytes = get_uint32le(dat + offs);
+	tileset->dat = dat + offs + 4;
+	if (offs + 4 + tileset->bytes > len) tileset->dat = NULL;
+}
+
+static void read_cel(const uint8_t *dat, uint32_t len)
+{
+	if (len < 48 || s_ase.have_tilemap) return;
+	if (get_uint16le(dat) != s_ase.tilemap_layer) return;
+	if (get_uint16le(dat + 7) != ASE_CEL_COMPRESSED_TILEMAP) return;
+	AseTilemap *map = &s_ase.tilemap;
+	map->x = (int16_t)get_uint16le(dat + 2);
+	map->y = (int16_t)get_uint16le(dat + 4);
+	map->w = get_uint16le(dat + 16);
+	map->h = get_uint16le(dat + 18);
+	if (get_uint16le(dat + 20) != 32) return;
+	map->id_mask = get_uint32le(dat + 22);
+	map->xflip_mask = get_uint32le(dat + 26);
+	map->yflip_mask = get_uint32le(dat + 30);
+	map->dflip_mask = get_uint32le(dat + 34);
+	map->dat = dat + 48;
+	map->bytes = len - 48;
+	s_ase.have_tilemap = true;
+}
+
+static bool read_first_frame(const uint8_t *file, size_t size)
+{
+	if (size < ASE_HEADER_BYTES + ASE_FRAME_HEADER_BYTES) return false;
+	if (get_uint16le(file + 4) != ASE_MAGIC) return false;
+	if (get_uint16le(file + 12) != 8)
+	{
+		printf("Only indexed color Aseprite files are supported.\n");
+		return false;
+	}
+	if (file[28] != 0)
+	{
+		printf("Warning: transparent index is %d; index 0 is used instead.\n",
+		       file[28]);
+	}
+	s_ase.width = get_uint16le(file + 8);
+	s_ase.height = get_uint16le(file + 10);
+
+	const uint8_t *frame = file + ASE_HEADER_BYTES;
+	if (get_uint16le(frame + 4) != ASE_FRAME_MAGIC) return false;
+	size_t frame_bytes = get_uint32le(frame);
+	if (frame_bytes > size - ASE_HEADER_BYTES) frame_bytes = size - ASE_HEADER_BYTES;
+	uint32_t chunk_count = get_uint32le(frame + 12);
+	if (chunk_count == 0) chunk_count = get_uint16le(frame + 6);
+
+	size_t offs = ASE_FRAME_HEADER_BYTES;
+	for (uint32_t i = 0; i < chunk_count; i++)
+	{
+		if (offs + ASE_CHUNK_HEADER_BYTES > frame_bytes) break;
+		const uint8_t *chunk = frame + offs;
+		const uint32_t chunk_bytes = get_uint32le(chunk);
+		if (chunk_bytes < ASE_CHUNK_HEADER_BYTES ||
+		    chunk_bytes > frame_bytes - offs)
+		{
+			printf("Malformed chunk at offset %zu.\n", offs);
+			return false;
+		}
+		const uint8_t *dat = chunk + ASE_CHUNK_HEADER_BYTES;
+		const uint32_t len = chunk_bytes - ASE_CHUNK_HEADER_BYTES;
+		switch (get_uint16le(chunk + 4))
+		{
+			case ASE_CHUNK_LAYER:
+				read_layer(dat, len);
+				break;
+			case ASE_CHUNK_CEL:
+				read_cel(dat, len);
+				break;
+			case ASE_CHUNK_PALETTE:
+				read_palette(dat, len);
+				break;
+			case ASE_CHUNK_TILESET:
+				read_tileset(dat, len);
+				break;
+		}
+		offs += chunk_bytes;
+	}
+	return true;
+}
+
+// Packs the tileset into BG pattern data, reusing the sprite 4bpp packing.
+static bool write_bg(const char *outname, const AseTileset *tileset)
+{
+	unsigned char *img = NULL;
+	size_t img_bytes = 0;
+	const size_t expected = (size_t)tileset->tw * tileset->th *
+	                        tileset->tile_count;
+	const unsigned error = lodepng_zlib_decompress(&img, &img_bytes,
+	                                               tileset->dat, tileset->bytes,
+	                                               &lodepng_default_decompress_settings);
+	if (error || img_bytes < expected)
+	{
+		printf("Couldn't decompress the tileset.\n");
+		free(img);
+		return false;
+	}
+
+	char fname_buffer[256];
+	snprintf(fname_buffer, sizeof(fname_buffer), "%s.BG", outname);
+	FILE *f = fopen(fname_buffer, "wb");
+	if (!f)
+	{
+		printf("Couldn't open %s for writing.\n", fname_buffer);
+		free(img);
+		return false;
+	}
+
+	// The tileset image is a single column of tiles.
+	const int tw = tileset->tw;
+	const int th = tileset->th;
+	for (int i = 0; i < tileset->tile_count; i++)
+	{
+		uint8_t pcg_data[32 * 4];
+		const int ty = i * th;
+		const int limy = ty + th;
+		if (tw == 8)
+		{
+			clip_8x8_tile(img, tw, 0, ty, tw, limy, &pcg_data[32 * 0]);
+			fwrite(pcg_data, 32, 1, f);
+			continue;
+		}
+		clip_8x8_tile(img, tw, 0, ty, tw, limy, &pcg_data[32 * 0]);
+		clip_8x8_tile(img, tw, 0, ty + 8, tw, limy, &pcg_data[32 * 1]);
+		clip_8x8_tile(img, tw, 8, ty, tw, limy, &pcg_data[32 * 2]);
+		clip_8x8_tile(img, tw, 8, ty + 8, tw, limy, &pcg_data[32 * 3]);
+		fwrite(pcg_data, 128, 1, f);
+	}
+	fclose(f);
+	free(img);
+	return true;
+}
+
+// Places the tilemap cel within a map covering the whole canvas.
+static bool write_map(const char *outname, const AseTileset *tileset)
+{
+	const AseTilemap *cel = &s_ase.tilemap;
+	unsigned char *tiles = NULL;
+	size_t tiles_bytes = 0;
+	const unsigned error = lodepng_zlib_decompress(&tiles, &tiles_bytes,
+	                                               cel->dat, cel->bytes,
+	                                               &lodepng_default_decompress_settings);
+	if (error || tiles_bytes < (size_t)cel->w * cel->h * 4)
+	{
+		printf("Couldn't decompress the tilemap.\n");
+		free(tiles);
+		return false;
+	}
+
+	const int map_w = s_ase.width / tileset->tw;
+	const int map_h = s_ase.height / tileset->th;
+	uint16_t *map = calloc(map_w * map_h, sizeof(uint16_t));
+	if (!map)
+	{
+		printf("Couldn't allocate the tilemap.\n");
+		free(tiles);
+		return false;
+	}
+
+	const int cx = cel->x / tileset->tw;
+	const int cy = cel->y / tileset->th;
+	bool warned_dflip = false;
+	for (int y = 0; y < cel->h; y++)
+	{
+		if (cy + y < 0 || cy + y >= map_h) continue;
+		for (int x = 0; x < cel->w; x++)
+		{
+			if (cx + x < 0 || cx + x >= map_w) continue;
+			const uint32_t tile = get_uint32le(&tiles[4 * (x + (y * cel->w))]);
+			if ((tile & cel->dflip_mask) && !warned_dflip)
+			{
+				printf("Warning: diagonal flips are not supported by BG.\n");
+				warned_dflip = true;
+			}
+			uint16_t entry = tile & cel->id_mask & 0xFF;
+			if (tile & cel->xflip_mask) entry |= 0x4000;
+			if (tile & cel->yflip_mask) entry |= 0x8000;
+			map[(cx + x) + ((cy + y) * map_w)] = entry;
+		}
+	}
+	free(tiles);
+
+	char fname_buffer[256];
+	snprintf(fname_buffer, sizeof(fname_buffer), "%s.MAP", outname);
+	FILE *f = fopen(fname_buffer, "wb");
+	if (!f)
+	{
+		printf("Couldn't open %s for writing.\n", fname_buffer);
+		free(map);
+		return false;
+	}
+	fputc(map_w >> 8, f);
+	fputc(map_w & 0xFF, f);
+	fputc(map_h >> 8, f);
+	fputc(map_h & 0xFF, f);
+	for (int i = 0; i < map_w * map_h; i++)
+	{
+		fputc(map[i] >> 8, f);
+		fputc(map[i] & 0xFF, f);
+	}
+	fclose(f);
+	free(map);
+	return true;
+}
+
+static bool write_pal(const char *outname)
+{
+	char fname_buffer[256];
+	snprintf(fname_buffer, sizeof(fname_buffer), "%s.PAL", outname);
+	FILE *f = fopen(fname_buffer, "wb");
+	if (!f)
+	{
+		printf("Couldn't open %s for writing.\n", fname_buffer);
+		return false;
+	}
+	// The first index is always transparent, so it is left as 0.
+	for (int i = 0; i < 16; i++)
+	{
+		fputc(s_ase.pal[i] >> 8, f);
+		fputc(s_ase.pal[i] & 0xFF, f);
+	}
+	fclose(f);
+	return true;
+}
+
+bool ase_is_aseprite(const char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if (!f) return false;
+	uint8_t header[6];
+	const bool ret = fread(header, 1, sizeof(header), f) == sizeof(header) &&
+	                 get_uint16le(header + 4) == ASE_MAGIC;
+	fclose(f);
+	return ret;
+}
+
+bool ase_convert_tilemap(const char *fname, const char *outname)
+{
+	size_t size;
+	const uint8_t *file = map_file(fname, &size);
+	if (!file)
+	{
+		printf("Couldn't open %s.\n", fname);
+		return false;
+	}
+
+	bool ret = false;
+	memset(&s_ase, 0, sizeof(s_ase));
+	s_ase.tilemap_layer = -1;
+	if (!read_first_frame(file, size))
+	{
+		printf("%s is not a valid Aseprite file.\n", fname);
+		goto done;
+	}
+	if (s_ase.tilemap_layer < 0 || !s_ase.have_tilemap)
+	{
+		printf("%s has no tilemap layer in its first frame.\n", fname);
+		goto done;
+	}
+	if (s_ase.tileset_id >= ASE_TILESET_MAX_COUNT ||
+	    !s_ase.tilesets[s_ase.tileset_id].dat)
+	{
+		printf("The tileset for the tilemap layer is missing or external.\n");
+		goto done;
+	}
+
+	const AseTileset *tileset = &s_ase.tilesets[s_ase.tileset_id];
+	if ((tileset->tw != 8 || tileset->th != 8) &&
+	    (tileset->tw != 16 || tileset->th != 16))
+	{
+		printf("Tiles must be 8x8 or 16x16 (have %d x %d).\n",
+		       tileset->tw, tileset->th);
+		goto done;
+	}
+	if (tileset->tile_count > BG_PT_MAX_COUNT)
+	{
+		printf("BG supports %d patterns (have %d).\n",
+		       BG_PT_MAX_COUNT, tileset->tile_count);
+		goto done;
+	}
+
+	if (!write_bg(outname, tileset)) goto done;
+	if (!write_map(outname, tileset)) goto done;
+	if (!write_pal(outname)) goto done;
+
+	printf("BG:\t%d (%d x %d)\n", tileset->tile_count, tileset->tw, tileset->th);
+	printf("MAP:\t%d x %d\n", s_ase.width / tileset->tw,
+	       s_ase.height / tileset->th);
+	ret = true;
+
+done:
+	unmap_file(file, size);
+	return ret;
+}
@@ -0,0 +1,25 @@
+// Aseprite tilemap import for BG conversion.
+//
+// Aseprite 1.3 tilemap layers store a tileset along with a grid of tile
+// indices and flip flags, so BG data can be emitted from them directly rather
+// than deduplicated again from flattened pixels. Only indexed color files are
+// supported, with 8x8 or 16x16 tiles.
+#ifndef ASE_H
+#define ASE_H
+
+#include <stdbool.h>
+
+// Returns true if fname begins with the Aseprite file magic.
+bool ase_is_aseprite(const char *fname);
+
+// Converts the first tilemap layer of the first frame in fname, emitting:
+// <outname>.BG  <-- Tileset pattern data; 32 bytes per 8x8 tile, or 128 bytes
+//                   per 16x16 tile in the same layout as sprite PCG data
+// <outname>.MAP <-- Big-endian uint16_t width and height in tiles, followed by
+//                   one BG entry per cell, row by row: bit 15 is V-flip,
+//                   bit 14 is H-flip, and bits 7-0 are the pattern number
+// <outname>.PAL <-- Palette data (in X68000 color format)
+// Returns true if conversion was successful.
+bool ase_convert_tilemap(const char *fname, const char *outname);
+
+#endif  // ASE_H
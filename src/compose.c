@@ -0,0 +1,243 @@
+#include "compose.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#define COMPOSE_PART_MAX_COUNT 64
+#define COMPOSE_FRAME_MAX_COUNT 4096
+#define COMPOSE_LINE_MAX 1024
+
+typedef struct ComposePart
+{
+	char name[64];
+	uint8_t *imgdat;
+	unsigned int iw, ih;
+	int fw, fh;
+	int columns;
+	int count;
+} ComposePart;
+
+static ComposePart s_parts[COMPOSE_PART_MAX_COUNT];
+static int s_part_count = 0;
+
+static void free_parts(void)
+{
+	for (int i = 0; i < s_part_count; i++) free(s_parts[i].imgdat);
+	s_part_count = 0;
+}
+
+static ComposePart *find_part(const char *name)
+{
+	for (int i = 0; i < s_part_count; i++)
+	{
+		if (strcmp(s_parts[i].name, name) == 0) return &s_parts[i];
+	}
+	return NULL;
+}
+
+static bool add_part(const char *fname, int line_no, char *args,
+                     LodePNGState *state)
+{
+	char *name = strtok(args, " \t\r\n");
+	char *sheet = strtok(NULL, " \t\r\n");
+	char *fw = strtok(NULL, " \t\r\n");
+	char *fh = strtok(NULL, " \t\r\n");
+	if (!fh)
+	{
+		printf("%s:%d: part needs a name, sheet, and frame size\n",
+		       fname, line_no);
+		return false;
+	}
+	if (find_part(name))
+	{
+		printf("%s:%d: part \"%s\" declared twice\n", fname, line_no, name);
+		return false;
+	}
+	if (s_part_count >= COMPOSE_PART_MAX_COUNT)
+	{
+		printf("%s:%d: too many parts\n", fname, line_no);
+		return false;
+	}
+
+	ComposePart *part = &s_parts[s_part_count];
+	snprintf(part->name, sizeof(part->name), "%s", name);
+	part->fw = strtoul(fw, NULL, 0);
+	part->fh = strtoul(fh, NULL, 0);
+	if (part->fw <= 0 || part->fh <= 0)
+	{
+		printf("%s:%d: bad frame size for part \"%s\"\n", fname, line_no, name);
+		return false;
+	}
+
+	// The first sheet supplies the palette; the others only need pixel data.
+	LodePNGState part_state;
+	part->imgdat = load_png_data(sheet, &part->iw, &part->ih,
+	                             s_part_count == 0 ? state : &part_state);
+	if (!part->imgdat) return false;
+	if (s_part_count > 0)
+	{
+		if (!palettes_match(state, &part_state))
+		{
+			printf("Warning: palette of \"%s\" differs from the first part.\n",
+			       sheet);
+		}
+		lodepng_state_cleanup(&part_state);
+	}
+	part->columns = part->iw / part->fw;
+	part->count = part->columns * (part->ih / part->fh);
+	s_part_count++;
+	return true;
+}
+
+// Draws the opaque pixels of a part frame into the composite frame at dx, dy.
+static void draw_part(const ComposePart *part, int index,
+                      uint8_t *dest, int dest_w, int frame_x,
+                      int frame_w, int frame_h, int dx, int dy)
+{
+	const int px = (index % part->columns) * part->fw;
+	const int py = (index / part->columns) * part->fh;
+	for (int y = 0; y < part->fh; y++)
+	{
+		const int ty = dy + y;
+		if (ty < 0 || ty >= frame_h) continue;
+		const uint8_t *src = &part->imgdat[px + ((py + y) * part->iw)];
+		uint8_t *line = &dest[frame_x + (ty * dest_w)];
+		for (int x = 0; x < part->fw; x++)
+		{
+			const int tx = dx + x;
+			if (tx < 0 || tx >= frame_w) continue;
+			if (src[x] == 0) continue;
+			line[tx] = src[x];
+		}
+	}
+}
+
+// Composes the frame described by args into column frame_idx of dest.
+static bool add_frame(const char *fname, int line_no, char *args,
+                      uint8_t *dest, int dest_w, int frame_idx,
+                      int frame_w, int frame_h)
+{
+	char *name = strtok(args, " \t\r\n");
+	while (name)
+	{
+		char *index = strtok(NULL, " \t\r\n");
+		char *x = strtok(NULL, " \t\r\n");
+		char *y = strtok(NULL, " \t\r\n");
+		if (!y)
+		{
+			printf("%s:%d: frame entries are <name> <index> <x> <y>\n",
+			       fname, line_no);
+			return false;
+		}
+		const ComposePart *part = find_part(name);
+		if (!part)
+		{
+			printf("%s:%d: unknown part \"%s\"\n", fname, line_no, name);
+			return false;
+		}
+		const int idx = strtol(index, NULL, 0);
+		if (idx < 0 || idx >= part->count)
+		{
+			printf("%s:%d: part \"%s\" has no frame %d\n",
+			       fname, line_no, name, idx);
+			return false;
+		}
+		draw_part(part, idx, dest, dest_w, frame_idx * frame_w,
+		          frame_w, frame_h, strtol(x, NULL, 0), strtol(y, NULL, 0));
+		name = strtok(NULL, " \t\r\n");
+	}
+	return true;
+}
+
+// Counts the frame lines, so the composite can be allocated up front.
+static int count_frames(FILE *f)
+{
+	char line[COMPOSE_LINE_MAX];
+	int count = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		const char *cmd = line + strspn(line, " \t");
+		if (strncmp(cmd, "frame", 5) == 0) count++;
+	}
+	rewind(f);
+	return count;
+}
+
+uint8_t *compose_sheet(const char *fname, int frame_w, int frame_h,
+                       unsigned int *png_w, unsigned int *png_h,
+                       LodePNGState *state)
+{
+	FILE *f = fopen(fname, "r");
+	if (!f)
+	{
+		printf("Couldn't open composition list %s.\n", fname);
+		return NULL;
+	}
+
+	const int frame_count = count_frames(f);
+	if (frame_count <= 0 || frame_count > COMPOSE_FRAME_MAX_COUNT)
+	{
+		printf("%s: expected 1 to %d frames (have %d)\n",
+		       fname, COMPOSE_FRAME_MAX_COUNT, frame_count);
+		fclose(f);
+		return NULL;
+	}
+
+	*png_w = frame_w * frame_count;
+	*png_h = frame_h;
+	uint8_t *ret = calloc(*png_w, *png_h);
+	if (!ret)
+	{
+		printf("Couldn't allocate composite image.\n");
+		fclose(f);
+		return NULL;
+	}
+
+	char line[COMPOSE_LINE_MAX];
+	int line_no = 0;
+	int frame_idx = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), f))
+	{
+		line_no++;
+		char *cmd = line + strspn(line, " \t");
+		if (*cmd == '#' || *cmd == '\r' || *cmd == '\n' || *cmd == '\0')
+		{
+			continue;
+		}
+		if (strncmp(cmd, "part", 4) == 0)
+		{
+			ok = add_part(fname, line_no, cmd + 4, state);
+		}
+		else if (strncmp(cmd, "frame", 5) == 0)
+		{
+			if (s_part_count == 0)
+			{
+				printf("%s:%d: frame before any part\n", fname, line_no);
+				ok = false;
+				break;
+			}
+			ok = add_frame(fname, line_no, cmd + 5, ret, *png_w, frame_idx++,
+			               frame_w, frame_h);
+		}
+		else
+		{
+			printf("%s:%d: unknown directive\n", fname, line_no);
+			ok = false;
+		}
+	}
+
+	fclose(f);
+	free_parts();
+	if (!ok)
+	{
+		free(ret);
+		return NULL;
+	}
+	printf("Composed %d frames from \"%s\".\n", frame_idx, fname);
+	return ret;
+}
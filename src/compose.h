@@ -0,0 +1,32 @@
+// Build-time composition of multi-part objects.
+//
+// A composition list is a text file that combines frames from several sprite
+// sheets into one object set, so that a character made of a body, a weapon,
+// and an effect is drawn as a single XOBJ rather than as several. Blank lines
+// and lines starting with '#' are ignored. The other lines are:
+//
+//     part <name> <sheet.png> <frame width> <frame height>
+//     frame <name> <index> <x> <y> [<name> <index> <x> <y> ...]
+//
+// "part" declares a sheet that is cut into frames of the given size, which are
+// indexed left to right, then top to bottom. Each "frame" line emits one
+// composed frame, drawing the listed part frames at the given offsets within
+// it. Parts listed later are drawn over those listed earlier.
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stdint.h>
+
+#include "lodepng.h"
+
+// Renders the composition list fname as a sheet one frame tall, with one
+// composed frame of frame_w x frame_h per column. The composite is then chopped
+// like any other sheet, so that overlapping parts share hardware sprites.
+// state is initialized with the palette of the first part declared; all parts
+// are expected to share it.
+// Free after usage. NULL on error.
+uint8_t *compose_sheet(const char *fname, int frame_w, int frame_h,
+                       unsigned int *png_w, unsigned int *png_h,
+                       LodePNGState *state);
+
+#endif  // COMPOSE_H
@@ -0,0 +1,418 @@
+#include "cost.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m68k.h"
+#include "mapfile.h"
+#include "records.h"
+#include "util.h"
+
+#define CPU_CYCLES_PER_MS 10000  // 10MHz
+#define CPU_MAX_CYCLES 0x100000000ULL
+
+// Memory map for the emulated routines.
+#define STACK_BASE 0x000400
+#define STACK_BYTES 0x400
+#define CODE_BASE 0x001000
+#define CODE_BYTES 0x400
+#define ROUTINE_BYTES 0x100  // Each routine starts on one of these.
+#define LOAD_BASE 0x010000  // Output files are placed from here up.
+#define LOAD_LIMIT 0xC00000  // 12MB of main memory.
+#define PAL_RAM_BASE 0xE82220  // Sprite palette block 1.
+#define PAL_RAM_BYTES 32
+
+//
+// Reference routines, as assembled.
+//
+
+// XSB header parsing. The type and counts are read, the palette is copied to
+// palette RAM at a1, and the three section offsets are relocated against the
+// base of the bundle in a0. Leaves the REF table in a3, the FRM base in d6, the
+// patterns in a0, and the REF and pattern counts in d3 and d5.
+static const uint16_t k_xsb_header[] =
+{
+	0x2448,          //     movea.l a0, a2
+	0x3018,          //     move.w  (a0)+, d0      type
+	0x3618,          //     move.w  (a0)+, d3      ref_count
+	0x3818,          //     move.w  (a0)+, d4      frm_bytes
+	0x3A18,          //     move.w  (a0)+, d5      pcg_count
+	0x720F,          //     moveq   #16-1, d1
+	0x32D8,          // .pal: move.w (a0)+, (a1)+
+	0x51C9, 0xFFFC,  //     dbra    d1, .pal
+	0x2418,          //     move.l  (a0)+, d2      ref_offs
+	0xD48A,          //     add.l   a2, d2
+	0x2642,          //     movea.l d2, a3
+	0x2418,          //     move.l  (a0)+, d2      frm_offs
+	0xD48A,          //     add.l   a2, d2
+	0x2C02,          //     move.l  d2, d6
+	0x2418,          //     move.l  (a0)+, d2      pcg_offs
+	0xD48A,          //     add.l   a2, d2
+	0x2042,          //     movea.l d2, a0
+	0x4E75,          //     rts
+};
+
+// Palette copy to palette RAM, from a0 to a1. Also used for one step of a fade.
+static const uint16_t k_pal_copy[] =
+{
+	0x720F,          //     moveq   #16-1, d1
+	0x32D8,          // .pal: move.w (a0)+, (a1)+
+	0x51C9, 0xFFFC,  //     dbra    d1, .pal
+	0x4E75,          //     rts
+};
+
+// REF relocation: the FRM offset in each 8-byte entry at a0 becomes a pointer,
+// by adding the FRM base in d1. d0 is the REF count.
+static const uint16_t k_ref_relocate[] =
+{
+	0x4A40,          //     tst.w   d0
+	0x670C,          //     beq.s   .done
+	0x5340,          //     subq.w  #1, d0
+	0xD3A8, 0x0002,  // .ref: add.l d1, 2(a0)
+	0x5088,          //     addq.l  #8, a0
+	0x51C8, 0xFFF8,  //     dbra    d0, .ref
+	0x4E75,          // .done: rts
+};
+
+// PCG copy from the loaded file at a0 into a resident pattern buffer at a1. d0
+// is the pattern count.
+#define MOVE_L_A0_A1 0x22D8  // move.l (a0)+, (a1)+
+static const uint16_t k_pcg_copy[] =
+{
+	0x4A40,          //     tst.w   d0
+	0x6746,          //     beq.s   .done
+	0x5340,          //     subq.w  #1, d0
+	// .pcg: move.l (a0)+, (a1)+, x32 unrolled
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1, MOVE_L_A0_A1,
+	0x51C8, 0xFFBE,  //     dbra    d0, .pcg
+	0x4E75,          // .done: rts
+};
+
+// FRM data is used in place by XSP and needs no processing after loading.
+
+typedef enum Routine
+{
+	ROUTINE_XSB_HEADER,
+	ROUTINE_PAL_COPY,
+	ROUTINE_REF_RELOCATE,
+	ROUTINE_PCG_COPY,
+	ROUTINE_COUNT
+} Routine;
+
+static const struct
+{
+	const uint16_t *code;
+	int words;
+} k_routines[ROUTINE_COUNT] =
+{
+	[ROUTINE_XSB_HEADER] = {k_xsb_header, ARRAYSIZE(k_xsb_header)},
+	[ROUTINE_PAL_COPY] = {k_pal_copy, ARRAYSIZE(k_pal_copy)},
+	[ROUTINE_REF_RELOCATE] = {k_ref_relocate, ARRAYSIZE(k_ref_relocate)},
+	[ROUTINE_PCG_COPY] = {k_pcg_copy, ARRAYSIZE(k_pcg_copy)},
+};
+
+//
+// Target memory.
+//
+
+typedef struct Target
+{
+	M68k cpu;
+	uint8_t stack[STACK_BYTES];
+	uint8_t code[CODE_BYTES];
+	uint8_t pal_ram[PAL_RAM_BYTES];
+	uint8_t *buffers[M68K_REGION_MAX];
+	int buffer_count;
+	uint32_t load_next;
+	uint64_t total;
+} Target;
+
+static void target_init(Target *t)
+{
+	m68k_init(&t->cpu);
+	memset(t->stack, 0, sizeof(t->stack));
+	memset(t->code, 0, sizeof(t->code));
+	memset(t->pal_ram, 0, sizeof(t->pal_ram));
+	for (int i = 0; i < ROUTINE_COUNT; i++)
+	{
+		uint8_t *dest = &t->code[i * ROUTINE_BYTES];
+		for (int j = 0; j < k_routines[i].words; j++)
+		{
+			set_uint16be(&dest[j * 2], k_routines[i].code[j]);
+		}
+	}
+	m68k_map(&t->cpu, STACK_BASE, t->stack, sizeof(t->stack));
+	m68k_map(&t->cpu, CODE_BASE, t->code, sizeof(t->code));
+	m68k_map(&t->cpu, PAL_RAM_BASE, t->pal_ram, sizeof(t->pal_ram));
+	t->cpu.a[7] = STACK_BASE + STACK_BYTES;
+	t->buffer_count = 0;
+	t->load_next = LOAD_BASE;
+	t->total = 0;
+}
+
+static void target_free(Target *t)
+{
+	for (int i = 0; i < t->buffer_count; i++) free(t->buffers[i]);
+	t->buffer_count = 0;
+}
+
+// Places bytes of main memory at the next free address, copying src there if
+// it isn't NULL. Returns the address, or 0 if it doesn't fit.
+static uint32_t target_alloc(Target *t, const uint8_t *src, size_t bytes)
+{
+	const uint32_t addr = t->load_next;
+	if (bytes > LOAD_LIMIT - addr || t->buffer_count >= M68K_REGION_MAX - 3)
+	{
+		printf("Output is too large to place in target memory.\n");
+		return 0;
+	}
+	uint8_t *dat = malloc(bytes ? bytes : 1);
+	if (!dat)
+	{
+		printf("Couldn't allocate target memory.\n");
+		return 0;
+	}
+	if (src) memcpy(dat, src, bytes);
+	else memset(dat, 0, bytes);
+	t->buffers[t->buffer_count++] = dat;
+	m68k_map(&t->cpu, addr, dat, bytes);
+	t->load_next = (addr + bytes + 15) & ~15U;
+	return addr;
+}
+
+// Loads an output file into main memory. Returns its address, or 0 on error.
+static uint32_t target_load(Target *t, const char *fname, uint32_t *bytes)
+{
+	size_t size;
+	const uint8_t *dat = map_file(fname, &size);
+	if (!dat)
+	{
+		printf("Couldn't read %s to profile.\n", fname);
+		return 0;
+	}
+	const uint32_t addr = target_alloc(t, dat, size);
+	unmap_file(dat, size);
+	*bytes = size;
+	return addr;
+}
+
+// Host side view of emulated memory, for checking results.
+static const uint8_t *target_ptr(const Target *t, uint32_t addr)
+{
+	for (int i = 0; i < t->cpu.region_count; i++)
+	{
+		const M68kRegion *region = &t->cpu.regions[i];
+		if (addr >= region->base && addr - region->base < region->size)
+		{
+			return &region->dat[addr - region->base];
+		}
+	}
+	return NULL;
+}
+
+static bool run(Target *t, Routine routine, const char *fname, int count,
+                const char *unit)
+{
+	if (!m68k_call(&t->cpu, CODE_BASE + (routine * ROUTINE_BYTES),
+	               CPU_MAX_CYCLES))
+	{
+		printf("%s: %s\n", fname, t->cpu.fault_text);
+		return false;
+	}
+	static const char *k_names[ROUTINE_COUNT] =
+	{
+		[ROUTINE_XSB_HEADER] = "XSB header",
+		[ROUTINE_PAL_COPY] = "PAL copy",
+		[ROUTINE_REF_RELOCATE] = "REF relocate",
+		[ROUTINE_PCG_COPY] = "PCG copy",
+	};
+	printf("%-24s%-16s%6d %-8s%10llu\n", fname, k_names[routine], count, unit,
+	       (unsigned long long)t->cpu.cycles);
+	t->total += t->cpu.cycles;
+	return true;
+}
+
+// Checks the routines did what they were written to do, so that a fault in
+// the emulation doesn't go unnoticed as a cycle count.
+static bool check(bool ok, const char *fname, const char *what)
+{
+	if (!ok) printf("%s: %s doesn't match after emulation.\n", fname, what);
+	return ok;
+}
+
+static bool run_pal_copy(Target *t, const char *fname, uint32_t src)
+{
+	t->cpu.a[0] = src;
+	t->cpu.a[1] = PAL_RAM_BASE;
+	if (!run(t, ROUTINE_PAL_COPY, fname, 16, "colors")) return false;
+	return check(memcmp(t->pal_ram, target_ptr(t, src), PAL_RAM_BYTES) == 0,
+	             fname, "Palette RAM");
+}
+
+static bool run_ref_relocate(Target *t, const char *fname, uint32_t ref,
+                             int ref_count, uint32_t frm)
+{
+	// Offsets before relocation, to check against.
+	uint8_t *before = malloc(8 * (size_t)ref_count + 1);
+	if (!before) return false;
+	memcpy(before, target_ptr(t, ref), 8 * (size_t)ref_count);
+	t->cpu.a[0] = ref;
+	t->cpu.d[0] = ref_count;
+	t->cpu.d[1] = frm;
+	bool ok = run(t, ROUTINE_REF_RELOCATE, fname, ref_count, "entries");
+	const uint8_t *after = target_ptr(t, ref);
+	for (int i = 0; ok && i < ref_count; i++)
+	{
+		const uint32_t want = get_uint32be(&before[i * 8 + 2]) + frm;
+		ok = check(get_uint32be(&after[i * 8 + 2]) == want, fname, "REF");
+	}
+	free(before);
+	return ok;
+}
+
+static bool run_pcg_copy(Target *t, const char *fname, uint32_t src,
+                         int pcg_count)
+{
+	const size_t bytes = 128 * (size_t)pcg_count;
+	const uint32_t dest = target_alloc(t, NULL, bytes);
+	if (!dest) return false;
+	t->cpu.a[0] = src;
+	t->cpu.a[1] = dest;
+	t->cpu.d[0] = pcg_count;
+	if (!run(t, ROUTINE_PCG_COPY, fname, pcg_count, "patterns")) return false;
+	return check(bytes == 0 ||
+	             memcmp(target_ptr(t, dest), target_ptr(t, src), bytes) == 0,
+	             fname, "Pattern buffer");
+}
+
+static bool profile_bundle(Target *t, const char *outname)
+{
+	char fname[256];
+	snprintf(fname, sizeof(fname), "%s.XSB", outname);
+	uint32_t bytes;
+	const uint32_t base = target_load(t, fname, &bytes);
+	if (!base) return false;
+	if (bytes < sizeof(XSBHeader))
+	{
+		printf("%s is too short to profile.\n", fname);
+		return false;
+	}
+
+	t->cpu.a[0] = base;
+	t->cpu.a[1] = PAL_RAM_BASE;
+	if (!run(t, ROUTINE_XSB_HEADER, fname, 1, "header")) return false;
+	const uint32_t ref = t->cpu.a[3];
+	const uint32_t frm = t->cpu.d[6];
+	const uint32_t pcg = t->cpu.a[0];
+	const int ref_count = t->cpu.d[3] & 0xFFFF;
+	const int pcg_count = t->cpu.d[5] & 0xFFFF;
+	if (!check(memcmp(t->pal_ram, target_ptr(t, base + 8), PAL_RAM_BYTES) == 0,
+	           fname, "Palette RAM"))
+	{
+		return false;
+	}
+	// Sections are only read through the offsets the routine relocated, so
+	// they have to lie within the bundle.
+	const uint32_t end = base + bytes;
+	if (ref > end || ref_count * 8U > end - ref ||
+	    pcg > end || pcg_count * 128U > end - pcg)
+	{
+		printf("%s: Sections lie outside the bundle.\n", fname);
+		return false;
+	}
+
+	if (ref_count > 0 && !run_ref_relocate(t, fname, ref, ref_count, frm))
+	{
+		return false;
+	}
+	return run_pcg_copy(t, fname, pcg, pcg_count);
+}
+
+static bool profile_set(Target *t, const char *outname, ConvMode mode)
+{
+	char fname[256];
+	uint32_t bytes;
+
+	snprintf(fname, sizeof(fname), "%s.PAL", outname);
+	const uint32_t pal = target_load(t, fname, &bytes);
+	if (!pal) return false;
+	if (bytes < PAL_RAM_BYTES)
+	{
+		printf("%s is too short to profile.\n", fname);
+		return false;
+	}
+	if (!run_pal_copy(t, fname, pal)) return false;
+
+	if (mode == CONV_MODE_XOBJ)
+	{
+		snprintf(fname, sizeof(fname), "%s.FRM", outname);
+		const uint32_t frm = target_load(t, fname, &bytes);
+		if (!frm) return false;
+		printf("%-24s%-16s%6u %-8s%10d\n", fname, "FRM (in place)", bytes / 8,
+		       "entries", 0);
+
+		snprintf(fname, sizeof(fname), "%s.REF", outname);
+		const uint32_t ref = target_load(t, fname, &bytes);
+		if (!ref) return false;
+		if (!run_ref_relocate(t, fname, ref, bytes / 8, frm)) return false;
+	}
+
+	snprintf(fname, sizeof(fname), (mode == CONV_MODE_XOBJ) ? "%s.XSP" : "%s.SP",
+	         outname);
+	const uint32_t pcg = target_load(t, fname, &bytes);
+	if (!pcg) return false;
+	return run_pcg_copy(t, fname, pcg, bytes / 128);
+}
+
+static bool profile_fade(Target *t, const char *outname)
+{
+	char fname[256];
+	snprintf(fname, sizeof(fname), "%s.FAD", outname);
+	uint32_t bytes;
+	const uint32_t fad = target_load(t, fname, &bytes);
+	if (!fad) return false;
+	if (bytes < 2 + PAL_RAM_BYTES)
+	{
+		printf("%s is too short to profile.\n", fname);
+		return false;
+	}
+	// The first step of the fade to black, past the step count.
+	const uint64_t load_total = t->total;
+	const bool ok = run_pal_copy(t, fname, fad + 2);
+	t->total = load_total;
+	if (ok) printf("    (per frame of a fade)\n");
+	return ok;
+}
+
+bool cost_report(const char *outname, ConvMode mode, bool bundle,
+                 int fade_steps)
+{
+	Target *t = malloc(sizeof(Target));
+	if (!t)
+	{
+		printf("Couldn't allocate target memory.\n");
+		return false;
+	}
+	target_init(t);
+	printf("Target cost (68000 cycles, measured by emulation):\n");
+	bool ok = bundle ? profile_bundle(t, outname) : profile_set(t, outname, mode);
+	if (ok)
+	{
+		printf("Load total: %llu cycles (%llu.%02llu ms at 10MHz)\n",
+		       (unsigned long long)t->total,
+		       (unsigned long long)(t->total / CPU_CYCLES_PER_MS),
+		       (unsigned long long)((t->total % CPU_CYCLES_PER_MS) / 100));
+	}
+	if (ok && fade_steps > 0) ok = profile_fade(t, outname);
+	target_free(t);
+	free(t);
+	return ok;
+}
@@ -0,0 +1,21 @@
+// Measured 68000 cycle costs for consuming emitted data on the target.
+//
+// Small reference loader routines, written out in cost.c, are run over the
+// files just written, in an emulated 68000 (see m68k.h) that counts cycles by
+// the timings of the MC68000 user's manual, with no wait states. They are meant
+// for comparing output options against each other during a build, rather than
+// as exact figures for a given machine.
+#ifndef COST_H
+#define COST_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// Loads the files written to outname, runs each reference routine on them, and
+// prints the cycles each took, and the total at the X68000's 10MHz clock.
+// Returns false if a file couldn't be loaded or a routine failed.
+bool cost_report(const char *outname, ConvMode mode, bool bundle,
+                 int fade_steps);
+
+#endif  // COST_H
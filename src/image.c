@@ -0,0 +1,162 @@
+#include "image.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool decode_png_into(const uint8_t *png, size_t png_size,
+                     uint8_t **buf, size_t *buf_size,
+                     unsigned int *png_w, unsigned int *png_h,
+                     LodePNGState *state)
+{
+	// The image is decoded as an 8-bit indexed color PNG; we don't want any
+	// conversion to take place.
+	lodepng_state_init(state);
+	state->info_raw.colortype = LCT_PALETTE;
+	state->info_raw.bitdepth = 8;
+	int error = lodepng_inspect(png_w, png_h, state, png, png_size);
+	if (error)
+	{
+		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
+		return false;
+	}
+
+	// Grow the buffer to the high-water mark only when this image needs it.
+	const size_t needed = (size_t)*png_w * *png_h;
+	if (needed > *buf_size)
+	{
+		uint8_t *grown = realloc(*buf, needed);
+		if (!grown)
+		{
+			printf("Couldn't allocate %zu bytes for a %u x %u image.\n",
+			       needed, *png_w, *png_h);
+			return false;
+		}
+		*buf = grown;
+		*buf_size = needed;
+	}
+
+	error = lodepng_decode_into(*buf, *buf_size, png_w, png_h, state,
+	                            png, png_size);
+	if (error)
+	{
+		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
+		return false;
+	}
+	return true;
+}
+
+bool load_png_into(const char *fname, uint8_t **buf, size_t *buf_size,
+                   unsigned int *png_w, unsigned int *png_h,
+                   LodePNGState *state)
+{
+	uint8_t *png;
+	// First load the file into memory.
+	size_t fsize;
+	int error = lodepng_load_file(&png, &fsize, fname);
+	if (error)
+	{
+		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
+		return false;
+	}
+
+	const bool ok = decode_png_into(png, fsize, buf, buf_size,
+	                                png_w, png_h, state);
+	free(png);
+	return ok;
+}
+
+uint8_t *load_png_data(const char *fname,
+                       unsigned int *png_w, unsigned int *png_h,
+                       LodePNGState *state)
+{
+	uint8_t *ret = NULL;
+	size_t ret_size = 0;
+	if (!load_png_into(fname, &ret, &ret_size, png_w, png_h, state))
+	{
+		free(ret);
+		return NULL;
+	}
+
+//	printf("Loaded \"%s\": %d x %d\n", fname, *png_w, *png_h);
+	return ret;
+}
+
+bool palettes_match(const LodePNGState *a, const LodePNGState *b)
+{
+	const LodePNGColorMode *ca = &a->info_png.color;
+	const LodePNGColorMode *cb = &b->info_png.color;
+	const size_t cmp_bytes = 4 * 16;
+	return ca->palettesize >= 16 && cb->palettesize >= 16 &&
+	       memcmp(ca->palette, cb->palette, cmp_bytes) == 0;
+}
+
+void image_projections(const uint8_t *imgdat, int iw, int ih,
+                       uint32_t *cols, uint32_t *rows)
+{
+	for (int x = 0; x < iw; x++) cols[x] = 0;
+	for (int y = 0; y < ih; y++)
+	{
+		const uint8_t *line = &imgdat[y * iw];
+		uint32_t count = 0;
+		for (int x = 0; x < iw; x++)
+		{
+			const uint32_t opaque = (line[x] != 0);
+			cols[x] += opaque;
+			count += opaque;
+		}
+		rows[y] = count;
+	}
+}
+
+int detect_grid_period(const uint32_t *proj, int len, int *confidence)
+{
+	// Frames smaller than an 8x8 tile aren't considered.
+	static const int k_min_period = 8;
+
+	int best_period = len;
+	int best_score = -1;
+	for (int period = k_min_period; period <= len; period++)
+	{
+		if (len % period) continue;
+
+		// Walk the runs of opaque lines, noting any that straddle a cell
+		// boundary, and the cells that contain anything at all.
+		const int cells = len / period;
+		int runs = 0;
+		int split_runs = 0;
+		int filled_cells = 0;
+		int last_filled = -1;
+		int run_start = -1;
+		for (int i = 0; i <= len; i++)
+		{
+			const bool opaque = (i < len) && proj[i] != 0;
+			if (opaque && run_start < 0) run_start = i;
+			if (opaque || run_start < 0) continue;
+			runs++;
+			if (run_start / period != (i - 1) / period) split_runs++;
+			for (int cell = run_start / period; cell <= (i - 1) / period; cell++)
+			{
+				if (cell == last_filled) continue;
+				filled_cells++;
+				last_filled = cell;
+			}
+			run_start = -1;
+		}
+		if (runs == 0) break;
+
+		// Cells are better the fewer runs they split and the fewer of them are
+		// left empty. Smaller cells win ties, as they mean less claim work.
+		const int score = (100 * (runs - split_runs) / runs) *
+		                  (100 * filled_cells / cells) / 100;
+		if (score > best_score)
+		{
+			best_score = score;
+			best_period = period;
+		}
+	}
+
+	*confidence = (best_score < 0) ? 0 : best_score;
+	return best_period;
+}
@@ -0,0 +1,48 @@
+// Functions related to loading sprite sheet image data.
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lodepng.h"
+
+// Loads fname and decodes it as 8-bit indexed color; one pixel is one byte.
+// state is initialized, and holds the palette once loading has completed.
+// Free after usage. NULL on error.
+uint8_t *load_png_data(const char *fname,
+                       unsigned int *png_w, unsigned int *png_h,
+                       LodePNGState *state);
+
+// Decodes the PNG held in png as 8-bit indexed color into *buf, which is grown
+// to fit as needed, with *buf_size tracking its capacity. The buffer belongs to
+// the caller, and can be passed again for the next image so that a series of
+// images costs only one allocation, for the largest of them.
+// state is initialized, and holds the palette once decoding has completed.
+// Returns false on error.
+bool decode_png_into(const uint8_t *png, size_t png_size,
+                     uint8_t **buf, size_t *buf_size,
+                     unsigned int *png_w, unsigned int *png_h,
+                     LodePNGState *state);
+
+// Same as decode_png_into, loading the PNG from fname first.
+bool load_png_into(const char *fname, uint8_t **buf, size_t *buf_size,
+                   unsigned int *png_w, unsigned int *png_h,
+                   LodePNGState *state);
+
+// Returns true if the first 16 palette entries of two decoded images match.
+bool palettes_match(const LodePNGState *a, const LodePNGState *b);
+
+// Counts the opaque pixels in every column and every row of imgdat in a single
+// pass. cols holds iw entries, and rows holds ih entries.
+void image_projections(const uint8_t *imgdat, int iw, int ih,
+                       uint32_t *cols, uint32_t *rows);
+
+// Infers the frame size along one axis of a sheet from its projection, by
+// finding the cell size that best divides the runs of opaque pixels into
+// separate cells, without any run crossing a cell boundary. confidence is set
+// to a 0-100 score for the result.
+int detect_grid_period(const uint32_t *proj, int len, int *confidence);
+
+#endif  // IMAGE_H
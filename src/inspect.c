@@ -0,0 +1,357 @@
+#include "inspect.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mapfile.h"
+#include "records.h"
+#include "types.h"
+#include "util.h"
+
+#define REF_ENTRY_BYTES 8
+#define FRM_ENTRY_BYTES 8
+#define PCG_PATTERN_BYTES 128
+
+// A bank as it lies in the mapped files. Nothing is copied out of them.
+typedef struct Bank
+{
+	ConvMode mode;
+	const uint8_t *ref;
+	const uint8_t *frm;
+	const uint8_t *pal;  // NULL if there is no palette.
+	int ref_count;
+	uint32_t frm_bytes;
+	int pcg_count;
+
+	// Mappings to release afterwards.
+	const uint8_t *map[4];
+	size_t map_size[4];
+	int map_count;
+} Bank;
+
+// For each pattern, the number of REF entries using it, and the last REF entry
+// that was counted, plus one.
+static uint32_t s_pt_frames[PCG_PT_MAX_COUNT];
+static uint32_t s_pt_last_ref[PCG_PT_MAX_COUNT];
+
+static const uint8_t *bank_map(Bank *bank, const char *fname, size_t *size)
+{
+	const uint8_t *ret = map_file(fname, size);
+	if (!ret)
+	{
+		printf("Couldn't open %s.\n", fname);
+		return NULL;
+	}
+	bank->map[bank->map_count] = ret;
+	bank->map_size[bank->map_count] = *size;
+	bank->map_count++;
+	return ret;
+}
+
+static void bank_unmap(Bank *bank)
+{
+	for (int i = 0; i < bank->map_count; i++)
+	{
+		unmap_file(bank->map[i], bank->map_size[i]);
+	}
+	bank->map_count = 0;
+}
+
+static bool bank_open_xsb(Bank *bank, const char *fname)
+{
+	size_t size;
+	const uint8_t *dat = bank_map(bank, fname, &size);
+	if (!dat) return false;
+	if (size < sizeof(XSBHeader))
+	{
+		printf("%s is too small for an XSB header.\n", fname);
+		return false;
+	}
+
+	const XSBHeader *header = (const XSBHeader *)dat;
+	bank->mode = get_uint16be((const uint8_t *)&header->type) == 0 ?
+	             CONV_MODE_XOBJ : CONV_MODE_SP;
+	bank->ref_count = get_uint16be((const uint8_t *)&header->ref_count);
+	bank->frm_bytes = get_uint16be((const uint8_t *)&header->frm_bytes);
+	bank->pcg_count = get_uint16be((const uint8_t *)&header->pcg_count);
+	bank->pal = (const uint8_t *)header->pal;
+	if (bank->mode == CONV_MODE_SP)
+	{
+		bank->ref_count = 0;
+		bank->frm_bytes = 0;
+	}
+
+	const uint32_t ref_offs = get_uint32be((const uint8_t *)&header->ref_offs);
+	const uint32_t frm_offs = get_uint32be((const uint8_t *)&header->frm_offs);
+	const uint32_t pcg_offs = get_uint32be((const uint8_t *)&header->pcg_offs);
+	if ((uint64_t)ref_offs + (REF_ENTRY_BYTES * bank->ref_count) > size ||
+	    (uint64_t)frm_offs + bank->frm_bytes > size ||
+	    (uint64_t)pcg_offs + (PCG_PATTERN_BYTES * bank->pcg_count) > size)
+	{
+		printf("%s is truncated.\n", fname);
+		return false;
+	}
+	bank->ref = dat + ref_offs;
+	bank->frm = dat + frm_offs;
+	return true;
+}
+
+static bool bank_open_set(Bank *bank, const char *fname, const char *ext)
+{
+	// Siblings are named the way record_complete() names them.
+	char sibling[256];
+	const int base_len = (int)(ext - fname);
+	size_t size;
+	bank->mode = (strcasecmp(ext, ".SP") == 0) ? CONV_MODE_SP : CONV_MODE_XOBJ;
+
+	snprintf(sibling, sizeof(sibling), "%.*s%s", base_len, fname,
+	         bank->mode == CONV_MODE_SP ? ".SP" : ".XSP");
+	if (!bank_map(bank, sibling, &size)) return false;
+	bank->pcg_count = size / PCG_PATTERN_BYTES;
+
+	snprintf(sibling, sizeof(sibling), "%.*s.PAL", base_len, fname);
+	bank->pal = map_file(sibling, &size);
+	if (bank->pal)
+	{
+		bank->map[bank->map_count] = bank->pal;
+		bank->map_size[bank->map_count] = size;
+		bank->map_count++;
+		if (size < 32) bank->pal = NULL;
+	}
+
+	if (bank->mode == CONV_MODE_SP) return true;
+
+	snprintf(sibling, sizeof(sibling), "%.*s.REF", base_len, fname);
+	bank->ref = bank_map(bank, sibling, &size);
+	if (!bank->ref) return false;
+	bank->ref_count = size / REF_ENTRY_BYTES;
+
+	snprintf(sibling, sizeof(sibling), "%.*s.FRM", base_len, fname);
+	bank->frm = bank_map(bank, sibling, &size);
+	if (!bank->frm) return false;
+	bank->frm_bytes = size;
+	return true;
+}
+
+// Returns the FRM entries of REF entry idx, and their count in sp_count.
+// NULL if the entry points outside of the FRM data.
+static const uint8_t *ref_frm(const Bank *bank, int idx, int *sp_count,
+                              uint32_t *frm_offs)
+{
+	const uint8_t *ref = &bank->ref[idx * REF_ENTRY_BYTES];
+	*sp_count = get_uint16be(ref);
+	*frm_offs = get_uint32be(ref + 2);
+	if ((uint64_t)*frm_offs + ((uint64_t)*sp_count * FRM_ENTRY_BYTES) >
+	    bank->frm_bytes)
+	{
+		return NULL;
+	}
+	return &bank->frm[*frm_offs];
+}
+
+static void print_frame(const Bank *bank, int idx)
+{
+	int sp_count;
+	uint32_t frm_offs;
+	const uint8_t *frm = ref_frm(bank, idx, &sp_count, &frm_offs);
+	if (!frm)
+	{
+		printf("REF %5d: FRM offset $%06X is out of range\n", idx, frm_offs);
+		return;
+	}
+
+	// Positions are relative to the previous sprite, and mark its center.
+	int vx = 0;
+	int vy = 0;
+	int left = 0, top = 0, right = 0, bottom = 0;
+	int patterns = 0;
+	int shared = 0;
+	for (int i = 0; i < sp_count; i++)
+	{
+		const uint8_t *entry = &frm[i * FRM_ENTRY_BYTES];
+		vx += (int16_t)get_uint16be(entry);
+		vy += (int16_t)get_uint16be(entry + 2);
+		const int sl = vx - (PCG_TILE_PX / 2);
+		const int st = vy - (PCG_TILE_PX / 2);
+		if (i == 0 || sl < left) left = sl;
+		if (i == 0 || st < top) top = st;
+		if (i == 0 || sl + PCG_TILE_PX > right) right = sl + PCG_TILE_PX;
+		if (i == 0 || st + PCG_TILE_PX > bottom) bottom = st + PCG_TILE_PX;
+
+		// Patterns are counted once per frame, on their first use in it.
+		const int pt = (int16_t)get_uint16be(entry + 4);
+		if (pt < 0 || pt >= PCG_PT_MAX_COUNT) continue;
+		bool seen = false;
+		for (int j = 0; j < i && !seen; j++)
+		{
+			seen = get_uint16be(&frm[(j * FRM_ENTRY_BYTES) + 4]) == pt;
+		}
+		if (seen) continue;
+		patterns++;
+		if (s_pt_frames[pt] > 1) shared++;
+	}
+	printf("REF %5d: %3d sprites at FRM $%06X, %3d patterns (%d shared), "
+	       "extents (%d, %d) - (%d, %d)\n", idx, sp_count, frm_offs, patterns,
+	       shared, left, top, right, bottom);
+}
+
+static bool inspect_frames(const Bank *bank, bool frames)
+{
+	memset(s_pt_frames, 0, sizeof(s_pt_frames));
+	memset(s_pt_last_ref, 0, sizeof(s_pt_last_ref));
+
+	// REF entries that point to FRM data already used by an earlier one share
+	// it, as repeated animation frames do. Their patterns are counted once.
+	const uint32_t frm_entries = bank->frm_bytes / FRM_ENTRY_BYTES;
+	uint8_t *frm_used = calloc((frm_entries / 8) + 1, 1);
+	if (!frm_used)
+	{
+		printf("Couldn't allocate FRM usage map.\n");
+		return false;
+	}
+
+	int bad_refs = 0;
+	int shared_refs = 0;
+	int empty_refs = 0;
+	uint32_t sprites = 0;
+	int max_sprites = 0;
+	int max_ref = -1;
+	int outside = 0;
+	for (int i = 0; i < bank->ref_count; i++)
+	{
+		int sp_count;
+		uint32_t frm_offs;
+		const uint8_t *frm = ref_frm(bank, i, &sp_count, &frm_offs);
+		if (!frm)
+		{
+			bad_refs++;
+			continue;
+		}
+		sprites += sp_count;
+		if (sp_count > max_sprites)
+		{
+			max_sprites = sp_count;
+			max_ref = i;
+		}
+		if (sp_count == 0)
+		{
+			empty_refs++;
+			continue;
+		}
+		const uint32_t first = frm_offs / FRM_ENTRY_BYTES;
+		if (frm_used[first / 8] & (1 << (first % 8)))
+		{
+			shared_refs++;
+			continue;
+		}
+		frm_used[first / 8] |= 1 << (first % 8);
+
+		for (int j = 0; j < sp_count; j++)
+		{
+			const int pt = (int16_t)get_uint16be(&frm[(j * FRM_ENTRY_BYTES) + 4]);
+			if (pt < 0 || pt >= PCG_PT_MAX_COUNT) continue;
+			if (pt >= bank->pcg_count) outside++;
+			if (s_pt_last_ref[pt] == (uint32_t)i + 1) continue;
+			s_pt_last_ref[pt] = i + 1;
+			s_pt_frames[pt]++;
+		}
+	}
+	free(frm_used);
+
+	int used = 0;
+	int shared = 0;
+	for (int i = 0; i < bank->pcg_count && i < PCG_PT_MAX_COUNT; i++)
+	{
+		if (s_pt_frames[i] > 0) used++;
+		if (s_pt_frames[i] > 1) shared++;
+	}
+
+	if (frames)
+	{
+		for (int i = 0; i < bank->ref_count; i++) print_frame(bank, i);
+		printf("--------------------\n");
+	}
+
+	printf("REF:\t%d frames", bank->ref_count);
+	if (shared_refs > 0) printf(", %d sharing FRM data", shared_refs);
+	if (empty_refs > 0) printf(", %d empty", empty_refs);
+	printf("\n");
+	printf("FRM:\t%u sprites", bank->frm_bytes / FRM_ENTRY_BYTES);
+	if (bank->ref_count > 0)
+	{
+		printf(", %.1f per frame", (double)sprites / bank->ref_count);
+	}
+	if (max_ref >= 0) printf(", at most %d (REF %d)", max_sprites, max_ref);
+	printf("\n");
+	printf("PCG:\t%d patterns, %d used, %d shared between frames, %d unused\n",
+	       bank->pcg_count, used, shared, bank->pcg_count - used);
+	if (outside > 0)
+	{
+		printf("Linked:\t%d sprites use patterns beyond this bank\n", outside);
+	}
+	if (bad_refs > 0)
+	{
+		printf("Error:\t%d REF entries point outside of the FRM data\n",
+		       bad_refs);
+	}
+	return bad_refs == 0;
+}
+
+bool inspect_bank(const char *fname, bool frames)
+{
+	Bank bank;
+	memset(&bank, 0, sizeof(bank));
+	bool ret = false;
+
+	const char *ext = strrchr(fname, '.');
+	if (ext && strchr(ext, '/')) ext = NULL;
+	if (!ext)
+	{
+		printf("Can't tell the kind of bank %s is from its name.\n", fname);
+		return false;
+	}
+
+	const bool bundle = (strcasecmp(ext, ".XSB") == 0);
+	if (bundle)
+	{
+		if (!bank_open_xsb(&bank, fname)) goto done;
+	}
+	else if (strcasecmp(ext, ".XSP") == 0 || strcasecmp(ext, ".SP") == 0 ||
+	         strcasecmp(ext, ".FRM") == 0 || strcasecmp(ext, ".REF") == 0)
+	{
+		if (!bank_open_set(&bank, fname, ext)) goto done;
+	}
+	else
+	{
+		printf("%s is not an XSB, XSP, SP, FRM, or REF file.\n", fname);
+		goto done;
+	}
+
+	printf("Bank: %s (%s%s)\n", fname, bundle ? "bundle, " : "",
+	       bank.mode == CONV_MODE_XOBJ ? "XOBJ" : "SP");
+	printf("--------------------\n");
+	if (bank.mode == CONV_MODE_XOBJ)
+	{
+		if (!inspect_frames(&bank, frames)) goto done;
+	}
+	else
+	{
+		printf("PCG:\t%d patterns\n", bank.pcg_count);
+	}
+	if (bank.pal)
+	{
+		printf("PAL:\t");
+		for (int i = 0; i < 16; i++)
+		{
+			printf("%04X%s", get_uint16be(&bank.pal[i * 2]), i < 15 ? " " : "\n");
+		}
+	}
+	ret = true;
+
+done:
+	bank_unmap(&bank);
+	return ret;
+}
@@ -0,0 +1,17 @@
+// Inspection of previously emitted banks, without converting anything.
+#ifndef INSPECT_H
+#define INSPECT_H
+
+#include <stdbool.h>
+
+// Prints a summary of the bank named by fname: an XSB bundle, or any one of
+// the XSP, FRM, and REF files of a set, whose siblings are found by swapping
+// the extension. The files are mapped rather than read, and the REF and FRM
+// tables are decoded in place, so pattern data is never touched.
+// If frames is true, a line is printed for every REF entry as well, with its
+// sprite count, FRM offset, extents, and how many of its patterns are shared
+// with other frames.
+// Returns true if the bank could be inspected.
+bool inspect_bank(const char *fname, bool frames);
+
+#endif  // INSPECT_H
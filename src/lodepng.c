@@ -4334,6 +4334,77 @@ static void removePaddingBits(unsigned char* out, const unsigned char* in,
 /*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
 the IDAT chunks (with filter index bytes and possible padding bits)
 return value is error*/
+/*png2xsp: Adam7 images with 4 or 8-bit palette indices, requested as 8-bit
+palette indices with no palette of their own, are deinterlaced straight into
+the final image with byte operations, skipping the bit-level deinterlace and
+the per-pixel palette conversion that would otherwise follow it. Indices come
+out as that conversion would give them.*/
+static unsigned adam7_palette8_applies(const LodePNGState* state) {
+  const LodePNGColorMode* png = &state->info_png.color;
+  const LodePNGColorMode* raw = &state->info_raw;
+  return state->decoder.color_convert && state->info_png.interlace_method == 1 &&
+         png->colortype == LCT_PALETTE && (png->bitdepth == 4 || png->bitdepth == 8) &&
+         raw->colortype == LCT_PALETTE && raw->bitdepth == 8 && raw->palettesize == 0;
+}
+
+static unsigned postProcessAdam7Palette8(unsigned char* out, unsigned char* in,
+                                         unsigned w, unsigned h, const LodePNGColorMode* png) {
+  const unsigned bpp = png->bitdepth;
+  unsigned passw[7], passh[7]; size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned i;
+  unsigned char widen[16];
+  unsigned unlisted = 0, used = 0; /*bit sets of 4-bit indices*/
+
+  /*8-bit indices are kept as they are, as lodepng_convert copies them. 4-bit
+  ones are widened the way it does through its color tree: to the last palette
+  index with the same RGBA, and an index past the palette reads the black of an
+  unused entry, which is an error if that isn't listed*/
+  if(bpp == 4) {
+    if(!png->palette) return 107;
+    for(i = 0; i != 16; ++i) {
+      size_t j;
+      widen[i] = 0;
+      unlisted |= 1u << i;
+      for(j = 0; j != png->palettesize; ++j) {
+        const unsigned char* a = &png->palette[j * 4];
+        const unsigned char* b = &png->palette[i * 4];
+        if(a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3]) {
+          widen[i] = (unsigned char)j;
+          unlisted &= ~(1u << i);
+        }
+      }
+    }
+  }
+
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+
+  for(i = 0; i != 7; ++i) {
+    unsigned x, y;
+    const size_t linebytes = (passw[i] * bpp + 7u) / 8u;
+    CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp));
+    /*unfiltered scanlines are left padded to whole bytes, so are read in place*/
+    for(y = 0; y < passh[i]; ++y) {
+      const unsigned char* line = &in[padded_passstart[i] + y * linebytes];
+      unsigned char* dest = &out[(ADAM7_IY[i] + (size_t)y * ADAM7_DY[i]) * (size_t)w + ADAM7_IX[i]];
+      if(bpp == 8) {
+        for(x = 0; x < passw[i]; ++x) dest[x * ADAM7_DX[i]] = line[x];
+      } else {
+        for(x = 0; x + 1 < passw[i]; x += 2) {
+          const unsigned char b = line[x >> 1];
+          used |= (1u << (b >> 4)) | (1u << (b & 15));
+          dest[x * ADAM7_DX[i]] = widen[b >> 4];
+          dest[(x + 1) * ADAM7_DX[i]] = widen[b & 15];
+        }
+        if(x < passw[i]) {
+          used |= 1u << (line[x >> 1] >> 4);
+          dest[x * ADAM7_DX[i]] = widen[line[x >> 1] >> 4];
+        }
+      }
+    }
+  }
+  return (used & unlisted) ? 82 : 0; /*color not in palette*/
+}
+
 static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
                                      unsigned w, unsigned h, const LodePNGInfo* info_png) {
   /*
@@ -4827,10 +4898,24 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
   return error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+/*png2xsp: true if the image decodeGeneric produces is already in the requested
+raw format, so it can be handed out without a conversion pass. 8-bit palette
+indices requested with no palette of their own would only be copied as-is.*/
+static unsigned decode_is_direct(const LodePNGState* state) {
+  const LodePNGColorMode* png = &state->info_png.color;
+  const LodePNGColorMode* raw = &state->info_raw;
+  if(adam7_palette8_applies(state)) return 1;
+  if(!state->decoder.color_convert || lodepng_color_mode_equal(raw, png)) return 1;
+  return png->colortype == LCT_PALETTE && png->bitdepth == 8 &&
+         raw->colortype == LCT_PALETTE && raw->bitdepth == 8 && raw->palettesize == 0;
+}
+
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")
+png2xsp: if into is given, the image is decoded into it rather than a new allocation*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
-                          const unsigned char* in, size_t insize) {
+                          const unsigned char* in, size_t insize,
+                          unsigned char* into, size_t intosize) {
   unsigned char IEND = 0;
   const unsigned char* chunk; /*points to beginning of next chunk*/
   unsigned char* idat; /*the data from idat chunks, zlib compressed*/
@@ -5015,12 +5100,21 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   lodepng_free(idat);
 
   if(!state->error) {
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
+    outsize = lodepng_get_raw_size(*w, *h, adam7_palette8_applies(state) ? &state->info_raw : &state->info_png.color);
+    if(into) {
+      if(intosize < outsize) state->error = 116; /*caller's buffer too small*/
+      else *out = into;
+    } else {
+      *out = (unsigned char*)lodepng_malloc(outsize);
+      if(!*out) state->error = 83; /*alloc fail*/
+    }
   }
-  if(!state->error) {
-    lodepng_memset(*out, 0, outsize);
+  if(!state->error && adam7_palette8_applies(state)) {
+    state->error = postProcessAdam7Palette8(*out, scanlines, *w, *h, &state->info_png.color);
+  } else if(!state->error) {
+    /*png2xsp: whole-byte pixels are all written by unfiltering or deinterlacing,
+    so only packed pixels need the image cleared first*/
+    if(lodepng_get_bpp(&state->info_png.color) < 8) lodepng_memset(*out, 0, outsize);
     state->error = postProcessScanlines(*out, scanlines, *w, *h, &state->info_png);
   }
   lodepng_free(scanlines);
@@ -5030,9 +5124,9 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize) {
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
+  decodeGeneric(out, w, h, state, in, insize, 0, 0);
   if(state->error) return state->error;
-  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
+  if(decode_is_direct(state)) {
     /*same color type, no copying or converting of data needed*/
     /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
     the raw image has to the end user*/
@@ -5063,6 +5157,39 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
   return state->error;
 }
 
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize) {
+  unsigned char* data = 0;
+  unsigned direct;
+  state->error = lodepng_inspect(w, h, state, in, insize);
+  if(state->error) return state->error;
+  if(outsize < lodepng_get_raw_size(*w, *h, state->decoder.color_convert ? &state->info_raw
+                                                                         : &state->info_png.color)) {
+    return (state->error = 116); /*caller's buffer too small*/
+  }
+
+  /*the palette isn't known yet, so this only errs towards converting*/
+  direct = decode_is_direct(state);
+  decodeGeneric(&data, w, h, state, in, insize, direct ? out : 0, outsize);
+  if(state->error) {
+    if(data != out) lodepng_free(data);
+    return state->error;
+  }
+  if(!state->decoder.color_convert) {
+    state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  } else if(!direct) {
+    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8)) {
+      state->error = 56; /*unsupported color mode conversion*/
+    }
+    else state->error = lodepng_convert(out, data, &state->info_raw,
+                                        &state->info_png.color, *w, *h);
+    lodepng_free(data);
+  }
+  return state->error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -6452,6 +6579,8 @@ const char* lodepng_error_text(unsigned code) {
     case 113: return "ICC profile unreasonably large";
     case 114: return "sBIT chunk has wrong size for the color type of the image";
     case 115: return "sBIT value out of range";
+    /*png2xsp: lodepng_decode_into*/
+    case 116: return "output buffer is too small for the decoded image";
   }
   return "unknown error code";
 }
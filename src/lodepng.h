@@ -879,6 +879,16 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+png2xsp: Same as lodepng_decode, but decodes into out, a caller-owned buffer of
+outsize bytes, rather than allocating the image. The dimensions are read with
+lodepng_inspect first, and error 116 is returned if the image won't fit. When
+no color conversion is needed, no intermediate image is allocated either.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize);
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the IHDR chunk of the PNG, such as width, height and color type. The
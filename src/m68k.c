@@ -0,0 +1,630 @@
+#include "m68k.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define ADDRESS_MASK 0xFFFFFF
+
+// Return address pushed by m68k_call(); the routine is done once it is popped.
+#define RETURN_SENTINEL 0xFFFFF0
+
+#define CCR_C 0x01
+#define CCR_V 0x02
+#define CCR_Z 0x04
+#define CCR_N 0x08
+#define CCR_X 0x10
+
+typedef enum OperandKind
+{
+	OPERAND_D,
+	OPERAND_A,
+	OPERAND_MEM,
+	OPERAND_IMM,
+} OperandKind;
+
+typedef struct Operand
+{
+	OperandKind kind;
+	int reg;
+	uint32_t addr;
+	uint32_t imm;
+} Operand;
+
+static void fault(M68k *cpu, const char *text, uint32_t val)
+{
+	if (cpu->fault) return;
+	cpu->fault = true;
+	snprintf(cpu->fault_text, sizeof(cpu->fault_text), "%s $%06X (PC $%06X)",
+	         text, val, cpu->pc);
+}
+
+//
+// Memory.
+//
+
+static uint8_t *mem_ptr(M68k *cpu, uint32_t addr, int bytes)
+{
+	addr &= ADDRESS_MASK;
+	if (bytes > 1 && (addr & 1))
+	{
+		fault(cpu, "Address error at", addr);
+		return NULL;
+	}
+	for (int i = 0; i < cpu->region_count; i++)
+	{
+		const M68kRegion *region = &cpu->regions[i];
+		if (addr >= region->base && addr - region->base + bytes <= region->size)
+		{
+			return &region->dat[addr - region->base];
+		}
+	}
+	fault(cpu, "Bus error at", addr);
+	return NULL;
+}
+
+static uint32_t mem_read(M68k *cpu, uint32_t addr, int bytes)
+{
+	const uint8_t *p = mem_ptr(cpu, addr, bytes);
+	if (!p) return 0;
+	uint32_t val = 0;
+	for (int i = 0; i < bytes; i++) val = (val << 8) | p[i];
+	return val;
+}
+
+static void mem_write(M68k *cpu, uint32_t addr, int bytes, uint32_t val)
+{
+	uint8_t *p = mem_ptr(cpu, addr, bytes);
+	if (!p) return;
+	for (int i = bytes - 1; i >= 0; i--)
+	{
+		p[i] = val & 0xFF;
+		val >>= 8;
+	}
+}
+
+static uint16_t fetch16(M68k *cpu)
+{
+	const uint16_t val = mem_read(cpu, cpu->pc, 2);
+	cpu->pc = (cpu->pc + 2) & ADDRESS_MASK;
+	return val;
+}
+
+static uint32_t fetch32(M68k *cpu)
+{
+	const uint32_t hi = fetch16(cpu);
+	return (hi << 16) | fetch16(cpu);
+}
+
+//
+// Operands.
+//
+
+static uint32_t size_mask(int bytes)
+{
+	return (bytes == 4) ? 0xFFFFFFFF : (1U << (8 * bytes)) - 1;
+}
+
+static uint32_t sign_extend(uint32_t val, int bytes)
+{
+	if (bytes == 1) return (uint32_t)(int32_t)(int8_t)val;
+	if (bytes == 2) return (uint32_t)(int32_t)(int16_t)val;
+	return val;
+}
+
+// Effective address calculation time, from the manual's table.
+static int ea_cycles(int mode, int reg, int bytes)
+{
+	static const int k_word[8] = {0, 0, 4, 4, 6, 8, 10, 0};
+	static const int k_mode7_word[5] = {8, 12, 8, 10, 4};
+	int cycles = (mode == 7) ? ((reg < 5) ? k_mode7_word[reg] : 0) : k_word[mode];
+	if (bytes == 4 && (mode >= 2)) cycles += 4;
+	return cycles;
+}
+
+// Resolves an effective address, consuming its extension words, and stepping
+// the register for (An)+ and -(An). Returns false if the mode isn't supported.
+static bool resolve(M68k *cpu, int mode, int reg, int bytes, Operand *op)
+{
+	// Byte accesses through the stack pointer keep it even.
+	const int step = (bytes == 1 && reg == 7) ? 2 : bytes;
+	switch (mode)
+	{
+		case 0:
+			op->kind = OPERAND_D;
+			op->reg = reg;
+			return true;
+		case 1:
+			op->kind = OPERAND_A;
+			op->reg = reg;
+			return true;
+		case 2:
+			op->kind = OPERAND_MEM;
+			op->addr = cpu->a[reg];
+			return true;
+		case 3:
+			op->kind = OPERAND_MEM;
+			op->addr = cpu->a[reg];
+			cpu->a[reg] += step;
+			return true;
+		case 4:
+			cpu->a[reg] -= step;
+			op->kind = OPERAND_MEM;
+			op->addr = cpu->a[reg];
+			return true;
+		case 5:
+			op->kind = OPERAND_MEM;
+			op->addr = cpu->a[reg] + (int16_t)fetch16(cpu);
+			return true;
+		case 6:
+		{
+			const uint16_t ext = fetch16(cpu);
+			const int xreg = (ext >> 12) & 7;
+			uint32_t index = (ext & 0x8000) ? cpu->a[xreg] : cpu->d[xreg];
+			if (!(ext & 0x0800)) index = sign_extend(index, 2);
+			op->kind = OPERAND_MEM;
+			op->addr = cpu->a[reg] + index + (int8_t)(ext & 0xFF);
+			return true;
+		}
+		case 7:
+			if (reg == 0)
+			{
+				op->kind = OPERAND_MEM;
+				op->addr = sign_extend(fetch16(cpu), 2);
+				return true;
+			}
+			if (reg == 1)
+			{
+				op->kind = OPERAND_MEM;
+				op->addr = fetch32(cpu);
+				return true;
+			}
+			if (reg == 4)
+			{
+				op->kind = OPERAND_IMM;
+				op->imm = (bytes == 4) ? fetch32(cpu) : (fetch16(cpu) & size_mask(bytes));
+				return true;
+			}
+			return false;
+	}
+	return false;
+}
+
+static uint32_t operand_read(M68k *cpu, const Operand *op, int bytes)
+{
+	switch (op->kind)
+	{
+		case OPERAND_D: return cpu->d[op->reg] & size_mask(bytes);
+		case OPERAND_A: return cpu->a[op->reg] & size_mask(bytes);
+		case OPERAND_MEM: return mem_read(cpu, op->addr, bytes);
+		case OPERAND_IMM: return op->imm;
+	}
+	return 0;
+}
+
+static void operand_write(M68k *cpu, const Operand *op, int bytes, uint32_t val)
+{
+	const uint32_t mask = size_mask(bytes);
+	switch (op->kind)
+	{
+		case OPERAND_D:
+			cpu->d[op->reg] = (cpu->d[op->reg] & ~mask) | (val & mask);
+			break;
+		case OPERAND_A:
+			cpu->a[op->reg] = sign_extend(val & mask, bytes);
+			break;
+		case OPERAND_MEM:
+			mem_write(cpu, op->addr, bytes, val);
+			break;
+		case OPERAND_IMM:
+			fault(cpu, "Write to an immediate at", cpu->pc);
+			break;
+	}
+}
+
+//
+// Condition codes.
+//
+
+static void set_nz(M68k *cpu, uint32_t val, int bytes)
+{
+	val &= size_mask(bytes);
+	cpu->ccr &= ~(CCR_N | CCR_Z | CCR_V | CCR_C);
+	if (val == 0) cpu->ccr |= CCR_Z;
+	if (val & (1U << (8 * bytes - 1))) cpu->ccr |= CCR_N;
+}
+
+// Flags for dst + src (or dst - src) giving res. X is set along with C unless
+// the operation is a compare.
+static void set_arith(M68k *cpu, uint32_t src, uint32_t dst, uint32_t res,
+                      int bytes, bool sub, bool set_x)
+{
+	const uint32_t msb = 1U << (8 * bytes - 1);
+	set_nz(cpu, res, bytes);
+	const bool sm = src & msb;
+	const bool dm = dst & msb;
+	const bool rm = res & msb;
+	bool carry, overflow;
+	if (sub)
+	{
+		carry = (sm && !dm) || (rm && !dm) || (sm && rm);
+		overflow = (!sm && dm && !rm) || (sm && !dm && rm);
+	}
+	else
+	{
+		carry = (sm && dm) || (!rm && dm) || (sm && !rm);
+		overflow = (sm && dm && !rm) || (!sm && !dm && rm);
+	}
+	if (carry) cpu->ccr |= CCR_C;
+	if (overflow) cpu->ccr |= CCR_V;
+	if (set_x) cpu->ccr = (cpu->ccr & ~CCR_X) | (carry ? CCR_X : 0);
+}
+
+static bool condition(const M68k *cpu, int cc)
+{
+	const bool c = cpu->ccr & CCR_C;
+	const bool v = cpu->ccr & CCR_V;
+	const bool z = cpu->ccr & CCR_Z;
+	const bool n = cpu->ccr & CCR_N;
+	switch (cc)
+	{
+		case 0x0: return true;
+		case 0x1: return false;
+		case 0x2: return !c && !z;
+		case 0x3: return c || z;
+		case 0x4: return !c;
+		case 0x5: return c;
+		case 0x6: return !z;
+		case 0x7: return z;
+		case 0x8: return !v;
+		case 0x9: return v;
+		case 0xA: return !n;
+		case 0xB: return n;
+		case 0xC: return n == v;
+		case 0xD: return n != v;
+		case 0xE: return !z && (n == v);
+		case 0xF: return z || (n != v);
+	}
+	return false;
+}
+
+//
+// Instructions.
+//
+
+static const int k_size_bytes[4] = {1, 2, 4, 0};
+
+static void op_move(M68k *cpu, uint16_t opcode)
+{
+	static const int k_move_bytes[4] = {0, 1, 4, 2};
+	const int bytes = k_move_bytes[(opcode >> 12) & 3];
+	const int src_mode = (opcode >> 3) & 7;
+	const int src_reg = opcode & 7;
+	const int dst_reg = (opcode >> 9) & 7;
+	const int dst_mode = (opcode >> 6) & 7;
+	Operand src, dst;
+	if (!resolve(cpu, src_mode, src_reg, bytes, &src))
+	{
+		fault(cpu, "Unsupported source mode in", opcode);
+		return;
+	}
+	const uint32_t val = operand_read(cpu, &src, bytes);
+	if (!resolve(cpu, dst_mode, dst_reg, bytes, &dst) || dst.kind == OPERAND_IMM)
+	{
+		fault(cpu, "Unsupported destination mode in", opcode);
+		return;
+	}
+	// -(An) as a destination costs no more than (An).
+	cpu->cycles += 4 + ea_cycles(src_mode, src_reg, bytes) +
+	               ea_cycles(dst_mode == 4 ? 2 : dst_mode, dst_reg, bytes);
+	if (dst.kind == OPERAND_A)
+	{
+		cpu->a[dst_reg] = sign_extend(val, bytes);  // MOVEA leaves the flags.
+		return;
+	}
+	operand_write(cpu, &dst, bytes, val);
+	const uint16_t x = cpu->ccr & CCR_X;
+	set_nz(cpu, val, bytes);
+	cpu->ccr |= x;
+}
+
+static void op_misc(M68k *cpu, uint16_t opcode)
+{
+	const int mode = (opcode >> 3) & 7;
+	const int reg = opcode & 7;
+	if (opcode == 0x4E75)  // RTS
+	{
+		cpu->pc = mem_read(cpu, cpu->a[7], 4) & ADDRESS_MASK;
+		cpu->a[7] += 4;
+		cpu->cycles += 16;
+		return;
+	}
+	if (opcode == 0x4E71)  // NOP
+	{
+		cpu->cycles += 4;
+		return;
+	}
+	if ((opcode & 0xF1C0) == 0x41C0)  // LEA
+	{
+		static const int k_lea_cycles[8] = {0, 0, 4, 0, 0, 8, 12, 0};
+		Operand op;
+		if ((mode != 2 && mode < 5) || !resolve(cpu, mode, reg, 4, &op) ||
+		    op.kind != OPERAND_MEM)
+		{
+			fault(cpu, "Unsupported LEA", opcode);
+			return;
+		}
+		cpu->a[(opcode >> 9) & 7] = op.addr & ADDRESS_MASK;
+		cpu->cycles += (mode == 7) ? ((reg == 1) ? 12 : 8) : k_lea_cycles[mode];
+		return;
+	}
+	const int size = (opcode >> 6) & 3;
+	const int bytes = k_size_bytes[size];
+	if ((opcode & 0xFF00) == 0x4200 && size != 3)  // CLR
+	{
+		Operand op;
+		if (!resolve(cpu, mode, reg, bytes, &op) || op.kind == OPERAND_A ||
+		    op.kind == OPERAND_IMM)
+		{
+			fault(cpu, "Unsupported CLR", opcode);
+			return;
+		}
+		operand_write(cpu, &op, bytes, 0);
+		const uint16_t x = cpu->ccr & CCR_X;
+		set_nz(cpu, 0, bytes);
+		cpu->ccr |= x;
+		if (op.kind == OPERAND_D) cpu->cycles += (bytes == 4) ? 6 : 4;
+		else cpu->cycles += ((bytes == 4) ? 12 : 8) + ea_cycles(mode, reg, bytes);
+		return;
+	}
+	if ((opcode & 0xFF00) == 0x4A00 && size != 3)  // TST
+	{
+		Operand op;
+		if (!resolve(cpu, mode, reg, bytes, &op) || op.kind == OPERAND_A)
+		{
+			fault(cpu, "Unsupported TST", opcode);
+			return;
+		}
+		const uint16_t x = cpu->ccr & CCR_X;
+		set_nz(cpu, operand_read(cpu, &op, bytes), bytes);
+		cpu->ccr |= x;
+		cpu->cycles += 4 + ea_cycles(mode, reg, bytes);
+		return;
+	}
+	fault(cpu, "Unimplemented instruction", opcode);
+}
+
+static void op_quick(M68k *cpu, uint16_t opcode)
+{
+	const int mode = (opcode >> 3) & 7;
+	const int reg = opcode & 7;
+	const int size = (opcode >> 6) & 3;
+	if (size == 3)
+	{
+		if (mode != 1)
+		{
+			fault(cpu, "Unimplemented instruction", opcode);
+			return;
+		}
+		// DBcc
+		const uint32_t pc = cpu->pc;
+		const int16_t disp = fetch16(cpu);
+		if (condition(cpu, (opcode >> 8) & 0xF))
+		{
+			cpu->cycles += 12;
+			return;
+		}
+		const uint16_t count = (cpu->d[reg] - 1) & 0xFFFF;
+		cpu->d[reg] = (cpu->d[reg] & 0xFFFF0000) | count;
+		if (count == 0xFFFF)
+		{
+			cpu->cycles += 14;
+			return;
+		}
+		cpu->pc = (pc + disp) & ADDRESS_MASK;
+		cpu->cycles += 10;
+		return;
+	}
+
+	// ADDQ / SUBQ
+	const bool sub = opcode & 0x0100;
+	const uint32_t data = ((opcode >> 9) & 7) ? ((opcode >> 9) & 7) : 8;
+	const int bytes = k_size_bytes[size];
+	if (mode == 1)
+	{
+		cpu->a[reg] += sub ? -data : data;  // Always whole register, no flags.
+		cpu->cycles += 8;
+		return;
+	}
+	Operand op;
+	if (!resolve(cpu, mode, reg, bytes, &op) || op.kind == OPERAND_IMM)
+	{
+		fault(cpu, "Unsupported ADDQ/SUBQ", opcode);
+		return;
+	}
+	const uint32_t dst = operand_read(cpu, &op, bytes);
+	const uint32_t res = (sub ? dst - data : dst + data) & size_mask(bytes);
+	operand_write(cpu, &op, bytes, res);
+	set_arith(cpu, data, dst, res, bytes, sub, true);
+	if (op.kind == OPERAND_D) cpu->cycles += (bytes == 4) ? 8 : 4;
+	else cpu->cycles += ((bytes == 4) ? 12 : 8) + ea_cycles(mode, reg, bytes);
+}
+
+static void op_branch(M68k *cpu, uint16_t opcode)
+{
+	const int cc = (opcode >> 8) & 0xF;
+	if (cc == 1)
+	{
+		fault(cpu, "Unimplemented instruction (BSR)", opcode);
+		return;
+	}
+	const uint32_t pc = cpu->pc;
+	int32_t disp = (int8_t)(opcode & 0xFF);
+	const bool word = disp == 0;
+	if (word) disp = (int16_t)fetch16(cpu);
+	if (condition(cpu, cc))
+	{
+		cpu->pc = (pc + disp) & ADDRESS_MASK;
+		cpu->cycles += 10;
+		return;
+	}
+	cpu->cycles += word ? 12 : 8;
+}
+
+// ADD, SUB, and CMP, with their address register forms.
+static void op_arith(M68k *cpu, uint16_t opcode)
+{
+	const int line = opcode >> 12;
+	const int dn = (opcode >> 9) & 7;
+	const int opmode = (opcode >> 6) & 7;
+	const int mode = (opcode >> 3) & 7;
+	const int reg = opcode & 7;
+	const bool sub = line != 0xD;
+	const bool cmp = line == 0xB;
+	const bool reg_src = mode <= 1 || (mode == 7 && reg == 4);
+
+	if (opmode == 3 || opmode == 7)  // ADDA / SUBA / CMPA
+	{
+		const int bytes = (opmode == 7) ? 4 : 2;
+		Operand src;
+		if (!resolve(cpu, mode, reg, bytes, &src))
+		{
+			fault(cpu, "Unsupported source mode in", opcode);
+			return;
+		}
+		const uint32_t val = sign_extend(operand_read(cpu, &src, bytes), bytes);
+		const int ea = ea_cycles(mode, reg, bytes);
+		if (cmp)
+		{
+			const uint32_t res = cpu->a[dn] - val;
+			const uint16_t x = cpu->ccr & CCR_X;
+			set_arith(cpu, val, cpu->a[dn], res, 4, true, false);
+			cpu->ccr = (cpu->ccr & ~CCR_X) | x;
+			cpu->cycles += 6 + ea;
+			return;
+		}
+		cpu->a[dn] += sub ? -val : val;
+		cpu->cycles += (bytes == 2) ? 8 + ea : (reg_src ? 8 : 6 + ea);
+		return;
+	}
+
+	const int bytes = k_size_bytes[opmode & 3];
+	if (cmp && opmode >= 4)
+	{
+		fault(cpu, "Unimplemented instruction (EOR/CMPM)", opcode);
+		return;
+	}
+	Operand op;
+	if (!resolve(cpu, mode, reg, bytes, &op) || (bytes == 1 && op.kind == OPERAND_A))
+	{
+		fault(cpu, "Unsupported mode in", opcode);
+		return;
+	}
+	const int ea = ea_cycles(mode, reg, bytes);
+	if (opmode < 4)  // <ea>, Dn
+	{
+		const uint32_t src = operand_read(cpu, &op, bytes);
+		const uint32_t dst = cpu->d[dn] & size_mask(bytes);
+		const uint32_t res = (sub ? dst - src : dst + src) & size_mask(bytes);
+		if (!cmp) cpu->d[dn] = (cpu->d[dn] & ~size_mask(bytes)) | res;
+		const uint16_t x = cpu->ccr & CCR_X;
+		set_arith(cpu, src, dst, res, bytes, sub, !cmp);
+		if (cmp) cpu->ccr = (cpu->ccr & ~CCR_X) | x;
+		if (bytes < 4) cpu->cycles += 4 + ea;
+		else if (cmp) cpu->cycles += 6 + ea;
+		else cpu->cycles += reg_src ? 8 : 6 + ea;
+		return;
+	}
+
+	// Dn, <ea>
+	if (op.kind != OPERAND_MEM)
+	{
+		fault(cpu, "Unimplemented instruction (ADDX/SUBX)", opcode);
+		return;
+	}
+	const uint32_t src = cpu->d[dn] & size_mask(bytes);
+	const uint32_t dst = operand_read(cpu, &op, bytes);
+	const uint32_t res = (sub ? dst - src : dst + src) & size_mask(bytes);
+	operand_write(cpu, &op, bytes, res);
+	set_arith(cpu, src, dst, res, bytes, sub, true);
+	cpu->cycles += ((bytes == 4) ? 12 : 8) + ea;
+}
+
+static void step(M68k *cpu)
+{
+	const uint16_t opcode = fetch16(cpu);
+	if (cpu->fault) return;
+	switch (opcode >> 12)
+	{
+		case 0x1:
+		case 0x2:
+		case 0x3:
+			op_move(cpu, opcode);
+			break;
+		case 0x4:
+			op_misc(cpu, opcode);
+			break;
+		case 0x5:
+			op_quick(cpu, opcode);
+			break;
+		case 0x6:
+			op_branch(cpu, opcode);
+			break;
+		case 0x7:
+			if (opcode & 0x0100)
+			{
+				fault(cpu, "Unimplemented instruction", opcode);
+				break;
+			}
+			cpu->d[(opcode >> 9) & 7] = sign_extend(opcode & 0xFF, 1);
+			{
+				const uint16_t x = cpu->ccr & CCR_X;
+				set_nz(cpu, cpu->d[(opcode >> 9) & 7], 4);
+				cpu->ccr |= x;
+			}
+			cpu->cycles += 4;
+			break;
+		case 0x9:
+		case 0xB:
+		case 0xD:
+			op_arith(cpu, opcode);
+			break;
+		default:
+			fault(cpu, "Unimplemented instruction", opcode);
+			break;
+	}
+}
+
+void m68k_init(M68k *cpu)
+{
+	memset(cpu, 0, sizeof(*cpu));
+}
+
+bool m68k_map(M68k *cpu, uint32_t base, uint8_t *dat, uint32_t size)
+{
+	if (cpu->region_count >= M68K_REGION_MAX) return false;
+	M68kRegion *region = &cpu->regions[cpu->region_count++];
+	region->base = base & ADDRESS_MASK;
+	region->size = size;
+	region->dat = dat;
+	return true;
+}
+
+bool m68k_call(M68k *cpu, uint32_t pc, uint64_t max_cycles)
+{
+	cpu->fault = false;
+	cpu->fault_text[0] = '\0';
+	cpu->cycles = 0;
+	cpu->a[7] -= 4;
+	mem_write(cpu, cpu->a[7], 4, RETURN_SENTINEL);
+	cpu->pc = pc & ADDRESS_MASK;
+	while (!cpu->fault && cpu->pc != RETURN_SENTINEL)
+	{
+		if (cpu->cycles > max_cycles)
+		{
+			fault(cpu, "Ran out of cycles at", cpu->pc);
+			break;
+		}
+		step(cpu);
+	}
+	return !cpu->fault;
+}
@@ -0,0 +1,54 @@
+// A small cycle-counting 68000 interpreter, for timing reference routines on
+// the host against real output data.
+//
+// Only what the routines in cost.c need is implemented: MOVE, MOVEA, MOVEQ,
+// LEA, CLR, TST, ADD, ADDA, ADDQ, SUB, SUBA, SUBQ, CMP, CMPA, Bcc, BRA, DBcc,
+// NOP and RTS, over every addressing mode but the PC relative ones. Cycles are
+// counted with the instruction timings of the MC68000 user's manual, with no
+// wait states. There are no exceptions; an unimplemented instruction, a bus
+// error, or an address error stops the routine with a fault.
+//
+// Memory is a set of mapped regions, each backed by a host buffer and held in
+// 68000 byte order. Addresses are 24 bits wide.
+#ifndef M68K_H
+#define M68K_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define M68K_REGION_MAX 16
+
+typedef struct M68kRegion
+{
+	uint32_t base;
+	uint32_t size;
+	uint8_t *dat;
+} M68kRegion;
+
+typedef struct M68k
+{
+	uint32_t d[8];
+	uint32_t a[8];  // a[7] is the stack pointer.
+	uint32_t pc;
+	uint16_t ccr;
+	uint64_t cycles;
+
+	M68kRegion regions[M68K_REGION_MAX];
+	int region_count;
+
+	bool fault;
+	char fault_text[80];
+} M68k;
+
+// Clears the registers and regions.
+void m68k_init(M68k *cpu);
+
+// Maps size bytes of dat at base. dat must outlive the CPU.
+bool m68k_map(M68k *cpu, uint32_t base, uint8_t *dat, uint32_t size);
+
+// Calls the routine at pc, with the registers as they are, and runs it until
+// it returns. cycles is cleared first. Returns false if the routine faulted
+// or ran for more than max_cycles; fault_text then says why.
+bool m68k_call(M68k *cpu, uint32_t pc, uint64_t max_cycles);
+
+#endif  // M68K_H
@@ -47,27 +47,57 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "lodepng.h"
 
 #include "types.h"
+#include "apng.h"
+#include "ase.h"
+#include "compose.h"
+#include "cost.h"
+#include "image.h"
+#include "inspect.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "passes.h"
+#include "patch.h"
 #include "records.h"
+#include "sheetcache.h"
+#include "snapshot.h"
 #include "util.h"
 
+// getopt() options, also used to tell options from inputs in manifest jobs.
+static const char k_options[] =
+    "?o:w:h:x:y:bemf:cia:l:ptI:M:j:O:T:W:C:v:D:n:P:U:A:";
+
+#define INPUT_MAX_COUNT 64
+#define ORIGIN_VARIANT_MAX_COUNT 16
+
 static void show_usage(const char *prog_name)
 {
-	printf("Usage: %s input.png <-o output> <-w width> <-h height> [-x xorigin] [-y yorigin] [-b]\n", prog_name);
+	printf("Usage: %s input.png [more.png ...] <-o output> <-w width> <-h height> [-x xorigin] [-y yorigin] [-b] [-e] [-m] [-f steps] [-c] [-i] [-a|-l bank] [-p] [-t] [-O level] [-T ms] [-W snapshot] [-C cache] [-v x,y ...] [-D spill] [-n frames] [-P metrics] [-U previous] [-A patch]\n", prog_name);
+	printf("       %s bank <-I summary|frames> [-t]\n", prog_name);
+	printf("       %s <-M manifest> [-j jobs]\n", prog_name);
 	printf("-o: Output file path (base)\n");
 	printf("    Specifies the base filepath for newly created file(s).\n");
 	printf("    For classic XOBJ use, multiple files are created with the\n");
 	printf("    extensions XSP/SP, FRM, REF, and PAL.\n");
 	printf("    When creating a bundle (see -b), the path is used directly.\n");
+	printf("    A path of the form shm:/name creates POSIX shared memory\n");
+	printf("    objects (such as /name.XSB) instead of files, for a local\n");
+	printf("    client to map read-only. -I and -a also accept them.\n");
+	printf("    The objects are made read-only once written, but this is\n");
+	printf("    advisory: they are not sealed, and any process of the same\n");
+	printf("    user can open them for writing again.\n");
 	printf("\n");
 	printf("-w, -h: Frame dimensions (pixels).\n");
 	printf("    Size of one frame within the spritesheet. Must be >= 1.\n");
 	printf("    If both parameters are <= 16, SP data is emitted, and\n");
 	printf("    REF/FRM data is not necessary.\n");
+	printf("    Either may be \"auto\" to infer it from the transparent\n");
+	printf("    gutters between frames in the sheet.\n");
 	printf("\n");
 	printf("-x, -y: Frame origin (pixels; center default\n");
 	printf("    Specifies the location within the frame to be treated as\n");
@@ -83,6 +113,131 @@ static void show_usage(const char *prog_name)
 	printf("    offsets to REF, FRM, and XSP within. This allows for one\n");
 	printf("    object set to be loaded from a single file.\n");
 	printf("\n");
+	printf("-e: Extents\n");
+	printf("    Emits a BOX file with one entry per REF. Each entry holds\n");
+	printf("    the tight bounds of the frame's opaque pixels and the\n");
+	printf("    area covered by its hardware sprites, relative to the\n");
+	printf("    origin, for use in culling and rough collision checks.\n");
+	printf("\n");
+	printf("-m: Masks\n");
+	printf("    Emits an MSK file holding a 1bpp opaque mask for every\n");
+	printf("    frame, cropped to the frame's opaque bounds and padded\n");
+	printf("    to whole 16-bit words per row for pixel collision tests.\n");
+	printf("\n");
+	printf("-f: Fade steps\n");
+	printf("    Emits a FAD file with palettes precomputed from PAL for a\n");
+	printf("    fade to black, a fade to white, and a negative flash, each\n");
+	printf("    over the specified number of steps (1 - 256).\n");
+	printf("\n");
+	printf("-c: Compose\n");
+	printf("    The input is read as a composition list rather than a\n");
+	printf("    PNG. Frames of several sheets are combined at the listed\n");
+	printf("    offsets into -w x -h frames, emitted as one object set.\n");
+	printf("    The list is made of lines like the following:\n");
+	printf("        part <name> <sheet.png> <frame width> <frame height>\n");
+	printf("        frame <name> <index> <x> <y> [<name> <index> <x> <y>...]\n");
+	printf("\n");
+	printf("-i: Index\n");
+	printf("    Emits a PXI file next to the pattern data, holding the\n");
+	printf("    pattern count and a hash of every pattern. It lets -a and\n");
+	printf("    -l seed their dictionary without re-hashing the bank.\n");
+	printf("\n");
+	printf("-a, -l: Append to or link against an existing bank (XSP or XSB)\n");
+	printf("    Patterns already present in the bank are reused.\n");
+	printf("    With -a, the output bank holds the existing patterns\n");
+	printf("    followed by the new ones.\n");
+	printf("    With -l, the bank is expected to be loaded ahead of the\n");
+	printf("    output on the target, so only new patterns are emitted.\n");
+	printf("\n");
+	printf("-p: Profile target costs\n");
+	printf("    Runs small reference loader routines over the emitted data\n");
+	printf("    in an emulated 68000, and reports the cycles they take for\n");
+	printf("    each output file, so that output options can be compared.\n");
+	printf("\n");
+	printf("-t: Timing\n");
+	printf("    Reports the time taken to decode, convert, and write.\n");
+	printf("\n");
+	printf("-O: Optimization level (0 - 3, default 1)\n");
+	printf("    0: Frames are cut on a fixed 16x16 grid, and nothing is\n");
+	printf("       shared. Fastest, with the largest output.\n");
+	printf("    1: Sprites are claimed around opaque pixels; identical\n");
+	printf("       patterns and frames are stored once.\n");
+	printf("    2: Patterns mirroring another are drawn flipped instead,\n");
+	printf("       and frames that begin a longer one share its FRM data.\n");
+	printf("    3: Several grid alignments are tried for every frame, and\n");
+	printf("       the one adding the fewest new patterns is kept.\n");
+	printf("    The time and savings of each pass are reported.\n");
+	printf("-T: Time budget (milliseconds)\n");
+	printf("    Passes of level 2 and 3 stop early once this much time has\n");
+	printf("    gone by since conversion began, keeping what they have done.\n");
+	printf("\n");
+	printf("-W: Warm snapshot\n");
+	printf("    Frames converted by an earlier run with the same snapshot\n");
+	printf("    file are replayed from it rather than searched for sprites\n");
+	printf("    again, with identical results. The snapshot is replaced\n");
+	printf("    with the frames and patterns of this run once it is done.\n");
+	printf("\n");
+	printf("-C: Sheet cache\n");
+	printf("    Everything converted from the inputs is kept in the cache\n");
+	printf("    file. A later run with the same inputs and options, other\n");
+	printf("    than the origin, restores it instead of decoding and cutting\n");
+	printf("    the sheets again, and only moves the frames to the origin.\n");
+	printf("    Not available with -c, -a, or -l.\n");
+	printf("\n");
+	printf("-v: Origin variant\n");
+	printf("    Also emits the output for another origin, given as x,y in\n");
+	printf("    the same terms as -x and -y, to <output>_<x>_<y>. May be\n");
+	printf("    repeated (up to %d times). Only the origin-dependent parts\n",
+	       ORIGIN_VARIANT_MAX_COUNT);
+	printf("    of the data are rewritten for each one.\n");
+	printf("\n");
+	printf("-D: Spill file\n");
+	printf("    Pattern data is kept in the named file, mapped, rather than\n");
+	printf("    in memory, and only pattern hashes stay resident. The file\n");
+	printf("    is written in order as patterns are found, and removed once\n");
+	printf("    the output is written.\n");
+	printf("\n");
+	printf("-n: Dedupe window (frames)\n");
+	printf("    Patterns are only matched against those used by the last\n");
+	printf("    frames frames, and the %d used most so far, so that the\n",
+	       WINDOW_HOT_COUNT);
+	printf("    dictionary in use stays bounded for tall sheets. Patterns\n");
+	printf("    that leave the window are let go of, and the PCG data goes\n");
+	printf("    to a spill file: the one given with -D, <output>.spill, or\n");
+	printf("    a temporary file for shm:/ output. The extra PCG data this\n");
+	printf("    costs against global dedupe is reported.\n");
+	printf("    Mirrored patterns are not merged (see -O 2).\n");
+	printf("\n");
+	printf("-P: Metrics file\n");
+	printf("    Phase times, a histogram of frame conversion times,\n");
+	printf("    dictionary sizes, and snapshot and sheet cache hits are\n");
+	printf("    written to the file in the Prometheus text format, every\n");
+	printf("    second while converting and once at the end. With -M, job\n");
+	printf("    counts and a histogram of job times are written instead.\n");
+	printf("\n");
+	printf("-U: Patch against a previous bank\n");
+	printf("    The output is compared with the bank named (an XSB, or\n");
+	printf("    any one file of a set), and the REF, FRM, and pattern\n");
+	printf("    ranges that changed are written to <output>.XPD. Give the\n");
+	printf("    same bank with -a as well to keep pattern numbers stable.\n");
+	printf("-A: Apply a patch\n");
+	printf("    Brings the bank given as input up to date with the patch,\n");
+	printf("    in place. No output file is needed.\n");
+	printf("\n");
+	printf("-I: Inspect an existing bank instead of converting\n");
+	printf("    The input is an XSB bundle, or one of the XSP, FRM, and\n");
+	printf("    REF files of a set. \"summary\" prints frame, sprite, and\n");
+	printf("    pattern counts, and how many patterns frames share.\n");
+	printf("    \"frames\" adds a line for every REF entry. No output\n");
+	printf("    file is needed.\n");
+	printf("\n");
+	printf("-M: Build every job in a manifest\n");
+	printf("    Each line of the manifest holds the arguments for one\n");
+	printf("    conversion. Jobs run in parallel, longest first, going by\n");
+	printf("    times kept in <manifest>.history from earlier builds, or\n");
+	printf("    by the size and opaque area of their input otherwise.\n");
+	printf("-j: Number of jobs to run at once (default: one per CPU)\n");
+	printf("\n");
 	printf("Sample usage:\n");
 	printf("    %s player.png -w 32 -h 48 -y 40 -o out/PLAYER\n", prog_name);
 	printf("\n");
@@ -96,38 +251,33 @@ static void show_usage(const char *prog_name)
 	printf("    %s player.png -w 32 -h 48 -y 40 -b -o out/PLAYER\n",
 	       prog_name);
 	printf("    out/PLAYER.XSB  <-- Everything\n");
+	printf("\n");
+	printf("If the input is an Aseprite file, the first tilemap layer is\n");
+	printf("converted to BG data, and frame options are not needed:\n");
+	printf("    %s stage.aseprite -o out/STAGE\n", prog_name);
+	printf("    out/STAGE.BG    <-- BG pattern data from the tileset\n");
+	printf("    out/STAGE.MAP   <-- Tilemap (width, height, BG entries)\n");
+	printf("    out/STAGE.PAL   <-- Palette data (in X68000 color format)\n");
+	printf("\n");
+	printf("If the input is an animated PNG, each animation frame becomes\n");
+	printf("one REF entry, and the frame size is taken from the canvas.\n");
+	printf("\n");
+	printf("Several sheets may be given, with the same frame options, to\n");
+	printf("pack them into one output. Their REF entries follow one another\n");
+	printf("in order, sharing one set of patterns, and frames identical to\n");
+	printf("an earlier one in any sheet point at its FRM data.\n");
+	printf("    %s spark.png poof.png -w 32 -h 32 -b -o out/EFFECTS\n",
+	       prog_name);
 }
 
-// Free after usage. NULL on error.
-static uint8_t *load_png_data(const char *fname,
-                              unsigned int *png_w, unsigned int *png_h,
-                              LodePNGState *state)
+// Parses an origin coordinate: a number of pixels, or min_name or max_name for
+// the near or far edge of the frame.
+static int parse_origin(const char *arg, const char *min_name,
+                        const char *max_name)
 {
-	uint8_t *png;
-	uint8_t *ret;
-	// First load the file into memory.
-	size_t fsize;
-	int error = lodepng_load_file(&png, &fsize, fname);
-	if (error)
-	{
-		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
-		return NULL;
-	}
-
-	// The image is decoded as an 8-bit indexed color PNG; we don't want any
-	// conversion to take place.
-	lodepng_state_init(state);
-	state->info_raw.colortype = LCT_PALETTE;
-	state->info_raw.bitdepth = 8;
-	error = lodepng_decode(&ret, png_w, png_h, state, png, fsize);
-	if (error)
-	{
-		printf("LodePNG error %u: %s\n", error, lodepng_error_text(error));
-		return NULL;
-	}
-
-//	printf("Loaded \"%s\": %d x %d\n", fname, *png_w, *png_h);
-	return ret;
+	if (strcmp(min_name, arg) == 0) return 0;  // min
+	if (strcmp(max_name, arg) == 0) return 65535;  // max
+	return strtoul(arg, NULL, 0);
 }
 
 // Hunt top-down, then left-right, for a sprite to clip from imgdat.
@@ -184,12 +334,194 @@ static bool claim(const uint8_t *imgdat,
 	return true;
 }
 
+// A hardware sprite placed within a frame, relative to the frame origin.
+typedef struct Placement
+{
+	int16_t vx;
+	int16_t vy;
+	int16_t pt;
+} Placement;
+
+// A hardware sprite's worth of image data cut from a frame, at its top-left
+// position in imgdat.
+typedef struct Tile
+{
+	int x;
+	int y;
+	uint8_t pattern[32 * 4];  // Four 8x8 tiles, row interleaved.
+} Tile;
+
+// Grid alignments tried by search_tiling() are this many pixels apart.
+#define SEARCH_GRID_STEP 4
+
+// Clips the 16x16 area at x, y into tile, excluding anything at or past limx
+// and limy. The area is erased from imgdat.
+static void clip_tile(uint8_t *imgdat, int iw, int limx, int limy,
+                      int x, int y, Tile *tile)
+{
+	tile->x = x;
+	tile->y = y;
+	clip_8x8_tile(imgdat, iw, x, y, limx, limy, &tile->pattern[32 * 0]);
+	clip_8x8_tile(imgdat, iw, x, y + 8, limx, limy, &tile->pattern[32 * 1]);
+	clip_8x8_tile(imgdat, iw, x + 8, y, limx, limy, &tile->pattern[32 * 2]);
+	clip_8x8_tile(imgdat, iw, x + 8, y + 8, limx, limy, &tile->pattern[32 * 3]);
+}
+
+// Claims sprites from a frame until it is empty. Returns the number of tiles,
+// or -1 if there would be more than max.
+static int tile_by_claim(uint8_t *imgdat, int iw, int ih,
+                         int sx, int sy, int sw, int sh, Tile *tiles, int max)
+{
+	int count = 0;
+	int col, row;
+	while (claim(imgdat, iw, ih, sx, sy, sw, sh, &col, &row))
+	{
+		if (count >= max) return -1;
+		clip_tile(imgdat, iw, sx + sw, sy + sh, col, row, &tiles[count++]);
+	}
+	return count;
+}
+
+// Cuts a frame on a 16x16 grid with a corner at ax, ay, skipping empty cells.
+// The frame must be empty above ay and left of ax. Returns the number of
+// tiles, or -1 if there would be more than max.
+static int tile_by_grid(uint8_t *imgdat, int iw, int sx, int sy, int sw, int sh,
+                        int ax, int ay, Tile *tiles, int max)
+{
+	const int limx = sx + sw;
+	const int limy = sy + sh;
+	int count = 0;
+	for (int y = ay; y < limy; y += PCG_TILE_PX)
+	{
+		const int ylim = (y + PCG_TILE_PX) < limy ? (y + PCG_TILE_PX) : limy;
+		for (int x = ax; x < limx; x += PCG_TILE_PX)
+		{
+			const int xlim = (x + PCG_TILE_PX) < limx ? (x + PCG_TILE_PX) : limx;
+			bool empty = true;
+			for (int cy = y; cy < ylim && empty; cy++)
+			{
+				for (int cx = x; cx < xlim; cx++)
+				{
+					if (imgdat[cx + (cy * iw)] == 0) continue;
+					empty = false;
+					break;
+				}
+			}
+			if (empty) continue;
+			if (count >= max) return -1;
+			clip_tile(imgdat, iw, limx, limy, x, y, &tiles[count++]);
+		}
+	}
+	return count;
+}
+
+// Counts the tiles whose patterns are neither in the PCG data already (or
+// mirrored there, if flips is set) nor repeated earlier in the list.
+static int count_new_patterns(const Tile *tiles, int count, bool flips)
+{
+	int ret = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const uint8_t *pattern = tiles[i].pattern;
+		bool found = record_find_pcg_dat(pattern) >= 0;
+		for (int f = 1; f < 4 && flips && !found; f++)
+		{
+			uint8_t mirrored[128];
+			pcg_flip(pattern, mirrored, f & 1, f & 2);
+			found = record_find_pcg_dat(mirrored) >= 0;
+		}
+		for (int j = 0; j < i && !found; j++)
+		{
+			found = memcmp(tiles[j].pattern, pattern, 128) == 0;
+		}
+		if (!found) ret++;
+	}
+	return ret;
+}
+
+// Tiles a frame by claiming, then on 16x16 grids aligned at several offsets
+// above and left of its opaque bounds (bl, bt), and keeps whichever tiling
+// adds the fewest new patterns, then uses the fewest sprites. Claiming wins
+// ties. No more grids are tried once deadline_us has passed.
+static int search_tiling(uint8_t *imgdat, int iw, int ih,
+                         int sx, int sy, int sw, int sh, int bl, int bt,
+                         bool flips, uint64_t deadline_us, Tile *tiles, int max)
+{
+	static Tile trial[PCG_FRM_MAX_COUNT / 8];
+	static uint8_t *saved = NULL;
+	static size_t saved_size = 0;
+
+	// Every tiling erases the frame, so it is put back before each one.
+	const size_t bytes = (size_t)sw * sh;
+	if (bytes > saved_size)
+	{
+		uint8_t *grown = realloc(saved, bytes);
+		if (!grown) return tile_by_claim(imgdat, iw, ih, sx, sy, sw, sh, tiles, max);
+		saved = grown;
+		saved_size = bytes;
+	}
+	for (int y = 0; y < sh; y++)
+	{
+		memcpy(&saved[y * sw], &imgdat[sx + ((sy + y) * iw)], sw);
+	}
+
+	int best = tile_by_claim(imgdat, iw, ih, sx, sy, sw, sh, tiles, max);
+	if (best <= 0) return best;
+	int best_new = count_new_patterns(tiles, best, flips);
+	const int claim_count = best;
+	const int claim_new = best_new;
+
+	// Offsets that would put the grid outside the frame are clamped to its
+	// edge, which only needs to be tried once.
+	for (int dy = 0; dy < PCG_TILE_PX; dy += SEARCH_GRID_STEP)
+	{
+		if (dy > 0 && bt - dy + SEARCH_GRID_STEP <= sy) break;
+		const int ay = (bt - dy) > sy ? (bt - dy) : sy;
+		for (int dx = 0; dx < PCG_TILE_PX; dx += SEARCH_GRID_STEP)
+		{
+			if (dx > 0 && bl - dx + SEARCH_GRID_STEP <= sx) break;
+			const int ax = (bl - dx) > sx ? (bl - dx) : sx;
+			if (pass_out_of_time(deadline_us))
+			{
+				pass_cut_short(PASS_SEARCH);
+				goto done;
+			}
+			for (int y = 0; y < sh; y++)
+			{
+				memcpy(&imgdat[sx + ((sy + y) * iw)], &saved[y * sw], sw);
+			}
+			const int count = tile_by_grid(imgdat, iw, sx, sy, sw, sh, ax, ay,
+			                               trial, max);
+			if (count < 0) continue;
+			const int new_count = count_new_patterns(trial, count, flips);
+			if (new_count > best_new || (new_count == best_new && count >= best))
+			{
+				continue;
+			}
+			memcpy(tiles, trial, sizeof(Tile) * count);
+			best = count;
+			best_new = new_count;
+		}
+	}
+
+done:
+	pass_account(PASS_SEARCH, 0, claim_new - best_new, claim_count - best, 0);
+	return best;
+}
+
 // Takes sprite data from imgdat and generates XSP entry data for it.
 // Adds to the PCG, FRM, and REF files as necessary.
-static void chop_sprite(uint8_t *imgdat, int iw, int ih, ConvMode mode,
-                        int ox, int oy,
+// level is the optimization level (see passes.h); only the search for
+// placements at level 3 watches deadline_us.
+// Returns false if pattern data couldn't be stored, and the conversion has to
+// stop.
+static bool chop_sprite(uint8_t *imgdat, int iw, int ih, ConvMode mode,
+                        int level, uint64_t deadline_us, int ox, int oy,
                         int sx, int sy, int sw, int sh)
 {
+	static Placement placements[PCG_FRM_MAX_COUNT / 8];
+	static Tile tiles[PCG_FRM_MAX_COUNT / 8];
+
 	// Data that gets placed into the ref dat at the end.
 	// frm_offs needs to point at the start of the XOBJ_FRM_DAT for this
 	// sprite. s_frm_offs will be added for every hardware sprite chopped
@@ -220,55 +552,292 @@ static void chop_sprite(uint8_t *imgdat, int iw, int ih, ConvMode mode,
 	// TODO: Verbose #define
 	// render_region(imgdat, iw, ih, sx, sy, sw, sh);
 
-	int clip_x, clip_y;
-	int last_vx = 0;
-	int last_vy = 0;
+	// The opaque bounds must be taken before claim() erases the image data.
+	FrameBox opaque_box = {0, 0, 0, 0};
+	FrameBox sprite_box = {0, 0, 0, 0};
+	int bl, bt, br, bb;
+	if (find_opaque_bounds(imgdat, iw, sx, sy, sw, sh, &bl, &bt, &br, &bb))
+	{
+		opaque_box.left = bl - sx - (ox + PCG_TILE_PX / 2);
+		opaque_box.top = bt - sy - (oy + PCG_TILE_PX / 2);
+		opaque_box.right = br - sx - (ox + PCG_TILE_PX / 2);
+		opaque_box.bottom = bb - sy - (oy + PCG_TILE_PX / 2);
+	}
+	else
+	{
+		bl = bt = br = bb = 0;
+	}
+
+	// The mask is packed here, before the image is erased, but only recorded
+	// along with the REF entry at the end.
+	const bool record_mask = mode == CONV_MODE_XOBJ && record_get_msk_output();
+	const int mask_words = mask_row_words(br - bl);
+	const int mask_rows = bb - bt;
+	uint8_t *mask = NULL;
+	if (record_mask)
+	{
+		mask = malloc(2 * mask_words * mask_rows + 1);
+		if (mask) pack_mask_1bpp(imgdat, iw, bl, bt, br, bb, mask);
+	}
+
+	// A frame converted by an earlier run is replayed from the snapshot, which
+	// skips searching for sprites and clipping tiles (XSP mode only).
+	SnapshotFrame cached;
+	bool replay = false;
+	if (mode == CONV_MODE_XOBJ && snapshot_active())
+	{
+		const uint64_t key = snapshot_frame_key(imgdat, iw, sx, sy, sw, sh, level);
+		replay = snapshot_find_frame(key, &cached);
+		if (replay) snapshot_note_replay();
+		snapshot_begin_frame(key);
+	}
+
 	// TODO: In SP mode, should we just process the entire image?
-	while (claim(imgdat, iw, ih, sx, sy, sw, sh, &clip_x, &clip_y))
+	const uint64_t tile_start = time_us();
+	PassId tile_pass = PASS_TILE;
+	int tile_count;
+	if (replay)
+	{
+		tile_count = (cached.count <= ARRAYSIZE(tiles)) ? cached.count : -1;
+		for (int i = 0; i < tile_count; i++)
+		{
+			const uint8_t *pattern;
+			snapshot_frame_sprite(&cached, i, &tiles[i].x, &tiles[i].y, &pattern);
+			tiles[i].x += sx;
+			tiles[i].y += sy;
+			memcpy(tiles[i].pattern, pattern, sizeof(tiles[i].pattern));
+		}
+	}
+	else if (mode == CONV_MODE_XOBJ && level >= pass_min_level(PASS_SEARCH) &&
+	         !pass_out_of_time(deadline_us))
+	{
+		tile_pass = PASS_SEARCH;
+		tile_count = search_tiling(imgdat, iw, ih, sx, sy, sw, sh, bl, bt,
+		                           level >= pass_min_level(PASS_FLIP),
+		                           deadline_us, tiles, ARRAYSIZE(tiles));
+	}
+	else if (mode == CONV_MODE_XOBJ && level < pass_min_level(PASS_DEDUPE))
+	{
+		tile_count = tile_by_grid(imgdat, iw, sx, sy, sw, sh, sx, sy,
+		                          tiles, ARRAYSIZE(tiles));
+	}
+	else
+	{
+		if (mode == CONV_MODE_XOBJ && level >= pass_min_level(PASS_SEARCH))
+		{
+			pass_cut_short(PASS_SEARCH);
+		}
+		tile_count = tile_by_claim(imgdat, iw, ih, sx, sy, sw, sh,
+		                           tiles, ARRAYSIZE(tiles));
+	}
+	pass_account(tile_pass, time_us() - tile_start, 0, 0, 0);
+	if (tile_count < 0)
+	{
+		printf("Too many sprites in one frame!\n");
+		free(mask);
+		return true;
+	}
+
+	for (int i = 0; i < tile_count; i++)
 	{
+		const Tile *tile = &tiles[i];
 		sp_count++;
-		uint8_t pcg_data[32 * 4];  // Four 8x8 tiles, row interleaved.
-		const int limx = sx + sw;
-		const int limy = sy + sh;
-		clip_8x8_tile(imgdat, iw, clip_x, clip_y,
-		              limx, limy, &pcg_data[32 * 0]);
-		clip_8x8_tile(imgdat, iw, clip_x, clip_y + 8,
-		              limx, limy, &pcg_data[32 * 1]);
-		clip_8x8_tile(imgdat, iw, clip_x + 8, clip_y,
-		              limx, limy, &pcg_data[32 * 2]);
-		clip_8x8_tile(imgdat, iw, clip_x + 8, clip_y + 8,
-		              limx, limy, &pcg_data[32 * 3]);
-
-		// In XOBJ mode, duplicate tiles are removed.
-		int pt_idx = (mode == CONV_MODE_XOBJ)
-		             ? record_find_pcg_dat(pcg_data)
-		             : -1;
+
+		// In XOBJ mode, duplicate tiles are removed. Below the dedupe level,
+		// only patterns of a base bank are found (see record_set_dedupe()).
+		int pt_idx = -1;
+		if (mode == CONV_MODE_XOBJ)
+		{
+			const uint64_t lookup_start = time_us();
+			pt_idx = record_find_pcg_dat(tile->pattern);
+			if (level >= pass_min_level(PASS_DEDUPE))
+			{
+				pass_account(PASS_DEDUPE, time_us() - lookup_start, pt_idx >= 0,
+				             0, 0);
+			}
+		}
 		if (pt_idx < 0)
 		{
 			pt_idx = record_get_pcg_count();
 			if (pt_idx >= PCG_PT_MAX_COUNT)
 			{
 				printf("PCG area is full! Cannot record any more tiles.\n");
-				return;
+				free(mask);
+				return true;
 			}
-			else
+			else if (!record_pcg_dat(tile->pattern))
 			{
-				record_pcg_dat(pcg_data);
+				printf("Couldn't store pattern data; stopping.\n");
+				free(mask);
+				return false;
 			}
 		}
 
 		if (mode != CONV_MODE_XOBJ) continue;
+		if (!record_use_pcg(pt_idx, tile->pattern))
+		{
+			free(mask);
+			return false;
+		}
+		snapshot_add_sprite(tile->x - sx, tile->y - sy, pt_idx);
 
-		const int vx = ((clip_x % sw) - ox);
-		const int vy = ((clip_y % sh) - oy);
-		record_frm_dat(vx - last_vx, vy - last_vy, pt_idx, 0);
+		const int vx = ((tile->x % sw) - ox);
+		const int vy = ((tile->y % sh) - oy);
+		placements[sp_count - 1].vx = vx;
+		placements[sp_count - 1].vy = vy;
+		placements[sp_count - 1].pt = pt_idx;
 
-		last_vx = vx;
-		last_vy = vy;
+		// vx and vy mark the center of the hardware sprite.
+		const int sl = vx - (PCG_TILE_PX / 2);
+		const int st = vy - (PCG_TILE_PX / 2);
+		if (sp_count == 1 || sl < sprite_box.left) sprite_box.left = sl;
+		if (sp_count == 1 || st < sprite_box.top) sprite_box.top = st;
+		if (sp_count == 1 || sl + PCG_TILE_PX > sprite_box.right)
+		{
+			sprite_box.right = sl + PCG_TILE_PX;
+		}
+		if (sp_count == 1 || st + PCG_TILE_PX > sprite_box.bottom)
+		{
+			sprite_box.bottom = st + PCG_TILE_PX;
+		}
 	}
 
-	if (mode != CONV_MODE_XOBJ) return;
+	if (mode != CONV_MODE_XOBJ) return true;
+
+	// FRM positions are relative to the previous sprite.
+	int last_vx = 0;
+	int last_vy = 0;
+	for (int i = 0; i < sp_count; i++)
+	{
+		const Placement *p = &placements[i];
+		record_frm_dat(p->vx - last_vx, p->vy - last_vy, p->pt, 0);
+		last_vx = p->vx;
+		last_vy = p->vy;
+	}
+
+	// A mask that couldn't be packed is recorded empty, so that there is still
+	// one MSK entry for every REF entry.
+	if (record_mask)
+	{
+		if (mask)
+		{
+			record_msk_dat(opaque_box.left, opaque_box.top, mask_words, mask_rows,
+			               mask);
+		}
+		else
+		{
+			record_msk_dat(0, 0, 0, 0, NULL);
+		}
+		free(mask);
+	}
+	record_box_dat(&opaque_box, &sprite_box);
 	record_ref_dat(sp_count, frm_offs);
+	return true;
+}
+
+// Brings the dictionary sizes in the metrics up to date.
+static void set_record_metrics(void)
+{
+	if (!metrics_active()) return;
+	metrics_gauge("png2xsp_patterns", NULL, "Patterns written to the output.",
+	              record_get_pcg_written_count());
+	metrics_gauge("png2xsp_frm_entries", NULL, "FRM entries recorded.",
+	              record_get_frm_offs() / 8);
+	metrics_gauge("png2xsp_frm_pooled", NULL,
+	              "Frames that share the FRM data of an identical frame.",
+	              record_get_frm_pooled());
+	metrics_gauge("png2xsp_ref_entries", NULL, "REF entries recorded.",
+	              record_get_ref_count());
+	metrics_gauge("png2xsp_spill_bytes", NULL,
+	              "Pattern data kept in the spill file.",
+	              record_get_spill_bytes());
+}
+
+// Chops every frame of a sheet, row by row. unchanged may be NULL, or flag
+// animation frames identical to the one before, which reuse its REF entry.
+// Returns false if a frame couldn't be chopped; see chop_sprite().
+static bool chop_sheet(uint8_t *imgdat, int iw, int ih, const bool *unchanged,
+                       ConvMode mode, int level, uint64_t deadline_us,
+                       int ox, int oy, int frame_w, int frame_h)
+{
+	const int sprite_rows = ih / frame_h;
+	const int sprite_columns = iw / frame_w;
+	for (int y = 0; y < sprite_rows; y++)
+	{
+		for (int x = 0; x < sprite_columns; x++)
+		{
+			// An animation frame that didn't change reuses the last REF.
+			if (unchanged && unchanged[x] && mode == CONV_MODE_XOBJ)
+			{
+				record_repeat_ref();
+				continue;
+			}
+			const uint64_t frame_start = time_us();
+			if (!chop_sprite(imgdat, iw, ih, mode, level, deadline_us, ox, oy,
+			                 x * frame_w, y * frame_h, frame_w, frame_h))
+			{
+				return false;
+			}
+			metrics_observe(METRICS_FRAME_SECONDS, time_us() - frame_start);
+			if (metrics_due())
+			{
+				set_record_metrics();
+				metrics_write();
+			}
+		}
+	}
+	return true;
+}
+
+// Chops each sheet after the first into the same output, decoding them into
+// one buffer in turn. They share the pattern data and FRM pool of the first,
+// whose name and decoder state are given to check their palettes against.
+// Returns false if a sheet can't be used.
+static bool chop_extra_sheets(const char *const *inputs, int count,
+                              const char *first_fname,
+                              const LodePNGState *first_state,
+                              ConvMode mode, int level,
+                              uint64_t deadline_us, int ox, int oy,
+                              int frame_w, int frame_h,
+                              uint64_t *decode_us, uint64_t *convert_us)
+{
+	uint8_t *sheet_buf = NULL;
+	size_t sheet_buf_size = 0;
+	bool ret = true;
+	for (int i = 0; i < count && ret; i++)
+	{
+		uint64_t phase_start = time_us();
+		unsigned int sheet_w, sheet_h;
+		LodePNGState sheet_state;
+		const bool loaded = load_png_into(inputs[i], &sheet_buf,
+		                                  &sheet_buf_size, &sheet_w, &sheet_h,
+		                                  &sheet_state);
+		*decode_us += time_us() - phase_start;
+		if (!loaded)
+		{
+			ret = false;
+			break;
+		}
+		if (!palettes_match(first_state, &sheet_state))
+		{
+			printf("Warning: palette of \"%s\" differs from \"%s\".\n",
+			       inputs[i], first_fname);
+		}
+		lodepng_state_cleanup(&sheet_state);
+		if (frame_w > sheet_w || frame_h > sheet_h)
+		{
+			printf("Frame size (%d x %d) exceeds %s (%d x %d)\n",
+			       frame_w, frame_h, inputs[i], sheet_w, sheet_h);
+			ret = false;
+			break;
+		}
+		phase_start = time_us();
+		ret = chop_sheet(sheet_buf, sheet_w, sheet_h, NULL, mode, level,
+		                 deadline_us, ox, oy, frame_w, frame_h);
+		*convert_us += time_us() - phase_start;
+	}
+	free(sheet_buf);
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -286,13 +855,41 @@ int main(int argc, char **argv)
 	const char *outname = NULL;
 	int frame_w = -1;
 	int frame_h = -1;
+	bool auto_w = false;
+	bool auto_h = false;
 	int origin_x = -1;
 	int origin_y = -1;
 	bool bundle = false;
+	bool extents = false;
+	bool masks = false;
+	int fade_steps = 0;
+	bool fade = false;
+	bool compose = false;
+	bool index = false;
+	const char *base_fname = NULL;
+	bool base_link = false;
+	bool profile = false;
+	bool timing = false;
+	bool inspect = false;
+	bool inspect_frames = false;
+	const char *manifest = NULL;
+	const char *snapshot_fname = NULL;
+	int jobs = 0;
+	int level = OPT_LEVEL_DEFAULT;
+	int budget_ms = 0;
+	const char *cache_fname = NULL;
+	const char *spill_fname = NULL;
+	int window = 0;
+	const char *metrics_fname = NULL;
+	const char *prev_fname = NULL;
+	const char *patch_fname = NULL;
+	int variant_x[ORIGIN_VARIANT_MAX_COUNT];
+	int variant_y[ORIGIN_VARIANT_MAX_COUNT];
+	int variant_count = 0;
 
 	// Parse options.
 	int c;
-	while ((c = getopt(argc, argv, "?o:w:h:x:y:b")) != -1)
+	while ((c = getopt(argc, argv, k_options)) != -1)
 	{
 		switch (c)
 		{
@@ -303,44 +900,167 @@ int main(int argc, char **argv)
 				outname = optarg;
 				break;
 			case 'w':
-				frame_w = strtoul(optarg, NULL, 0);
+				auto_w = (strcmp("auto", optarg) == 0);
+				frame_w = auto_w ? 0 : strtoul(optarg, NULL, 0);
 				break;
 			case 'h':
-				frame_h = strtoul(optarg, NULL, 0);
+				auto_h = (strcmp("auto", optarg) == 0);
+				frame_h = auto_h ? 0 : strtoul(optarg, NULL, 0);
 				break;
 			case 'x':
-				if (strcmp("left", optarg) == 0) origin_x = 0;  // min
-				else if (strcmp("right", optarg) == 0) origin_x = 65535;  // max
-				else origin_x = strtoul(optarg, NULL, 0);
+				origin_x = parse_origin(optarg, "left", "right");
 				break;
 			case 'y':
-				if (strcmp("top", optarg) == 0) origin_y = 0;  // min
-				else if (strcmp("bottom", optarg) == 0) origin_y = 65535;  // max
-				else origin_y = strtoul(optarg, NULL, 0);
+				origin_y = parse_origin(optarg, "top", "bottom");
 				break;
 			case 'b':
 				bundle = true;
 				break;
+			case 'e':
+				extents = true;
+				break;
+			case 'm':
+				masks = true;
+				break;
+			case 'f':
+				fade = true;
+				fade_steps = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				compose = true;
+				break;
+			case 'i':
+				index = true;
+				break;
+			case 'a':
+			case 'l':
+				base_fname = optarg;
+				base_link = (c == 'l');
+				break;
+			case 'p':
+				profile = true;
+				break;
+			case 't':
+				timing = true;
+				break;
+			case 'I':
+				inspect = true;
+				inspect_frames = (strcmp("frames", optarg) == 0);
+				if (!inspect_frames && strcmp("summary", optarg) != 0)
+				{
+					printf("Unknown inspection \"%s\".\n", optarg);
+					return -1;
+				}
+				break;
+			case 'M':
+				manifest = optarg;
+				break;
+			case 'j':
+				jobs = strtoul(optarg, NULL, 0);
+				break;
+			case 'O':
+				level = strtoul(optarg, NULL, 0);
+				break;
+			case 'T':
+				budget_ms = strtoul(optarg, NULL, 0);
+				break;
+			case 'W':
+				snapshot_fname = optarg;
+				break;
+			case 'C':
+				cache_fname = optarg;
+				break;
+			case 'D':
+				spill_fname = optarg;
+				break;
+			case 'n':
+				window = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				metrics_fname = optarg;
+				break;
+			case 'U':
+				prev_fname = optarg;
+				break;
+			case 'A':
+				patch_fname = optarg;
+				break;
+			case 'v':
+			{
+				char coords[64];
+				snprintf(coords, sizeof(coords), "%s", optarg);
+				char *comma = strchr(coords, ',');
+				if (!comma || variant_count >= ORIGIN_VARIANT_MAX_COUNT)
+				{
+					printf("Expected at most %d origin variants as x,y (have \"%s\").\n",
+					       ORIGIN_VARIANT_MAX_COUNT, optarg);
+					return -1;
+				}
+				*comma = '\0';
+				variant_x[variant_count] = parse_origin(coords, "left", "right");
+				variant_y[variant_count] = parse_origin(comma + 1, "top", "bottom");
+				variant_count++;
+				break;
+			}
 		}
 	}
 
-	// Non-opt arguments
+	// Non-opt arguments. Sheets after the first are packed into the same output.
+	const char *extra_inputs[INPUT_MAX_COUNT];
+	int extra_count = 0;
 	for (int i = optind; i < argc; i++)
 	{
-		fname = argv[i];
-		break;
+		if (!fname)
+		{
+			fname = argv[i];
+			continue;
+		}
+		if (extra_count >= ARRAYSIZE(extra_inputs))
+		{
+			printf("Too many input sheets (at most %d).\n", INPUT_MAX_COUNT);
+			return -1;
+		}
+		extra_inputs[extra_count++] = argv[i];
 	}
 
 	//
 	// Check argument sanity
 	//
 
-	if (frame_w <= 0 || frame_h <= 0)
+	if (metrics_fname) metrics_open(metrics_fname);
+
+	if (manifest)
 	{
-		printf("Frame width and height parameters must be >= 0 (have %d x %d)\n",
-		       frame_w, frame_h);
-		return -1;
+		return manifest_build(progname, k_options, manifest, jobs) ? 0 : -1;
+	}
+
+	if (inspect)
+	{
+		if (!fname)
+		{
+			printf("Bank file name must be specified.\n");
+			return -1;
+		}
+		const uint64_t inspect_start = time_us();
+		const bool ok = inspect_bank(fname, inspect_frames);
+		if (timing)
+		{
+			printf("Inspect:\t%.3f ms\n", (time_us() - inspect_start) / 1000.0);
+		}
+		return ok ? 0 : -1;
 	}
+
+	if (patch_fname)
+	{
+		if (!fname)
+		{
+			printf("Bank file name must be specified.\n");
+			return -1;
+		}
+		printf("Patch: %s --> %s\n", patch_fname, fname);
+		return patch_apply(patch_fname, fname) ? 0 : -1;
+	}
+
 	if (!outname)
 	{
 		printf("Output file name must be specified.\n");
@@ -353,11 +1073,165 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	// Aseprite tilemaps already carry their tiles, so are converted directly.
+	if (!compose && ase_is_aseprite(fname))
+	{
+		if (extra_count > 0)
+		{
+			printf("An Aseprite tilemap can't be packed with other sheets.\n");
+			return -1;
+		}
+		printf("Input: %s (Aseprite tilemap)\n", fname);
+		printf("--> %s.BG\n", outname);
+		printf("--> %s.MAP\n", outname);
+		printf("--> %s.PAL\n", outname);
+		return ase_convert_tilemap(fname, outname) ? 0 : -1;
+	}
+
+	// Animation frames are composited to the canvas size.
+	const bool animated = !compose && apng_is_animated(fname);
+	if (animated)
+	{
+		auto_w = auto_h = false;
+		frame_w = frame_h = 1;  // Replaced once the canvas size is known.
+	}
+
+	if ((frame_w <= 0 && !auto_w) || (frame_h <= 0 && !auto_h))
+	{
+		printf("Frame width and height parameters must be >= 0 (have %d x %d)\n",
+		       frame_w, frame_h);
+		return -1;
+	}
+
+	if (fade && (fade_steps < 1 || fade_steps > 256))
+	{
+		printf("Fade steps must be between 1 and 256 (have %d)\n", fade_steps);
+		return -1;
+	}
+
+	if (level < 0 || level > OPT_LEVEL_MAX)
+	{
+		printf("Optimization level must be between 0 and %d (have %d)\n",
+		       OPT_LEVEL_MAX, level);
+		return -1;
+	}
+
+	if (compose && (auto_w || auto_h))
+	{
+		printf("Frame size must be given explicitly for a composition.\n");
+		return -1;
+	}
+
+	for (int i = 0; i < extra_count; i++)
+	{
+		if (apng_is_animated(extra_inputs[i]))
+		{
+			printf("Only the first input may be an animated PNG (%s).\n",
+			       extra_inputs[i]);
+			return -1;
+		}
+	}
+
+	// A sheet cache entry for the same inputs and options stands in for
+	// decoding and converting them.
+	uint64_t cache_key = 0;
+	bool cache_hit = false;
+	SheetCacheInfo cache_info;
+	if (cache_fname && (compose || base_fname))
+	{
+		printf("The sheet cache can't be used with -c, -a, or -l; ignoring it.\n");
+		cache_fname = NULL;
+	}
+	if (cache_fname)
+	{
+		const char *inputs[INPUT_MAX_COUNT + 1];
+		inputs[0] = fname;
+		for (int i = 0; i < extra_count; i++) inputs[i + 1] = extra_inputs[i];
+		char options[128];
+		snprintf(options, sizeof(options), "w%d%s h%d%s O%d T%d e%d m%d n%d",
+		         frame_w, auto_w ? "auto" : "", frame_h, auto_h ? "auto" : "",
+		         level, budget_ms, extents, masks, window);
+		cache_key = sheet_cache_key(inputs, extra_count + 1, options);
+		cache_hit = cache_key && sheet_cache_open(cache_fname, cache_key,
+		                                          &cache_info);
+	}
+
+	//
+	// Prepare the PNG image.
+	//
+
+	unsigned int png_w = 0;
+	unsigned int png_h = 0;
+	LodePNGState state;
+	uint64_t phase_start = time_us();
+	uint64_t decode_us = 0;
+	uint64_t convert_us = 0;
+	bool *unchanged = NULL;
+	uint8_t *imgdat = NULL;
+	int exit_code = 0;
+	if (cache_hit)
+	{
+		png_w = cache_info.png_w;
+		png_h = cache_info.png_h;
+		frame_w = cache_info.frame_w;
+		frame_h = cache_info.frame_h;
+		auto_w = auto_h = false;
+	}
+	else if (compose)
+	{
+		imgdat = compose_sheet(fname, frame_w, frame_h, &png_w, &png_h, &state);
+	}
+	else if (animated)
+	{
+		imgdat = apng_load_frames(fname, &png_w, &png_h, &frame_w, &frame_h,
+		                          &unchanged, &state);
+	}
+	else
+	{
+		imgdat = load_png_data(fname, &png_w, &png_h, &state);
+	}
+	if (!imgdat && !cache_hit) return -1;
+	decode_us = time_us() - phase_start;
+
+	if (auto_w || auto_h)
+	{
+		uint32_t *cols = malloc(sizeof(uint32_t) * (png_w + png_h));
+		if (!cols)
+		{
+			printf("Couldn't allocate projection buffers.\n");
+			exit_code = -1;
+			goto finished;
+		}
+		uint32_t *rows = cols + png_w;
+		image_projections(imgdat, png_w, png_h, cols, rows);
+		int confidence;
+		if (auto_w)
+		{
+			frame_w = detect_grid_period(cols, png_w, &confidence);
+			printf("Detected frame width: %d (confidence %d%%)\n",
+			       frame_w, confidence);
+		}
+		if (auto_h)
+		{
+			frame_h = detect_grid_period(rows, png_h, &confidence);
+			printf("Detected frame height: %d (confidence %d%%)\n",
+			       frame_h, confidence);
+		}
+		free(cols);
+	}
+
 	// Default to center origin.
 	if (origin_x < 0) origin_x = frame_w / 2;
 	if (origin_y < 0) origin_y = frame_h / 2;
 	if (origin_x > frame_w) origin_x = frame_w;
-	if (origin_y > frame_w) origin_y = frame_h;
+	if (origin_y > frame_h) origin_y = frame_h;
+	for (int i = 0; i < variant_count; i++)
+	{
+		if (variant_x[i] < 0) variant_x[i] = frame_w / 2;
+		if (variant_y[i] < 0) variant_y[i] = frame_h / 2;
+		if (variant_x[i] > frame_w) variant_x[i] = frame_w;
+		if (variant_y[i] > frame_h) variant_y[i] = frame_h;
+	}
 
 	const ConvMode mode = (frame_w <= PCG_TILE_PX && frame_h <= PCG_TILE_PX) ?
 	                      CONV_MODE_SP : CONV_MODE_XOBJ;
@@ -365,10 +1239,20 @@ int main(int argc, char **argv)
 	const char *modestr = (mode == CONV_MODE_XOBJ) ? "XSP" : "SP";
 	printf("Options summary:\n");
 	printf("Input: %s\n", fname);
+	for (int i = 0; i < extra_count; i++)
+	{
+		printf("Input: %s\n", extra_inputs[i]);
+	}
 	printf("Frame: %d x %d\n", frame_w, frame_h);
 	printf("Origin: %d, %d\n", origin_x, origin_y);
+	for (int i = 0; i < variant_count; i++)
+	{
+		printf("Variant: %d, %d --> %s_%d_%d\n", variant_x[i], variant_y[i],
+		       outname, variant_x[i], variant_y[i]);
+	}
 	printf("Mode: %s\n", modestr);
 	printf("Bundle: %s\n", bundle ? "Yes" : "No");
+	if (level != OPT_LEVEL_DEFAULT) printf("Level: %d\n", level);
 	printf("Output: \"%s\"\n", outname);
 	if (bundle)
 	{
@@ -381,20 +1265,16 @@ int main(int argc, char **argv)
 		printf("--> %s.REF\n", outname);
 		printf("--> %s.PAL\n", outname);
 	}
+	if (extents && mode == CONV_MODE_XOBJ) printf("--> %s.BOX\n", outname);
+	if (masks && mode == CONV_MODE_XOBJ) printf("--> %s.MSK\n", outname);
+	if (fade_steps > 0) printf("--> %s.FAD\n", outname);
+	if (index) printf("--> %s.PXI\n", outname);
 
-	//
-	// Prepare the PNG image.
-	//
-
-	unsigned int png_w = 0;
-	unsigned int png_h = 0;
-	LodePNGState state;
-	uint8_t *imgdat = load_png_data(fname, &png_w, &png_h, &state);
-	if (!imgdat) return -1;
 	if (frame_w > png_w || frame_h > png_h)
 	{
 		printf("Frame size (%d x %d) exceed source image (%d x %d)\n",
 		       frame_w, frame_h, png_w, png_h);
+		exit_code = -1;
 		goto finished;
 	}
 
@@ -402,17 +1282,81 @@ int main(int argc, char **argv)
 	//
 	// Generate XSP data.
 	//
-	if (!record_init(outname, mode, bundle)) goto finished;
+	if (!record_init(outname, mode, bundle))
+	{
+		exit_code = -1;
+		goto finished;
+	}
+	if (spill_fname && !record_set_spill(spill_fname))
+	{
+		record_discard();
+		exit_code = -1;
+		goto finished;
+	}
+	record_set_box_output(extents);
+	record_set_msk_output(masks);
+	record_set_fade_steps(fade_steps);
+	record_set_index_output(index);
+	record_set_dedupe(level >= pass_min_level(PASS_DEDUPE));
+	if (!record_set_window(window))
+	{
+		record_discard();
+		exit_code = -1;
+		goto finished;
+	}
+	if (base_fname && !record_load_base(base_fname, base_link))
+	{
+		record_discard();
+		exit_code = -1;
+		goto finished;
+	}
+	if (snapshot_fname && !cache_hit && !snapshot_open(snapshot_fname))
+	{
+		record_discard();
+		exit_code = -1;
+		goto finished;
+	}
 
-	// Chop sprites out of the image data.
-	const int sprite_rows = png_h / frame_h;
-	const int sprite_columns = png_w / frame_w;
-	for (int y = 0; y < sprite_rows; y++)
+	// Chop sprites out of the image data, or restore them from the sheet
+	// cache. The time budget covers every pass from here on.
+	phase_start = time_us();
+	const uint64_t deadline_us = (budget_ms > 0) ?
+	                             phase_start + (1000 * (uint64_t)budget_ms) : 0;
+	if (cache_hit)
 	{
-		for (int x = 0; x < sprite_columns; x++)
+		const bool restored = sheet_cache_restore(origin_x, origin_y);
+		convert_us = time_us() - phase_start;
+		if (!restored)
+		{
+			record_discard();
+			exit_code = -1;
+			goto finished;
+		}
+	}
+	else
+	{
+		const bool chopped = chop_sheet(imgdat, png_w, png_h, unchanged, mode,
+		                                level, deadline_us, origin_x, origin_y,
+		                                frame_w, frame_h);
+		convert_us = time_us() - phase_start;
+		if (!chopped ||
+		    !chop_extra_sheets(extra_inputs, extra_count, fname, &state,
+		                       mode, level, deadline_us, origin_x, origin_y,
+		                       frame_w, frame_h, &decode_us, &convert_us))
+		{
+			record_discard();
+			exit_code = -1;
+			goto finished;
+		}
+
+		// The snapshot refers to patterns by their index before the passes
+		// below renumber them.
+		snapshot_save();
+		if (mode == CONV_MODE_XOBJ)
 		{
-			chop_sprite(imgdat, png_w, png_h, mode, origin_x, origin_y,
-			            x * frame_w, y * frame_h, frame_w, frame_h);
+			phase_start = time_us();
+			passes_run(level, deadline_us);
+			convert_us += time_us() - phase_start;
 		}
 	}
 
@@ -421,40 +1365,145 @@ int main(int argc, char **argv)
 	printf("--------------------\n");
 	if (mode == CONV_MODE_SP)
 	{
-		printf("SP:\t%d\n", record_get_pcg_count());
+		printf("SP:\t%d\n", record_get_pcg_written_count());
 	}
 	else
 	{
-		printf("XSP:\t%d\n", record_get_pcg_count());
+		printf("XSP:\t%d\n", record_get_pcg_written_count());
 		printf("FRM:\t%d\n", record_get_frm_offs() / 8);
+		if (record_get_frm_pooled() > 0)
+		{
+			printf("Pooled:\t%d\n", record_get_frm_pooled());
+		}
+		if (snapshot_active())
+		{
+			printf("Warm:\t%d of %d frames\n", snapshot_get_replayed(),
+			       snapshot_get_frame_count());
+		}
 		printf("REF:\t%d\n", record_get_ref_count());
 	}
+	if (window > 0 && mode == CONV_MODE_XOBJ && !cache_hit)
+	{
+		const int global = record_get_global_pcg_count();
+		printf("Window:\t%d frames, %d patterns against ~%d global (+%d bytes)\n",
+		       window, record_get_pcg_count(), global,
+		       128 * (record_get_pcg_count() - global));
+	}
+	if (cache_hit) printf("Cached:\tfrom %s\n", cache_fname);
+	if (spill_fname)
+	{
+		printf("Spill:\t%zu KB in %s\n", record_get_spill_bytes() / 1024,
+		       spill_fname);
+	}
 	printf("--------------------\n");
+	set_record_metrics();
+	if (snapshot_active())
+	{
+		const int replayed = snapshot_get_replayed();
+		metrics_counter("png2xsp_snapshot_frames_total", "result=\"hit\"",
+		                "Frames looked up in the warm snapshot.", replayed);
+		metrics_counter("png2xsp_snapshot_frames_total", "result=\"miss\"",
+		                NULL, snapshot_get_frame_count() - replayed);
+	}
+	if (cache_fname)
+	{
+		metrics_counter("png2xsp_sheet_cache_lookups_total", "result=\"hit\"",
+		                "Sheet cache lookups.", cache_hit);
+		metrics_counter("png2xsp_sheet_cache_lookups_total", "result=\"miss\"",
+		                NULL, !cache_hit);
+	}
+	if (timing || level != OPT_LEVEL_DEFAULT)
+	{
+		passes_report(level);
+		printf("--------------------\n");
+	}
 
 	//
 	// Extract the palette.
 	//
 
-	// The first index is always transparent, so we just set it to 0.
-	record_pal_dat(0, 0);
-	for (int i = 1; i < 16; i++)
+	// A restored sheet brings its palette with it.
+	if (!cache_hit)
 	{
-		// LodePNG palette data is sets of four bytes in RGBA order.
-		const int offs = i * 4;
-		const uint8_t r = state.info_png.color.palette[offs + 0];
-		const uint8_t g = state.info_png.color.palette[offs + 1];
-		const uint8_t b = state.info_png.color.palette[offs + 2];
-		// Conversion to X68000 RGB555.
-		const uint16_t entry = (((r >> 3) & 0x1F) << 6) |
-		                       (((g >> 3) & 0x1F) << 11) |
-		                       (((b >> 3) & 0x1F) << 1);
-		record_pal_dat(i, entry);
+		// The first index is always transparent, so we just set it to 0.
+		record_pal_dat(0, 0);
+		for (int i = 1; i < 16; i++)
+		{
+			// LodePNG palette data is sets of four bytes in RGBA order.
+			const int offs = i * 4;
+			const uint8_t r = state.info_png.color.palette[offs + 0];
+			const uint8_t g = state.info_png.color.palette[offs + 1];
+			const uint8_t b = state.info_png.color.palette[offs + 2];
+			// Conversion to X68000 RGB555.
+			record_pal_dat(i, rgb_to_x68k(r, g, b));
+		}
 	}
 
-	record_complete();
+	phase_start = time_us();
+	if (cache_fname && !cache_hit)
+	{
+		const SheetCacheInfo info = {png_w, png_h, frame_w, frame_h,
+		                             origin_x, origin_y};
+		sheet_cache_save(cache_fname, cache_key, &info);
+	}
+	const bool written = record_write(outname);
+	if (!written) exit_code = -1;
+	size_t patch_bytes = 0;
+	if (prev_fname)
+	{
+		if (patch_write(prev_fname, outname, bundle, &patch_bytes))
+		{
+			printf("Patch:\t%zu bytes against %s --> %s.XPD\n", patch_bytes,
+			       prev_fname, outname);
+		}
+		else
+		{
+			exit_code = -1;
+		}
+	}
+	// Costs are measured on the files as written.
+	if (profile && written)
+	{
+		printf("--------------------\n");
+		cost_report(outname, mode, bundle, fade_steps);
+		printf("--------------------\n");
+	}
+
+	// Each origin variant is the same data, moved to another origin.
+	int shifted_x = origin_x;
+	int shifted_y = origin_y;
+	for (int i = 0; i < variant_count; i++)
+	{
+		record_shift_origin(variant_x[i] - shifted_x, variant_y[i] - shifted_y);
+		shifted_x = variant_x[i];
+		shifted_y = variant_y[i];
+		char variant_name[256];
+		snprintf(variant_name, sizeof(variant_name), "%s_%d_%d", outname,
+		         shifted_x, shifted_y);
+		if (!record_write(variant_name)) exit_code = -1;
+	}
+	record_discard();
+	const uint64_t write_us = time_us() - phase_start;
+	metrics_gauge("png2xsp_phase_seconds", "phase=\"decode\"",
+	              "Time taken by each phase of the conversion.",
+	              decode_us / 1000000.0);
+	metrics_gauge("png2xsp_phase_seconds", "phase=\"convert\"", NULL,
+	              convert_us / 1000000.0);
+	metrics_gauge("png2xsp_phase_seconds", "phase=\"write\"", NULL,
+	              write_us / 1000000.0);
+	if (timing)
+	{
+		printf("Decode:\t%.3f ms\n", decode_us / 1000.0);
+		printf("Convert:\t%.3f ms\n", convert_us / 1000.0);
+		printf("Write:\t%.3f ms\n", write_us / 1000.0);
+	}
 
 finished:
+	metrics_write();
+	snapshot_close();
+	sheet_cache_close();
 	free(imgdat);
+	free(unchanged);
 
-	return 0;
+	return exit_code;
 }
@@ -0,0 +1,443 @@
+#include "manifest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "metrics.h"
+#include "util.h"
+
+#define MANIFEST_JOB_MAX_COUNT 1024
+#define MANIFEST_LINE_MAX 1024
+#define MANIFEST_ARG_MAX_COUNT 64
+
+// Opaque pixels cost a great deal more to convert than transparent ones, which
+// are only scanned over while claiming sprites.
+#define ESTIMATE_AREA_DIVISOR 16
+
+// Nanoseconds per unit of weight, until the history says otherwise. Measured
+// on the sample sheets.
+#define ESTIMATE_NS_PER_WEIGHT 300
+
+typedef struct ManifestJob
+{
+	char line[MANIFEST_LINE_MAX];  // As written, for the history.
+	char args[MANIFEST_LINE_MAX];  // Tokenized into argv.
+	char *argv[MANIFEST_ARG_MAX_COUNT + 2];
+	const char *input;
+
+	// Pixel counts of the input, for estimates. Zero if unknown.
+	uint64_t area;
+	uint64_t opaque;
+
+	uint64_t est_us;  // Expected duration.
+	bool from_history;
+	uint64_t took_us;  // Measured duration.
+	bool failed;
+	FILE *output;  // What the job prints, while it runs. NULL if discarded.
+} ManifestJob;
+
+static ManifestJob s_jobs[MANIFEST_JOB_MAX_COUNT];
+static int s_job_count = 0;
+
+// Splits a job line into arguments, and finds the input file name among them.
+// Options followed by ':' in options take an argument.
+static bool parse_job(ManifestJob *job, const char *progname,
+                      const char *options)
+{
+	int argc = 0;
+	job->argv[argc++] = (char *)progname;
+	job->input = NULL;
+	bool takes_arg = false;
+	for (char *tok = strtok(job->args, " \t\r\n"); tok;
+	     tok = strtok(NULL, " \t\r\n"))
+	{
+		if (argc > MANIFEST_ARG_MAX_COUNT) return false;
+		job->argv[argc++] = tok;
+		if (takes_arg)
+		{
+			takes_arg = false;
+		}
+		else if (tok[0] == '-' && tok[1] != '\0')
+		{
+			const char *opt = (tok[1] != ':') ? strchr(options, tok[1]) : NULL;
+			takes_arg = tok[2] == '\0' && opt && opt[1] == ':';
+		}
+		else if (!job->input)
+		{
+			job->input = tok;
+		}
+	}
+	job->argv[argc] = NULL;
+	return job->input != NULL;
+}
+
+static bool load_manifest(const char *fname, const char *progname,
+                          const char *options)
+{
+	FILE *f = fopen(fname, "r");
+	if (!f)
+	{
+		printf("Couldn't open manifest %s.\n", fname);
+		return false;
+	}
+
+	char line[MANIFEST_LINE_MAX];
+	int line_no = 0;
+	s_job_count = 0;
+	bool ret = true;
+	while (fgets(line, sizeof(line), f))
+	{
+		line_no++;
+		line[strcspn(line, "\r\n")] = '\0';
+		const char *start = line + strspn(line, " \t");
+		if (start[0] == '\0' || start[0] == '#') continue;
+		if (s_job_count >= MANIFEST_JOB_MAX_COUNT)
+		{
+			printf("%s:%d: too many jobs\n", fname, line_no);
+			ret = false;
+			break;
+		}
+		ManifestJob *job = &s_jobs[s_job_count];
+		memset(job, 0, sizeof(*job));
+		snprintf(job->line, sizeof(job->line), "%s", start);
+		snprintf(job->args, sizeof(job->args), "%s", start);
+		if (!parse_job(job, progname, options))
+		{
+			printf("%s:%d: expected an input file and options\n",
+			       fname, line_no);
+			ret = false;
+			break;
+		}
+		s_job_count++;
+	}
+	fclose(f);
+	if (ret && s_job_count == 0)
+	{
+		printf("%s lists no jobs.\n", fname);
+		ret = false;
+	}
+	return ret;
+}
+
+// Counts the pixels in a job's input. Inputs that aren't PNG files (such as
+// composition lists) are left unknown.
+static void measure_input(ManifestJob *job, uint8_t **buf, size_t *buf_size)
+{
+	uint8_t *png;
+	size_t fsize;
+	if (lodepng_load_file(&png, &fsize, job->input) != 0) return;
+	unsigned int w, h;
+	LodePNGState state;
+	if (decode_png_into(png, fsize, buf, buf_size, &w, &h, &state))
+	{
+		job->area = (uint64_t)w * h;
+		for (uint64_t i = 0; i < job->area; i++) job->opaque += ((*buf)[i] != 0);
+	}
+	lodepng_state_cleanup(&state);
+	free(png);
+}
+
+static uint64_t job_weight(const ManifestJob *job)
+{
+	return (job->area / ESTIMATE_AREA_DIVISOR) + job->opaque;
+}
+
+// History lines are "<microseconds> <area> <opaque> <job line>".
+static void load_history(const char *fname)
+{
+	FILE *f = fopen(fname, "r");
+	if (!f) return;
+	char line[MANIFEST_LINE_MAX + 64];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		unsigned long long us, area, opaque;
+		int consumed;
+		if (sscanf(line, "%llu %llu %llu %n", &us, &area, &opaque,
+		           &consumed) != 3)
+		{
+			continue;
+		}
+		for (int i = 0; i < s_job_count; i++)
+		{
+			ManifestJob *job = &s_jobs[i];
+			if (strcmp(job->line, line + consumed) != 0) continue;
+			job->est_us = us;
+			job->area = area;
+			job->opaque = opaque;
+			job->from_history = true;
+		}
+	}
+	fclose(f);
+}
+
+static void save_history(const char *fname)
+{
+	FILE *f = fopen(fname, "w");
+	if (!f)
+	{
+		printf("Couldn't write history %s.\n", fname);
+		return;
+	}
+	for (int i = 0; i < s_job_count; i++)
+	{
+		const ManifestJob *job = &s_jobs[i];
+		// A failed job's time says little about a successful one. Otherwise
+		// the new time is averaged with the old, to smooth over noisy runs.
+		if (job->failed && !job->from_history) continue;
+		uint64_t us = job->took_us;
+		if (job->failed) us = job->est_us;
+		else if (job->from_history) us = (job->est_us + job->took_us) / 2;
+		fprintf(f, "%llu %llu %llu %s\n", (unsigned long long)us,
+		        (unsigned long long)job->area,
+		        (unsigned long long)job->opaque, job->line);
+	}
+	fclose(f);
+}
+
+// Fills in the expected duration of jobs missing from the history, from what
+// the jobs that are in it cost per unit of weight.
+static void estimate_jobs(void)
+{
+	uint64_t known_us = 0;
+	uint64_t known_weight = 0;
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
+	for (int i = 0; i < s_job_count; i++)
+	{
+		ManifestJob *job = &s_jobs[i];
+		if (!job->from_history)
+		{
+			measure_input(job, &buf, &buf_size);
+			continue;
+		}
+		known_us += job->est_us;
+		known_weight += job_weight(job);
+	}
+	free(buf);
+
+	for (int i = 0; i < s_job_count; i++)
+	{
+		ManifestJob *job = &s_jobs[i];
+		if (job->from_history) continue;
+		job->est_us = (known_weight > 0) ?
+		              (job_weight(job) * known_us) / known_weight :
+		              (job_weight(job) * ESTIMATE_NS_PER_WEIGHT) / 1000;
+	}
+}
+
+// Orders jobs by expected duration, longest first. Ties keep manifest order.
+static void schedule_jobs(int *order)
+{
+	for (int i = 0; i < s_job_count; i++)
+	{
+		const int idx = i;
+		int j = i;
+		while (j > 0 && s_jobs[order[j - 1]].est_us < s_jobs[idx].est_us)
+		{
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = idx;
+	}
+}
+
+// Length of the build if jobs are started in the given order on workers that
+// each take the next job as soon as they are free, with the measured durations.
+static uint64_t makespan(const int *order, int workers)
+{
+	uint64_t busy[MANIFEST_JOB_MAX_COUNT] = {0};
+	if (workers > MANIFEST_JOB_MAX_COUNT) workers = MANIFEST_JOB_MAX_COUNT;
+	uint64_t ret = 0;
+	for (int i = 0; i < s_job_count; i++)
+	{
+		int next = 0;
+		for (int w = 1; w < workers; w++)
+		{
+			if (busy[w] < busy[next]) next = w;
+		}
+		busy[next] += s_jobs[order[i]].took_us;
+		if (busy[next] > ret) ret = busy[next];
+	}
+	return ret;
+}
+
+#ifdef _WIN32
+
+static int default_workers(void)
+{
+	return 1;
+}
+
+static bool run_jobs(const int *order, int workers)
+{
+	printf("Manifest builds are not supported on this platform.\n");
+	return false;
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int default_workers(void)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? cpus : 1;
+}
+
+static void set_job_metrics(int queued, int running, int done, int failed)
+{
+	const char *help = "Manifest jobs by state.";
+	metrics_gauge("png2xsp_jobs", "state=\"queued\"", help, queued);
+	metrics_gauge("png2xsp_jobs", "state=\"running\"", help, running);
+	metrics_gauge("png2xsp_jobs", "state=\"done\"", help, done - failed);
+	metrics_gauge("png2xsp_jobs", "state=\"failed\"", help, failed);
+}
+
+// Output from concurrent jobs would only be interleaved, so each job writes to
+// a file of its own, which is shown if the job fails.
+static pid_t start_job(ManifestJob *job)
+{
+	job->output = tmpfile();
+	fflush(stdout);
+	const pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	const int out_fd = job->output ? fileno(job->output) :
+	                                 open("/dev/null", O_WRONLY);
+	if (out_fd >= 0)
+	{
+		dup2(out_fd, STDOUT_FILENO);
+		dup2(out_fd, STDERR_FILENO);
+	}
+	execvp(job->argv[0], job->argv);
+	printf("Couldn't run %s.\n", job->argv[0]);
+	fflush(stdout);
+	_exit(127);
+}
+
+// Prints what a failed job wrote, indented under the job, and lets it go.
+static void finish_job_output(ManifestJob *job)
+{
+	if (!job->output) return;
+	if (job->failed)
+	{
+		rewind(job->output);
+		char line[MANIFEST_LINE_MAX];
+		while (fgets(line, sizeof(line), job->output))
+		{
+			printf("    %s", line);
+			if (line[strlen(line) - 1] != '\n') printf("\n");
+		}
+	}
+	fclose(job->output);
+	job->output = NULL;
+}
+
+static bool run_jobs(const int *order, int workers)
+{
+	static pid_t pids[MANIFEST_JOB_MAX_COUNT];
+	static uint64_t started[MANIFEST_JOB_MAX_COUNT];
+	for (int i = 0; i < s_job_count; i++) pids[i] = 0;
+	int running = 0;
+	int next = 0;
+	int done = 0;
+	int failed = 0;
+	bool ret = true;
+	while (done < s_job_count)
+	{
+		while (running < workers && next < s_job_count)
+		{
+			const int idx = order[next++];
+			started[idx] = time_us();
+			pids[idx] = start_job(&s_jobs[idx]);
+			if (pids[idx] < 0)
+			{
+				if (s_jobs[idx].output) fclose(s_jobs[idx].output);
+				s_jobs[idx].output = NULL;
+				printf("Couldn't start job: %s\n", s_jobs[idx].line);
+				s_jobs[idx].failed = true;
+				ret = false;
+				done++;
+				failed++;
+				continue;
+			}
+			running++;
+		}
+		set_job_metrics(s_job_count - next, running, done, failed);
+		if (metrics_due()) metrics_write();
+		if (running == 0) break;
+
+		int status;
+		const pid_t pid = wait(&status);
+		if (pid < 0) break;
+		for (int i = 0; i < s_job_count; i++)
+		{
+			ManifestJob *job = &s_jobs[i];
+			if (pids[i] != pid || job->took_us) continue;
+			job->took_us = time_us() - started[i];
+			job->failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+			done++;
+			printf("[%d/%d] %8.1f ms (expected %.1f) %s%s\n", done, s_job_count,
+			       job->took_us / 1000.0, job->est_us / 1000.0,
+			       job->failed ? "FAILED: " : "", job->line);
+			finish_job_output(job);
+			metrics_observe(METRICS_JOB_SECONDS, job->took_us);
+			if (job->failed)
+			{
+				ret = false;
+				failed++;
+			}
+			break;
+		}
+		running--;
+	}
+	set_job_metrics(s_job_count - next, running, done, failed);
+	return ret;
+}
+
+#endif  // _WIN32
+
+bool manifest_build(const char *progname, const char *options,
+                    const char *fname, int jobs)
+{
+	if (!load_manifest(fname, progname, options)) return false;
+	if (jobs < 1) jobs = default_workers();
+
+	char history_fname[256];
+	snprintf(history_fname, sizeof(history_fname), "%s.history", fname);
+	load_history(history_fname);
+	estimate_jobs();
+
+	int known = 0;
+	for (int i = 0; i < s_job_count; i++) known += s_jobs[i].from_history;
+	printf("Manifest: %s (%d jobs, %d from history, %d at once)\n",
+	       fname, s_job_count, known, jobs);
+	printf("--------------------\n");
+
+	static int order[MANIFEST_JOB_MAX_COUNT];
+	schedule_jobs(order);
+	const uint64_t start = time_us();
+	const bool ret = run_jobs(order, jobs);
+	const uint64_t wall_us = time_us() - start;
+	save_history(history_fname);
+	metrics_gauge("png2xsp_build_seconds", NULL,
+	              "Wall time of the manifest build.", wall_us / 1000000.0);
+	metrics_write();
+
+	// The same jobs, started in the order they are listed.
+	static int listed[MANIFEST_JOB_MAX_COUNT];
+	for (int i = 0; i < s_job_count; i++) listed[i] = i;
+	printf("--------------------\n");
+	printf("Wall:\t%.1f ms\n", wall_us / 1000.0);
+	printf("Makespan, longest first:\t%.1f ms\n", makespan(order, jobs) / 1000.0);
+	printf("Makespan, manifest order:\t%.1f ms\n",
+	       makespan(listed, jobs) / 1000.0);
+	return ret;
+}
@@ -0,0 +1,33 @@
+// Parallel builds of many sheets, listed in a manifest.
+//
+// Each line of a manifest holds the arguments for one conversion, exactly as
+// they would be given to png2xsp, separated by whitespace. Blank lines and lines
+// starting with '#' are skipped. For example:
+//
+//     # Player and enemies
+//     player.png -w 32 -h 48 -y 40 -o out/PLAYER
+//     enemy.png -w 16 -h 16 -b -o out/ENEMY
+//
+// Jobs are started longest first, so that the biggest sheets don't end up
+// running alone at the end of the build. Job lengths come from a history of
+// earlier builds, kept next to the manifest as <manifest>.history. Jobs not
+// found there are estimated from the area and opaque pixel count of their
+// input, scaled by what earlier jobs cost per pixel.
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdbool.h>
+
+// Runs every job in the manifest fname with up to jobs at once (or one per
+// processor if jobs is 0), by running progname for each, then updates the
+// history with the time each job took. options is progname's getopt() option
+// string, which tells options that take an argument from input files.
+// Job output is held back; failed jobs are reported with their arguments,
+// followed by what they printed.
+// The measured makespan is printed along with the one the same jobs would
+// have had if started in manifest order.
+// Returns true if every job succeeded.
+bool manifest_build(const char *progname, const char *options,
+                    const char *fname, int jobs);
+
+#endif  // MANIFEST_H
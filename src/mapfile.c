@@ -0,0 +1,206 @@
+#include "mapfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool is_shm_name(const char *fname)
+{
+	return strncmp(fname, SHM_NAME_PREFIX, strlen(SHM_NAME_PREFIX)) == 0;
+}
+
+#ifdef _WIN32
+
+const uint8_t *map_file(const char *fname, size_t *size)
+{
+	FILE *f = fopen(fname, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	const long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *ret = (len > 0) ? malloc(len) : NULL;
+	if (ret && fread(ret, 1, len, f) != (size_t)len)
+	{
+		free(ret);
+		ret = NULL;
+	}
+	fclose(f);
+	*size = ret ? len : 0;
+	return ret;
+}
+
+void unmap_file(const uint8_t *dat, size_t size)
+{
+	free((void *)dat);
+}
+
+FILE *output_open(const char *fname)
+{
+	if (is_shm_name(fname))
+	{
+		printf("Shared memory output is not supported on this platform.\n");
+		return NULL;
+	}
+	return fopen(fname, "wb");
+}
+
+bool output_close(FILE *f, const char *fname)
+{
+	const bool ok = fflush(f) == 0 && !ferror(f);
+	return fclose(f) == 0 && ok;
+}
+
+bool spill_open(SpillFile *spill, const char *fname, size_t capacity)
+{
+	spill->fd = -1;
+	spill->dat = NULL;
+	spill->capacity = 0;
+	return spill_reserve(spill, capacity);
+}
+
+bool spill_open_temp(SpillFile *spill, char *fname, size_t len,
+                     size_t capacity)
+{
+	fname[0] = '\0';
+	return spill_open(spill, fname, capacity);
+}
+
+bool spill_reserve(SpillFile *spill, size_t capacity)
+{
+	if (capacity <= spill->capacity) return true;
+	uint8_t *grown = realloc(spill->dat, capacity);
+	if (!grown) return false;
+	spill->dat = grown;
+	spill->capacity = capacity;
+	return true;
+}
+
+void spill_release(SpillFile *spill, size_t offs, size_t bytes)
+{
+}
+
+void spill_close(SpillFile *spill)
+{
+	free(spill->dat);
+	spill->dat = NULL;
+	spill->capacity = 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint8_t *map_file(const char *fname, size_t *size)
+{
+	const int fd = is_shm_name(fname) ?
+	               shm_open(fname + strlen(SHM_NAME_PREFIX), O_RDONLY, 0) :
+	               open(fname, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	void *ret = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);  // The mapping remains valid without the descriptor.
+	if (ret == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return ret;
+}
+
+void unmap_file(const uint8_t *dat, size_t size)
+{
+	if (dat) munmap((void *)dat, size);
+}
+
+FILE *output_open(const char *fname)
+{
+	if (!is_shm_name(fname)) return fopen(fname, "wb");
+	const char *name = fname + strlen(SHM_NAME_PREFIX);
+	shm_unlink(name);
+	const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return NULL;
+	FILE *f = fdopen(fd, "wb");
+	if (!f)
+	{
+		close(fd);
+		shm_unlink(name);
+	}
+	return f;
+}
+
+bool output_close(FILE *f, const char *fname)
+{
+	bool ok = fflush(f) == 0 && !ferror(f);
+	if (is_shm_name(fname)) ok = fchmod(fileno(f), 0444) == 0 && ok;
+	return fclose(f) == 0 && ok;
+}
+
+bool spill_open(SpillFile *spill, const char *fname, size_t capacity)
+{
+	spill->dat = NULL;
+	spill->capacity = 0;
+	spill->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (spill->fd < 0) return false;
+	if (!spill_reserve(spill, capacity))
+	{
+		spill_close(spill);
+		return false;
+	}
+	return true;
+}
+
+bool spill_open_temp(SpillFile *spill, char *fname, size_t len,
+                     size_t capacity)
+{
+	const char *dir = getenv("TMPDIR");
+	snprintf(fname, len, "%s/png2xsp-XXXXXX", (dir && dir[0]) ? dir : "/tmp");
+	spill->dat = NULL;
+	spill->capacity = 0;
+	spill->fd = mkstemp(fname);
+	if (spill->fd < 0) return false;
+	if (!spill_reserve(spill, capacity))
+	{
+		spill_close(spill);
+		remove(fname);
+		return false;
+	}
+	return true;
+}
+
+bool spill_reserve(SpillFile *spill, size_t capacity)
+{
+	if (capacity <= spill->capacity) return true;
+	if (ftruncate(spill->fd, capacity) != 0) return false;
+	void *grown = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                   spill->fd, 0);
+	if (grown == MAP_FAILED) return false;
+	if (spill->dat) munmap(spill->dat, spill->capacity);
+	spill->dat = grown;
+	spill->capacity = capacity;
+	return true;
+}
+
+void spill_release(SpillFile *spill, size_t offs, size_t bytes)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t first = (offs + page - 1) / page * page;
+	const size_t last = (offs + bytes) / page * page;
+	if (!spill->dat || last <= first) return;
+	madvise(spill->dat + first, last - first, MADV_DONTNEED);
+}
+
+void spill_close(SpillFile *spill)
+{
+	if (spill->dat) munmap(spill->dat, spill->capacity);
+	if (spill->fd >= 0) close(spill->fd);
+	spill->dat = NULL;
+	spill->capacity = 0;
+	spill->fd = -1;
+}
+
+#endif  // _WIN32
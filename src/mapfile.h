@@ -0,0 +1,68 @@
+// Read-only file mapping, used to consume previously emitted data in place.
+//
+// Output and mapped names of the form "shm:/name" refer to POSIX shared memory
+// objects rather than files, so that a local client can map a result without
+// it going through the file system. Output is still written through stdio, so
+// its bytes are copied once on the way into the object.
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SHM_NAME_PREFIX "shm:"
+
+// Returns true if fname names a shared memory object rather than a file.
+bool is_shm_name(const char *fname);
+
+// Maps fname read-only, setting size to its length in bytes. Pages are only
+// brought in as they are touched. Where mmap is unavailable the file is read
+// into memory instead. Returns NULL on error or if the file is empty.
+const uint8_t *map_file(const char *fname, size_t *size);
+
+// Releases a mapping created by map_file.
+void unmap_file(const uint8_t *dat, size_t size);
+
+// Creates fname for writing, replacing what was there. A shared memory object
+// is created anew, so a client that still has the last one mapped keeps it
+// intact. Returns NULL on error.
+FILE *output_open(const char *fname);
+
+// Closes a file from output_open. A shared memory object is made read-only
+// first. This is only advisory: the object isn't sealed, so a process of the
+// same user can still open it for writing, or make it writable again. Returns
+// false if any write to f failed.
+bool output_close(FILE *f, const char *fname);
+
+// Writable scratch file, mapped so that its contents are paged to disk rather
+// than held in memory. Data is only ever appended, so the kernel writes it back
+// in order. Where mmap is unavailable the data is kept in memory instead.
+typedef struct SpillFile
+{
+	int fd;
+	uint8_t *dat;
+	size_t capacity;
+} SpillFile;
+
+// Creates (or truncates) fname and maps capacity bytes of it.
+bool spill_open(SpillFile *spill, const char *fname, size_t capacity);
+
+// Creates a new, uniquely named spill file in TMPDIR (or /tmp), and writes its
+// name to fname. Where the data is kept in memory, fname is left empty.
+bool spill_open_temp(SpillFile *spill, char *fname, size_t len,
+                     size_t capacity);
+
+// Grows the file and mapping to at least capacity bytes. dat may move.
+bool spill_reserve(SpillFile *spill, size_t capacity);
+
+// Lets go of the pages that lie wholly within bytes [offs, offs + bytes). Their
+// contents stay in the file, and are read back in if touched again. Does
+// nothing where the data is kept in memory.
+void spill_release(SpillFile *spill, size_t offs, size_t bytes);
+
+// Unmaps and closes the file, leaving it in place.
+void spill_close(SpillFile *spill);
+
+#endif  // MAPFILE_H
@@ -0,0 +1,208 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#define METRICS_MAX_COUNT 64
+#define METRICS_NAME_MAX 64
+#define METRICS_LABELS_MAX 64
+
+typedef struct Metric
+{
+	char name[METRICS_NAME_MAX];
+	char labels[METRICS_LABELS_MAX];
+	const char *help;
+	const char *type;
+	double value;
+} Metric;
+
+typedef struct Histogram
+{
+	const char *name;
+	const char *help;
+	uint64_t buckets[16];  // Not cumulative; summed as they are written.
+	uint64_t count;
+	double sum;
+} Histogram;
+
+// Upper bounds of the histogram buckets, from a single frame up to a big job.
+static const double k_bucket_bounds[16] =
+{
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+static const char *s_fname;
+static uint64_t s_last_write_us;
+static Metric s_metrics[METRICS_MAX_COUNT];
+static int s_metric_count = 0;
+static Histogram s_histograms[METRICS_HISTOGRAM_COUNT] =
+{
+	[METRICS_FRAME_SECONDS] = {"png2xsp_frame_seconds",
+	                           "Time taken to convert one frame."},
+	[METRICS_JOB_SECONDS] = {"png2xsp_job_seconds",
+	                         "Time taken by one manifest job."},
+};
+
+void metrics_open(const char *fname)
+{
+	s_fname = fname;
+	s_last_write_us = time_us();
+}
+
+bool metrics_active(void)
+{
+	return s_fname != NULL;
+}
+
+static void metrics_set(const char *name, const char *labels, const char *help,
+                        const char *type, double value)
+{
+	if (!s_fname) return;
+	if (!labels) labels = "";
+	for (int i = 0; i < s_metric_count; i++)
+	{
+		Metric *metric = &s_metrics[i];
+		if (strcmp(metric->name, name) != 0 || strcmp(metric->labels, labels) != 0)
+		{
+			continue;
+		}
+		metric->value = value;
+		return;
+	}
+	if (s_metric_count >= METRICS_MAX_COUNT) return;
+	Metric *metric = &s_metrics[s_metric_count++];
+	snprintf(metric->name, sizeof(metric->name), "%s", name);
+	snprintf(metric->labels, sizeof(metric->labels), "%s", labels);
+	metric->help = help;
+	metric->type = type;
+	metric->value = value;
+}
+
+void metrics_gauge(const char *name, const char *labels, const char *help,
+                   double value)
+{
+	metrics_set(name, labels, help, "gauge", value);
+}
+
+void metrics_counter(const char *name, const char *labels, const char *help,
+                     double value)
+{
+	metrics_set(name, labels, help, "counter", value);
+}
+
+void metrics_observe(MetricsHistogram hist, uint64_t us)
+{
+	if (!s_fname) return;
+	Histogram *histogram = &s_histograms[hist];
+	const double seconds = us / 1000000.0;
+	histogram->count++;
+	histogram->sum += seconds;
+	for (int i = 0; i < ARRAYSIZE(k_bucket_bounds); i++)
+	{
+		if (seconds > k_bucket_bounds[i]) continue;
+		histogram->buckets[i]++;
+		break;
+	}
+}
+
+bool metrics_due(void)
+{
+	return s_fname && time_us() - s_last_write_us >= METRICS_INTERVAL_US;
+}
+
+static void write_metrics(FILE *f)
+{
+	for (int i = 0; i < s_metric_count; i++)
+	{
+		const Metric *metric = &s_metrics[i];
+		bool seen = false;
+		for (int j = 0; j < i && !seen; j++)
+		{
+			seen = strcmp(s_metrics[j].name, metric->name) == 0;
+		}
+		if (seen) continue;
+
+		if (metric->help) fprintf(f, "# HELP %s %s\n", metric->name, metric->help);
+		fprintf(f, "# TYPE %s %s\n", metric->name, metric->type);
+		for (int j = i; j < s_metric_count; j++)
+		{
+			const Metric *entry = &s_metrics[j];
+			if (strcmp(entry->name, metric->name) != 0) continue;
+			if (entry->labels[0])
+			{
+				fprintf(f, "%s{%s} %.9g\n", entry->name, entry->labels, entry->value);
+			}
+			else
+			{
+				fprintf(f, "%s %.9g\n", entry->name, entry->value);
+			}
+		}
+	}
+}
+
+static void write_histograms(FILE *f)
+{
+	for (int i = 0; i < METRICS_HISTOGRAM_COUNT; i++)
+	{
+		const Histogram *histogram = &s_histograms[i];
+		if (histogram->count == 0) continue;
+		fprintf(f, "# HELP %s %s\n", histogram->name, histogram->help);
+		fprintf(f, "# TYPE %s histogram\n", histogram->name);
+		uint64_t total = 0;
+		for (int b = 0; b < ARRAYSIZE(k_bucket_bounds); b++)
+		{
+			total += histogram->buckets[b];
+			fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", histogram->name,
+			        k_bucket_bounds[b], (unsigned long long)total);
+		}
+		fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", histogram->name,
+		        (unsigned long long)histogram->count);
+		fprintf(f, "%s_sum %.9g\n", histogram->name, histogram->sum);
+		fprintf(f, "%s_count %llu\n", histogram->name,
+		        (unsigned long long)histogram->count);
+	}
+}
+
+bool metrics_write(void)
+{
+	if (!s_fname) return false;
+	s_last_write_us = time_us();
+
+#ifndef _WIN32
+	// ru_maxrss is in kilobytes.
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		metrics_gauge("png2xsp_max_resident_bytes", NULL,
+		              "Peak resident memory of this process.",
+		              1024.0 * usage.ru_maxrss);
+	}
+#endif
+
+	char tmp_fname[256];
+	snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", s_fname);
+	FILE *f = fopen(tmp_fname, "w");
+	if (!f)
+	{
+		printf("Couldn't write metrics %s.\n", tmp_fname);
+		return false;
+	}
+	write_metrics(f);
+	write_histograms(f);
+	const bool ok = !ferror(f);
+	fclose(f);
+	if (!ok || rename(tmp_fname, s_fname) != 0)
+	{
+		printf("Couldn't write metrics %s.\n", s_fname);
+		remove(tmp_fname);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,51 @@
+// Run metrics, written in the Prometheus text exposition format for graphing.
+//
+// png2xsp doesn't stay resident; the longest lived processes are manifest
+// builds and conversions of tall sheets. Metrics are kept in memory while one
+// runs, and the file given with -P is rewritten at most once every
+// METRICS_INTERVAL_US as it goes, and once more at the end. Each version is
+// written aside and renamed over the last, so a collector that polls the file
+// (such as the node exporter's textfile collector) never reads half of one.
+//
+// Values are identified by name and labels, such as "png2xsp_phase_seconds"
+// and "phase=\"decode\"". Entries sharing a name are written together, under
+// the help text and type given when the first was set.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define METRICS_INTERVAL_US 1000000
+
+typedef enum MetricsHistogram
+{
+	METRICS_FRAME_SECONDS,  // Converting one frame.
+	METRICS_JOB_SECONDS,  // Running one manifest job.
+	METRICS_HISTOGRAM_COUNT
+} MetricsHistogram;
+
+// Starts keeping metrics, to be written to fname.
+void metrics_open(const char *fname);
+
+// Returns true if metrics are being kept.
+bool metrics_active(void);
+
+// Sets a value that can go up or down, or a running total. labels may be NULL,
+// and so may help for any but the first entry of a name.
+void metrics_gauge(const char *name, const char *labels, const char *help,
+                   double value);
+void metrics_counter(const char *name, const char *labels, const char *help,
+                     double value);
+
+// Adds a duration to a histogram.
+void metrics_observe(MetricsHistogram hist, uint64_t us);
+
+// Returns true if the file is due to be written again.
+bool metrics_due(void);
+
+// Writes every value kept so far, along with the peak memory use of the
+// process. Does nothing if metrics aren't being kept.
+bool metrics_write(void);
+
+#endif  // METRICS_H
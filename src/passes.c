@@ -0,0 +1,244 @@
+#include "passes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "util.h"
+
+typedef struct PassReport
+{
+	const char *name;
+	int min_level;
+	uint64_t us;
+	int patterns;
+	int sprites;
+	int frm_entries;
+	bool cut_short;
+} PassReport;
+
+// In pipeline order.
+static PassReport s_passes[PASS_COUNT] =
+{
+	[PASS_TILE] = {"tile", 0},
+	[PASS_SEARCH] = {"search", 3},
+	[PASS_DEDUPE] = {"dedupe", 1},
+	[PASS_FLIP] = {"flip", 2},
+	[PASS_SHARE] = {"share", 2},
+};
+
+int pass_min_level(PassId pass)
+{
+	return s_passes[pass].min_level;
+}
+
+bool pass_out_of_time(uint64_t deadline_us)
+{
+	return deadline_us != 0 && time_us() >= deadline_us;
+}
+
+void pass_account(PassId pass, uint64_t us, int patterns, int sprites,
+                  int frm_entries)
+{
+	PassReport *report = &s_passes[pass];
+	report->us += us;
+	report->patterns += patterns;
+	report->sprites += sprites;
+	report->frm_entries += frm_entries;
+}
+
+void pass_cut_short(PassId pass)
+{
+	s_passes[pass].cut_short = true;
+}
+
+//
+// Sharing the FRM data of frames that begin another frame.
+//
+
+// FRM positions are relative to the previous sprite, so a frame can only use
+// the FRM data of another if its sprites are the first ones of that frame.
+// Every prefix of every run is entered in a table, owned by the longest run
+// that starts with it; the owner of a run's own prefix is therefore never
+// redirected itself.
+typedef struct PrefixEntry
+{
+	uint32_t hash;
+	uint32_t first;  // FRM entry the owning run starts at.
+	uint16_t len;  // 0 marks an empty slot.
+	uint16_t owner_len;
+} PrefixEntry;
+
+static uint32_t prefix_hash_step(uint32_t hash, const FrmTable *frm, uint32_t i)
+{
+	const uint16_t fields[4] = {frm->vx[i], frm->vy[i], frm->pt[i], frm->rv[i]};
+	return fnv1a32(hash, fields, sizeof(fields));
+}
+
+static bool prefixes_equal(const FrmTable *frm, uint32_t a, uint32_t b,
+                           uint16_t len)
+{
+	const size_t bytes = sizeof(int16_t) * len;
+	return memcmp(&frm->vx[a], &frm->vx[b], bytes) == 0 &&
+	       memcmp(&frm->vy[a], &frm->vy[b], bytes) == 0 &&
+	       memcmp(&frm->pt[a], &frm->pt[b], bytes) == 0 &&
+	       memcmp(&frm->rv[a], &frm->rv[b], bytes) == 0;
+}
+
+// Finds the slot for the prefix of len entries from first, which is either the
+// one holding an equal prefix, or an empty one.
+static PrefixEntry *find_prefix(PrefixEntry *table, uint32_t mask,
+                                const FrmTable *frm, uint32_t hash,
+                                uint32_t first, uint16_t len)
+{
+	for (uint32_t slot = hash & mask; ; slot = (slot + 1) & mask)
+	{
+		PrefixEntry *entry = &table[slot];
+		if (entry->len == 0) return entry;
+		if (entry->hash == hash && entry->len == len &&
+		    (entry->first == first || prefixes_equal(frm, entry->first, first, len)))
+		{
+			return entry;
+		}
+	}
+}
+
+// Drops FRM entries no REF entry points into any more, and returns how many.
+static int compact_frm(FrmTable *frm, RefTable *ref)
+{
+	uint32_t *remap = malloc(sizeof(uint32_t) * (frm->count + 1));
+	uint8_t *used = calloc(frm->count + 1, 1);
+	if (!remap || !used)
+	{
+		free(remap);
+		free(used);
+		return 0;
+	}
+	for (int i = 0; i < ref->count; i++)
+	{
+		memset(&used[ref->first[i]], 1, ref->sp_count[i]);
+	}
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < frm->count; i++)
+	{
+		remap[i] = kept;
+		if (!used[i]) continue;
+		frm->vx[kept] = frm->vx[i];
+		frm->vy[kept] = frm->vy[i];
+		frm->pt[kept] = frm->pt[i];
+		frm->rv[kept] = frm->rv[i];
+		kept++;
+	}
+	remap[frm->count] = kept;
+	for (int i = 0; i < ref->count; i++) ref->first[i] = remap[ref->first[i]];
+	const int dropped = frm->count - kept;
+	frm->count = kept;
+	free(remap);
+	free(used);
+	return dropped;
+}
+
+static void share_prefixes(uint64_t deadline_us)
+{
+	const uint64_t start = time_us();
+	FrmTable *frm = record_get_frm_table();
+	RefTable *ref = record_get_ref_table();
+
+	// Runs are disjoint, so there are at most as many prefixes as entries.
+	uint32_t table_size = 16;
+	while (table_size < 2 * frm->count) table_size *= 2;
+	PrefixEntry *table = calloc(table_size, sizeof(PrefixEntry));
+	if (!table)
+	{
+		printf("Couldn't allocate FRM prefix table.\n");
+		return;
+	}
+	const uint32_t mask = table_size - 1;
+
+	bool cut_short = false;
+	for (int i = 0; i < ref->count && !cut_short; i++)
+	{
+		cut_short = pass_out_of_time(deadline_us);
+		const uint32_t first = ref->first[i];
+		const uint16_t len = ref->sp_count[i];
+		uint32_t hash = FNV1A32_INIT;
+		for (uint16_t l = 1; l <= len; l++)
+		{
+			hash = prefix_hash_step(hash, frm, first + l - 1);
+			PrefixEntry *entry = find_prefix(table, mask, frm, hash, first, l);
+			if (entry->len != 0 && entry->owner_len >= len) continue;
+			entry->hash = hash;
+			entry->first = first;
+			entry->len = l;
+			entry->owner_len = len;
+		}
+	}
+
+	int redirected = 0;
+	for (int i = 0; i < ref->count && !cut_short; i++)
+	{
+		cut_short = pass_out_of_time(deadline_us);
+		const uint32_t first = ref->first[i];
+		const uint16_t len = ref->sp_count[i];
+		if (len == 0) continue;
+		uint32_t hash = FNV1A32_INIT;
+		for (uint16_t l = 0; l < len; l++)
+		{
+			hash = prefix_hash_step(hash, frm, first + l);
+		}
+		const PrefixEntry *entry = find_prefix(table, mask, frm, hash, first, len);
+		if (entry->len == 0 || entry->first == first) continue;
+		ref->first[i] = entry->first;
+		redirected++;
+	}
+	free(table);
+
+	const int dropped = redirected ? compact_frm(frm, ref) : 0;
+	if (cut_short) pass_cut_short(PASS_SHARE);
+	pass_account(PASS_SHARE, time_us() - start, 0, 0, dropped);
+}
+
+void passes_run(int level, uint64_t deadline_us)
+{
+	// Merging looks over the whole bank, so it is left out of windowed dedupe.
+	if (level >= s_passes[PASS_FLIP].min_level && record_get_window() == 0)
+	{
+		const uint64_t start = time_us();
+		bool cut_short = false;
+		const int merged = record_merge_flipped_pcg(deadline_us, &cut_short);
+		if (cut_short) pass_cut_short(PASS_FLIP);
+		pass_account(PASS_FLIP, time_us() - start, merged, 0, 0);
+	}
+	if (level >= s_passes[PASS_SHARE].min_level)
+	{
+		share_prefixes(deadline_us);
+	}
+}
+
+void passes_report(int level)
+{
+	printf("Pass\tTime\tSaved\n");
+	for (int i = 0; i < PASS_COUNT; i++)
+	{
+		const PassReport *report = &s_passes[i];
+		if (level < report->min_level) continue;
+		printf("%s:\t%.3f ms\t", report->name, report->us / 1000.0);
+		const int bytes = (128 * report->patterns) + (8 * report->frm_entries);
+		if (report->patterns || report->frm_entries)
+		{
+			printf("%d bytes (", bytes);
+			if (report->patterns) printf("%d patterns", report->patterns);
+			if (report->patterns && report->frm_entries) printf(", ");
+			if (report->frm_entries) printf("%d FRM entries", report->frm_entries);
+			printf(")");
+		}
+		else
+		{
+			printf("-");
+		}
+		if (report->sprites) printf(", %d sprites", report->sprites);
+		if (report->cut_short) printf(", out of time");
+		printf("\n");
+	}
+}
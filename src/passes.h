@@ -0,0 +1,58 @@
+// Optimization levels, and the passes that make them up.
+//
+// Each level runs the passes of the one below it, and more:
+// 0: Frames are cut on a fixed 16x16 grid from their top-left corner, and
+//    neither patterns nor FRM runs are shared. This is the fastest.
+// 1: Sprites are claimed around the opaque pixels of a frame, identical
+//    patterns are stored once, and identical frames share FRM data.
+// 2: Patterns that are a mirror image of another are dropped, and the other
+//    is drawn flipped in their place. Frames whose sprites are the start of a
+//    longer frame's point into its FRM data.
+// 3: Several grid alignments are tried for every frame besides claiming, and
+//    whichever adds the fewest new patterns, then uses the fewest sprites, is
+//    kept.
+//
+// Passes run in order, and all of them watch the same deadline. A pass that
+// runs out of time stops early, leaving the data as it was at that point;
+// cutting sprites and looking up identical patterns always run to the end.
+#ifndef PASSES_H
+#define PASSES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OPT_LEVEL_DEFAULT 1
+#define OPT_LEVEL_MAX 3
+
+typedef enum PassId
+{
+	PASS_TILE,  // Cutting frames into sprites.
+	PASS_SEARCH,  // Trying alternate placements (level 3).
+	PASS_DEDUPE,  // Looking up identical patterns (level 1).
+	PASS_FLIP,  // Merging mirrored patterns (level 2).
+	PASS_SHARE,  // Pointing frames into longer frames' FRM data (level 2).
+	PASS_COUNT
+} PassId;
+
+// Lowest level at which a pass runs.
+int pass_min_level(PassId pass);
+
+// Returns true if deadline_us has passed. A deadline of 0 never passes.
+bool pass_out_of_time(uint64_t deadline_us);
+
+// Adds to what a pass has cost and saved so far: time spent, and patterns,
+// sprites, and FRM entries that the output no longer needs.
+void pass_account(PassId pass, uint64_t us, int patterns, int sprites,
+                  int frm_entries);
+
+// Notes that a pass stopped early for lack of time.
+void pass_cut_short(PassId pass);
+
+// Runs the passes over the recorded REF, FRM, and PCG data that come after
+// every frame has been cut into sprites. XSP mode only.
+void passes_run(int level, uint64_t deadline_us);
+
+// Prints the time taken and the data saved by each pass run at level.
+void passes_report(int level);
+
+#endif  // PASSES_H
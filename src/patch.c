@@ -0,0 +1,426 @@
+#include "patch.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mapfile.h"
+#include "records.h"
+#include "util.h"
+
+#define PATCH_MAGIC "XPD1"
+
+// Unchanged stretches up to this long are sent along with the ranges around
+// them, as a range of its own costs as much in offset and length.
+#define PATCH_MERGE_GAP 8
+
+typedef enum SectionId
+{
+	SECTION_HEAD,
+	SECTION_REF,
+	SECTION_FRM,
+	SECTION_PCG,
+	SECTION_COUNT
+} SectionId;
+
+// Sections are compared a whole entry at a time.
+static const size_t k_section_units[SECTION_COUNT] =
+{
+	[SECTION_HEAD] = 2,
+	[SECTION_REF] = 8,
+	[SECTION_FRM] = 8,
+	[SECTION_PCG] = 128,
+};
+
+typedef struct Section
+{
+	const uint8_t *dat;
+	size_t bytes;
+} Section;
+
+// A bank as it lies in the mapped files.
+typedef struct PatchBank
+{
+	bool bundle;
+	bool sp;  // SP mode set, with no REF or FRM file.
+	Section sections[SECTION_COUNT];
+	char base[256];  // Name without the extension.
+
+	// Mappings to release afterwards.
+	const uint8_t *map[SECTION_COUNT];
+	size_t map_size[SECTION_COUNT];
+	int map_count;
+} PatchBank;
+
+typedef struct PatchRange
+{
+	uint32_t offs;
+	uint32_t bytes;
+} PatchRange;
+
+static void put_uint16be(FILE *f, uint16_t val)
+{
+	fputc(val >> 8, f);
+	fputc(val & 0xFF, f);
+}
+
+static void put_uint32be(FILE *f, uint32_t val)
+{
+	put_uint16be(f, val >> 16);
+	put_uint16be(f, val & 0xFFFF);
+}
+
+static uint32_t section_hash(const Section *section)
+{
+	return fnv1a32(FNV1A32_INIT, section->dat, section->bytes);
+}
+
+static const uint8_t *bank_map(PatchBank *bank, const char *fname,
+                               size_t *size)
+{
+	const uint8_t *ret = map_file(fname, size);
+	if (!ret)
+	{
+		printf("Couldn't open %s.\n", fname);
+		return NULL;
+	}
+	bank->map[bank->map_count] = ret;
+	bank->map_size[bank->map_count] = *size;
+	bank->map_count++;
+	return ret;
+}
+
+static void bank_close(PatchBank *bank)
+{
+	for (int i = 0; i < bank->map_count; i++)
+	{
+		unmap_file(bank->map[i], bank->map_size[i]);
+	}
+	bank->map_count = 0;
+}
+
+static bool bank_open_xsb(PatchBank *bank, const char *fname)
+{
+	size_t size;
+	const uint8_t *dat = bank_map(bank, fname, &size);
+	if (!dat) return false;
+	if (size < sizeof(XSBHeader))
+	{
+		printf("%s is too small for an XSB header.\n", fname);
+		return false;
+	}
+
+	const XSBHeader *header = (const XSBHeader *)dat;
+	const bool sp = get_uint16be((const uint8_t *)&header->type) != 0;
+	const uint32_t offs[SECTION_COUNT] =
+	{
+		0,
+		get_uint32be((const uint8_t *)&header->ref_offs),
+		get_uint32be((const uint8_t *)&header->frm_offs),
+		get_uint32be((const uint8_t *)&header->pcg_offs),
+	};
+	const size_t bytes[SECTION_COUNT] =
+	{
+		sizeof(XSBHeader),
+		sp ? 0 : 8 * get_uint16be((const uint8_t *)&header->ref_count),
+		sp ? 0 : get_uint16be((const uint8_t *)&header->frm_bytes),
+		128 * get_uint16be((const uint8_t *)&header->pcg_count),
+	};
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		if ((uint64_t)offs[i] + bytes[i] > size)
+		{
+			printf("%s is truncated.\n", fname);
+			return false;
+		}
+		bank->sections[i].dat = dat + offs[i];
+		bank->sections[i].bytes = bytes[i];
+	}
+	return true;
+}
+
+static bool bank_open_set(PatchBank *bank)
+{
+	// Siblings are named the way record_write() names them.
+	static const char *const k_exts[SECTION_COUNT] =
+	{
+		[SECTION_HEAD] = ".PAL",
+		[SECTION_REF] = ".REF",
+		[SECTION_FRM] = ".FRM",
+		[SECTION_PCG] = ".XSP",
+	};
+	char sibling[300];
+	snprintf(sibling, sizeof(sibling), "%s.SP", bank->base);
+	size_t size;
+	const uint8_t *sp_dat = map_file(sibling, &size);
+	bank->sp = sp_dat != NULL;
+	unmap_file(sp_dat, size);
+
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		Section *section = &bank->sections[i];
+		if (bank->sp && (i == SECTION_REF || i == SECTION_FRM)) continue;
+		snprintf(sibling, sizeof(sibling), "%s%s", bank->base,
+		         (bank->sp && i == SECTION_PCG) ? ".SP" : k_exts[i]);
+		section->dat = bank_map(bank, sibling, &section->bytes);
+		if (!section->dat) return false;
+	}
+	return true;
+}
+
+static bool bank_open(PatchBank *bank, const char *fname)
+{
+	memset(bank, 0, sizeof(*bank));
+	const char *dot = strrchr(fname, '.');
+	const char *slash = strrchr(fname, '/');
+	if (!dot || (slash && dot < slash))
+	{
+		printf("%s has no extension to tell a bundle from a set by.\n", fname);
+		return false;
+	}
+	snprintf(bank->base, sizeof(bank->base), "%.*s", (int)(dot - fname), fname);
+	bank->bundle = strcasecmp(dot, ".XSB") == 0;
+	const bool ok = bank->bundle ? bank_open_xsb(bank, fname) :
+	                bank_open_set(bank);
+	if (!ok) bank_close(bank);
+	return ok;
+}
+
+// Finds the ranges of cur that differ from old. ranges must have room for one
+// per unit of cur.
+static int find_ranges(const Section *old, const Section *cur, size_t unit,
+                       PatchRange *ranges)
+{
+	int count = 0;
+	for (size_t offs = 0; offs < cur->bytes; offs += unit)
+	{
+		const size_t len = (cur->bytes - offs < unit) ? cur->bytes - offs : unit;
+		if (offs + len <= old->bytes &&
+		    memcmp(&old->dat[offs], &cur->dat[offs], len) == 0)
+		{
+			continue;
+		}
+		PatchRange *last = count ? &ranges[count - 1] : NULL;
+		if (last && offs - (last->offs + last->bytes) <= PATCH_MERGE_GAP)
+		{
+			last->bytes = offs + len - last->offs;
+			continue;
+		}
+		ranges[count].offs = offs;
+		ranges[count].bytes = len;
+		count++;
+	}
+	return count;
+}
+
+bool patch_write(const char *prev_fname, const char *outname, bool bundle,
+                 size_t *patch_bytes)
+{
+	PatchBank old;
+	PatchBank cur;
+	if (!bank_open(&old, prev_fname)) return false;
+	char fname_buffer[256];
+	snprintf(fname_buffer, sizeof(fname_buffer), bundle ? "%s.XSB" : "%s.PAL",
+	         outname);
+	if (!bank_open(&cur, fname_buffer))
+	{
+		bank_close(&old);
+		return false;
+	}
+
+	bool ret = false;
+	FILE *f = NULL;
+	PatchRange *ranges = NULL;
+	if (old.bundle != cur.bundle || old.sp != cur.sp)
+	{
+		printf("%s is not the same kind of bank as the output.\n", prev_fname);
+		goto done;
+	}
+
+	snprintf(fname_buffer, sizeof(fname_buffer), "%s.XPD", outname);
+	f = output_open(fname_buffer);
+	if (!f)
+	{
+		printf("Couldn't open %s for writing.\n", fname_buffer);
+		goto done;
+	}
+	fwrite(PATCH_MAGIC, 1, 4, f);
+	put_uint16be(f, bundle ? PATCH_FLAG_BUNDLE : 0);
+	put_uint16be(f, SECTION_COUNT);
+	*patch_bytes = 8;
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		const Section *old_section = &old.sections[i];
+		const Section *cur_section = &cur.sections[i];
+		const size_t unit = k_section_units[i];
+		free(ranges);
+		ranges = malloc(sizeof(PatchRange) * (cur_section->bytes / unit + 1));
+		if (!ranges)
+		{
+			printf("Couldn't allocate patch ranges.\n");
+			goto done;
+		}
+		const int count = find_ranges(old_section, cur_section, unit, ranges);
+		if (count > UINT16_MAX)
+		{
+			printf("Too many changed ranges to patch; send the bank instead.\n");
+			goto done;
+		}
+		put_uint32be(f, old_section->bytes);
+		put_uint32be(f, section_hash(old_section));
+		put_uint32be(f, cur_section->bytes);
+		put_uint16be(f, count);
+		*patch_bytes += 14;
+		for (int r = 0; r < count; r++)
+		{
+			put_uint32be(f, ranges[r].offs);
+			put_uint32be(f, ranges[r].bytes);
+			fwrite(&cur_section->dat[ranges[r].offs], 1, ranges[r].bytes, f);
+			*patch_bytes += 8 + ranges[r].bytes;
+		}
+	}
+	ret = !ferror(f);
+
+done:
+	if (f && !output_close(f, fname_buffer)) ret = false;
+	free(ranges);
+	bank_close(&old);
+	bank_close(&cur);
+	return ret;
+}
+
+static bool write_section(const char *fname, const uint8_t *dat, size_t bytes)
+{
+	FILE *f = output_open(fname);
+	if (!f)
+	{
+		printf("Couldn't open %s for writing.\n", fname);
+		return false;
+	}
+	fwrite(dat, 1, bytes, f);
+	const bool ok = !ferror(f);
+	return output_close(f, fname) && ok;
+}
+
+bool patch_apply(const char *patch_fname, const char *fname)
+{
+	size_t patch_size;
+	const uint8_t *patch = map_file(patch_fname, &patch_size);
+	if (!patch)
+	{
+		printf("Couldn't open %s.\n", patch_fname);
+		return false;
+	}
+	PatchBank bank;
+	if (!bank_open(&bank, fname))
+	{
+		unmap_file(patch, patch_size);
+		return false;
+	}
+
+	bool ret = false;
+	uint8_t *out[SECTION_COUNT] = {NULL};
+	size_t out_bytes[SECTION_COUNT] = {0};
+	if (patch_size < 8 || memcmp(patch, PATCH_MAGIC, 4) != 0 ||
+	    get_uint16be(patch + 6) != SECTION_COUNT)
+	{
+		printf("%s is not a patch.\n", patch_fname);
+		goto done;
+	}
+	if (((get_uint16be(patch + 4) & PATCH_FLAG_BUNDLE) != 0) != bank.bundle)
+	{
+		printf("%s is not for the same kind of bank as %s.\n", patch_fname, fname);
+		goto done;
+	}
+
+	// Every section is rebuilt before anything is written, as the bank is
+	// still mapped until then.
+	size_t pos = 8;
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		const Section *section = &bank.sections[i];
+		if (pos + 14 > patch_size) goto truncated;
+		const uint32_t old_bytes = get_uint32be(patch + pos);
+		const uint32_t old_hash = get_uint32be(patch + pos + 4);
+		const uint32_t new_bytes = get_uint32be(patch + pos + 8);
+		const int count = get_uint16be(patch + pos + 12);
+		pos += 14;
+		if (old_bytes != section->bytes || old_hash != section_hash(section))
+		{
+			printf("%s was made against another version of %s.\n",
+			       patch_fname, fname);
+			goto done;
+		}
+
+		out[i] = malloc(new_bytes ? new_bytes : 1);
+		if (!out[i])
+		{
+			printf("Couldn't allocate patched bank.\n");
+			goto done;
+		}
+		out_bytes[i] = new_bytes;
+		memcpy(out[i], section->dat, (old_bytes < new_bytes) ? old_bytes : new_bytes);
+		for (int r = 0; r < count; r++)
+		{
+			if (pos + 8 > patch_size) goto truncated;
+			const uint32_t offs = get_uint32be(patch + pos);
+			const uint32_t bytes = get_uint32be(patch + pos + 4);
+			pos += 8;
+			if ((uint64_t)offs + bytes > new_bytes || pos + bytes > patch_size)
+			{
+				goto truncated;
+			}
+			memcpy(&out[i][offs], patch + pos, bytes);
+			pos += bytes;
+		}
+	}
+
+	const bool bundle = bank.bundle;
+	const bool sp = bank.sp;
+	char base[256];
+	snprintf(base, sizeof(base), "%s", bank.base);
+	bank_close(&bank);
+	unmap_file(patch, patch_size);
+	patch = NULL;
+
+	char fname_buffer[300];
+	if (bundle)
+	{
+		FILE *f = output_open(fname);
+		if (!f)
+		{
+			printf("Couldn't open %s for writing.\n", fname);
+			goto done;
+		}
+		for (int i = 0; i < SECTION_COUNT; i++) fwrite(out[i], 1, out_bytes[i], f);
+		ret = !ferror(f);
+		ret = output_close(f, fname) && ret;
+		goto done;
+	}
+	snprintf(fname_buffer, sizeof(fname_buffer), "%s.PAL", base);
+	ret = write_section(fname_buffer, out[SECTION_HEAD], out_bytes[SECTION_HEAD]);
+	if (!sp)
+	{
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.REF", base);
+		ret = ret && write_section(fname_buffer, out[SECTION_REF],
+		                           out_bytes[SECTION_REF]);
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.FRM", base);
+		ret = ret && write_section(fname_buffer, out[SECTION_FRM],
+		                           out_bytes[SECTION_FRM]);
+	}
+	snprintf(fname_buffer, sizeof(fname_buffer), sp ? "%s.SP" : "%s.XSP", base);
+	ret = ret && write_section(fname_buffer, out[SECTION_PCG],
+	                           out_bytes[SECTION_PCG]);
+	goto done;
+
+truncated:
+	printf("%s is truncated.\n", patch_fname);
+
+done:
+	for (int i = 0; i < SECTION_COUNT; i++) free(out[i]);
+	bank_close(&bank);
+	unmap_file(patch, patch_size);
+	return ret;
+}
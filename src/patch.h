@@ -0,0 +1,47 @@
+// Patches that bring a previously emitted bank up to date with a new one.
+//
+// A bank is handled as four sections, which are compared separately:
+//   0: The XSB header, or the PAL file of a set.
+//   1: REF entries.
+//   2: FRM entries.
+//   3: Pattern data.
+// Sections of an SP mode set that don't exist are empty.
+//
+// A patch holds, for each section, the ranges that differ, so it scales with
+// what was edited rather than with the bank. Patterns keep their numbers from
+// one build to the next when the previous bank is also given as the base bank
+// (-a), which keeps the pattern ranges small.
+//
+// Layout, all big-endian, for loaders on the X68000 side:
+//   "XPD1"
+//   uint16_t flags;  // PATCH_FLAG_BUNDLE if the bank is an XSB.
+//   uint16_t section_count;
+//   For each section:
+//     uint32_t old_bytes;  // Length of the section the patch applies to.
+//     uint32_t old_hash;  // 32-bit FNV-1a of it.
+//     uint32_t new_bytes;
+//     uint16_t range_count;
+//     For each range: uint32_t offs; uint32_t bytes; uint8_t dat[bytes];
+//
+// A section is applied by keeping its first new_bytes bytes (anything beyond
+// the old length is always covered by a range), and copying each range over
+// them. A bundle is then put back together as the header, REF, FRM, and
+// pattern sections, in that order, as record_write() lays it out.
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PATCH_FLAG_BUNDLE 0x0001
+
+// Compares the bank prev_fname (an XSB bundle, or any one of the files of a
+// set) with the one just written to outname, and writes <outname>.XPD.
+// Sets patch_bytes to the size of the patch. Returns false on error.
+bool patch_write(const char *prev_fname, const char *outname, bool bundle,
+                 size_t *patch_bytes);
+
+// Applies the patch patch_fname to the bank fname, in place.
+bool patch_apply(const char *patch_fname, const char *fname);
+
+#endif  // PATCH_H
@@ -1,12 +1,24 @@
 #include "records.h"
 
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stddef.h>
 
-#define ARRAYSIZE(x) (sizeof(x) / sizeof(x[0]))
+#include "mapfile.h"
+#include "util.h"
+
+
+// Open addressing table of pattern indices, keyed by pcg_hash().
+#define PCG_HASH_TABLE_SIZE (PCG_PT_MAX_COUNT * 2)
+
+// PCG hash index sidecar file.
+#define PCG_INDEX_MAGIC "PXI1"
+#define PCG_INDEX_HEADER_BYTES 8
+#define PCG_INDEX_ENTRY_BYTES 8
 
 // Parameters.
 static struct
@@ -14,19 +26,105 @@ static struct
 	ConvMode mode;
 	const char *outname;
 	bool bundle;
+	bool box;
+	bool msk;
+	int fade_steps;
+	bool index;
+	bool no_dedupe;
 } s_param;
 
-// REF data
-static uint8_t *s_ref_dat;
-static int s_ref_count = 0;
+// REF and FRM data, kept in native form until record_complete().
+static int16_t s_frm_vx[PCG_FRM_MAX_COUNT / 8];
+static int16_t s_frm_vy[PCG_FRM_MAX_COUNT / 8];
+static int16_t s_frm_pt[PCG_FRM_MAX_COUNT / 8];
+static uint16_t s_frm_rv[PCG_FRM_MAX_COUNT / 8];
+static FrmTable s_frm = {s_frm_vx, s_frm_vy, s_frm_pt, s_frm_rv, 0};
 
-// FRM data
-static uint8_t *s_frm_dat;
-static uint32_t s_frm_offs = 0;
+static uint16_t s_ref_sp_count[PCG_REF_MAX_COUNT];
+static uint32_t s_ref_first[PCG_REF_MAX_COUNT];
+static RefTable s_ref = {s_ref_sp_count, s_ref_first, 0};
+
+// FRM pool: every run of FRM entries recorded for a REF entry, keyed by a hash
+// of its bytes, so that a frame identical to any earlier one (from the same
+// sheet or another) points at the existing run instead of adding its own.
+#define FRM_POOL_TABLE_SIZE (PCG_REF_MAX_COUNT * 2)
+typedef struct FrmRun
+{
+	uint32_t hash;
+	uint32_t first;
+	uint16_t sp_count;  // 0 marks an empty slot.
+} FrmRun;
+static FrmRun s_frm_pool[FRM_POOL_TABLE_SIZE];
+static int s_frm_pooled = 0;  // REF entries that reuse a pooled run.
 
 // PCG Data
+// Patterns from a base bank (see record_load_base) occupy the first indices,
+// and are read from the mapped bank file rather than copied to s_pcg_dat.
 static uint8_t *s_pcg_dat;  // Allocated to the max sprite count.
-static int s_pcg_count = 0;
+
+// Spill file for the PCG data (see record_set_spill). Patterns are stored one
+// after another, 128 bytes each, in pattern order, so nothing else needs to be
+// kept on disk to find them; their hashes stay in s_pcg_hash, unless a window
+// is set.
+#define SPILL_INITIAL_PATTERNS 1024
+static SpillFile s_spill;
+static const char *s_spill_fname = NULL;
+static int s_pcg_count = 0;  // Includes base patterns.
+static uint32_t s_pcg_hash[PCG_PT_MAX_COUNT];
+static int32_t s_pcg_table[PCG_HASH_TABLE_SIZE];  // Index + 1; 0 is empty.
+
+// Dedupe window (see record_set_window). Patterns are live while a recent
+// frame uses them, or while they are among the most used. New patterns are not
+// added to s_pcg_table; live ones are held in a pool of their own, with a copy
+// of their data, and evicted once they leave the window. Their data in the
+// spill file is then never read again until the output is written, so its
+// pages are let go as it grows.
+#define WINDOW_POOL_INITIAL 512
+#define SPILL_RELEASE_BYTES 0x10000
+typedef struct WindowEntry
+{
+	int32_t idx;  // Pattern index, or the next free entry's if unused.
+	uint32_t hash;
+	int32_t last_frame;
+	uint32_t uses;
+	bool live;
+	bool hot;
+	uint8_t dat[128];
+} WindowEntry;
+static int s_window = 0;
+static char s_window_spill_fname[1024];
+static size_t s_spill_released = 0;
+static WindowEntry *s_pool;
+static int s_pool_capacity = 0;
+static int s_pool_count = 0;  // Entries handed out, including freed ones.
+static int s_pool_free = -1;
+static int32_t *s_pool_table;  // Entry indices, -1 if empty; 2x capacity.
+static int32_t s_hot[WINDOW_HOT_COUNT];  // Entry indices.
+static int s_hot_count = 0;
+static int s_hot_min = 0;  // Position in s_hot of the least used.
+// Linear counting sketch of the patterns used, so that what global dedupe
+// would have kept can be estimated in fixed memory.
+#define WINDOW_SKETCH_BITS 0x10000
+static uint8_t s_global_sketch[WINDOW_SKETCH_BITS / 8];
+static int s_global_zeros = WINDOW_SKETCH_BITS;
+
+// Base bank
+static const uint8_t *s_base_map;
+static size_t s_base_map_size = 0;
+static const uint8_t *s_base_pcg;
+static int s_base_count = 0;
+static bool s_base_link = false;
+
+// BOX data
+static uint8_t *s_box_dat;  // Two FrameBox records per REF entry.
+static int s_box_count = 0;
+
+// MSK data
+static uint32_t *s_msk_offs;  // One offset into s_msk_dat per REF entry.
+static uint8_t *s_msk_dat;
+static int s_msk_count = 0;
+static size_t s_msk_bytes = 0;
+static size_t s_msk_capacity = 0;
 
 // PAL data
 static uint16_t s_pal_dat[16];
@@ -38,34 +136,165 @@ int record_get_pcg_count(void)
 
 int record_get_frm_offs(void)
 {
-	return s_frm_offs;
+	return 8 * s_frm.count;
 }
 
 int record_get_ref_count(void)
 {
-	return s_ref_count;
+	return s_ref.count;
+}
+
+FrmTable *record_get_frm_table(void)
+{
+	return &s_frm;
+}
+
+RefTable *record_get_ref_table(void)
+{
+	return &s_ref;
+}
+
+static uint32_t pcg_get_hash(int idx);
+
+uint32_t record_get_pcg_hash(int idx)
+{
+	return pcg_get_hash(idx);
+}
+
+int record_get_frm_pooled(void)
+{
+	return s_frm_pooled;
 }
 
 //
 // Motorola 68000, and therefore XSP, uses big-endian data.
 //
 
-static void set_uint16be(uint8_t *buf, uint16_t val)
+static void set_int16be(uint8_t *buf, int16_t val)
 {
 	buf[0] = (val >> 8) & 0xFF;
 	buf[1] = val & 0xFF;
 }
 
-static void set_int16be(uint8_t *buf, int16_t val)
+static void set_framebox(uint8_t *buf, const FrameBox *box)
 {
-	buf[0] = (val >> 8) & 0xFF;
-	buf[1] = val & 0xFF;
+	set_int16be(buf, box->left);
+	set_int16be(buf + 2, box->top);
+	set_int16be(buf + 4, box->right);
+	set_int16be(buf + 6, box->bottom);
+}
+
+//
+// PCG dictionary
+//
+
+static const uint8_t *pcg_ptr(int idx)
+{
+	if (idx < s_base_count) return &s_base_pcg[idx * 128];
+	return &s_pcg_dat[(idx - s_base_count) * 128];
+}
+
+// Makes room for count patterns after the base bank. Only the spill file
+// grows; otherwise room for the max sprite count is allocated up front.
+static bool pcg_reserve(int count)
+{
+	if (!s_spill_fname) return true;
+	size_t capacity = s_spill.capacity;
+	while (capacity < 128 * (size_t)count) capacity *= 2;
+	if (!spill_reserve(&s_spill, capacity))
+	{
+		printf("Couldn't grow spill file %s.\n", s_spill_fname);
+		return false;
+	}
+	s_pcg_dat = s_spill.dat;
+	return true;
+}
+
+// Hashes of patterns added under a window aren't kept (see record_pcg_dat).
+static uint32_t pcg_get_hash(int idx)
+{
+	if (s_window > 0 && idx >= s_base_count) return pcg_hash(pcg_ptr(idx));
+	return s_pcg_hash[idx];
+}
+
+static void pcg_table_insert(int idx, uint32_t hash)
+{
+	s_pcg_hash[idx] = hash;
+	uint32_t slot = hash % PCG_HASH_TABLE_SIZE;
+	while (s_pcg_table[slot] != 0) slot = (slot + 1) % PCG_HASH_TABLE_SIZE;
+	s_pcg_table[slot] = idx + 1;
+}
+
+const uint8_t *record_get_pcg_dat(int idx)
+{
+	if (idx < 0 || idx >= s_pcg_count) return NULL;
+	return pcg_ptr(idx);
+}
+
+// The range of patterns that are written out to the XSP/SP/XSB data.
+static int pcg_first_written(void)
+{
+	return s_base_link ? s_base_count : 0;
 }
 
-static void set_uint32be(uint8_t *buf, uint32_t val)
+int record_get_pcg_written_count(void)
 {
-	set_uint16be(buf, (val >> 16) & 0xFFFF);
-	set_uint16be(buf + 2, val & 0xFFFF);
+	return s_pcg_count - pcg_first_written();
+}
+
+//
+// X68000 palette entries are GGGGGRRRRRBBBBBI.
+//
+
+typedef enum FadeTarget
+{
+	FADE_BLACK,
+	FADE_WHITE,
+	FADE_NEGATIVE,
+} FadeTarget;
+
+static uint16_t fade_channel(uint16_t val, int shift, FadeTarget target,
+                             int step, int steps)
+{
+	const int from = (val >> shift) & 0x1F;
+	int to = 0;
+	switch (target)
+	{
+		case FADE_BLACK:
+			to = 0;
+			break;
+		case FADE_WHITE:
+			to = 0x1F;
+			break;
+		case FADE_NEGATIVE:
+			to = 0x1F - from;
+			break;
+	}
+	// Rounded to the nearest level so that the final step lands exactly.
+	const int level = ((from * (steps - step) * 2) + (to * step * 2) + steps) /
+	                  (steps * 2);
+	return (level & 0x1F) << shift;
+}
+
+static uint16_t fade_entry(uint16_t val, FadeTarget target, int step, int steps)
+{
+	return fade_channel(val, 11, target, step, steps) |
+	       fade_channel(val, 6, target, step, steps) |
+	       fade_channel(val, 1, target, step, steps);
+}
+
+static void write_fade_ramp(FILE *f, FadeTarget target, int steps)
+{
+	for (int step = 1; step <= steps; step++)
+	{
+		for (int i = 0; i < ARRAYSIZE(s_pal_dat); i++)
+		{
+			const uint16_t entry = (i == 0) ? 0 : fade_entry(s_pal_dat[i], target,
+			                                                 step, steps);
+			fputc(entry >> 8, f);
+			fputc(entry & 0xFF, f);
+		}
+	}
 }
 
 //
@@ -75,12 +304,27 @@ static void set_uint32be(uint8_t *buf, uint32_t val)
 bool record_init(const char *outname, ConvMode mode, bool bundle)
 {
 	s_pcg_count = 0;
-	s_frm_offs = 0;
-	s_ref_count = 0;
+	s_frm.count = 0;
+	s_frm_pooled = 0;
+	memset(s_frm_pool, 0, sizeof(s_frm_pool));
+	s_ref.count = 0;
+	s_box_count = 0;
+	s_msk_count = 0;
+	s_msk_bytes = 0;
+	s_msk_capacity = 0;
+	s_msk_dat = NULL;
+	s_base_map = NULL;
+	s_base_count = 0;
+	s_base_link = false;
+	memset(s_pcg_table, 0, sizeof(s_pcg_table));
 
 	s_param.mode = mode;
 	s_param.outname = outname;
 	s_param.bundle = bundle;
+	s_param.box = false;
+	s_param.msk = false;
+	s_param.fade_steps = 0;
+	s_param.index = false;
 
 	// File buffers
 	s_pcg_dat = malloc(128 * PCG_PT_MAX_COUNT);
@@ -90,27 +334,290 @@ bool record_init(const char *outname, ConvMode mode, bool bundle)
 		return false;
 	}
 
-	s_ref_dat = malloc(8 * PCG_REF_MAX_COUNT);
-	if (!s_ref_dat)
+	s_box_dat = malloc(16 * PCG_REF_MAX_COUNT);
+	if (!s_box_dat)
 	{
-		printf("Couldn't allocate REF data buffer.\n");
+		printf("Couldn't allocate BOX data buffer.\n");
 		free(s_pcg_dat);
 		return false;
 	}
 
-	s_frm_dat = malloc(PCG_FRM_MAX_COUNT);
-	if (!s_frm_dat)
+	s_msk_offs = malloc(sizeof(uint32_t) * PCG_REF_MAX_COUNT);
+	if (!s_msk_offs)
 	{
-		printf("Couldn't allocate FRM data buffer.\n");
+		printf("Couldn't allocate MSK offset buffer.\n");
 		free(s_pcg_dat);
-		free(s_ref_dat);
+		free(s_box_dat);
 		return false;
 	}
 
 	return true;
 }
 
-bool record_complete(void)
+void record_set_box_output(bool enable)
+{
+	s_param.box = enable;
+}
+
+void record_set_msk_output(bool enable)
+{
+	s_param.msk = enable;
+}
+
+bool record_get_msk_output(void)
+{
+	return s_param.msk;
+}
+
+void record_set_fade_steps(int steps)
+{
+	s_param.fade_steps = steps;
+}
+
+void record_set_dedupe(bool enable)
+{
+	s_param.no_dedupe = !enable;
+}
+
+// Moves the PCG data to the newly opened s_spill, before any is recorded.
+static void pcg_use_spill(const char *fname)
+{
+	free(s_pcg_dat);
+	s_pcg_dat = s_spill.dat;
+	s_spill_fname = fname;
+	s_spill_released = 0;
+}
+
+bool record_set_spill(const char *fname)
+{
+	if (!spill_open(&s_spill, fname, 128 * SPILL_INITIAL_PATTERNS))
+	{
+		printf("Couldn't create spill file %s.\n", fname);
+		return false;
+	}
+	pcg_use_spill(fname);
+	return true;
+}
+
+size_t record_get_spill_bytes(void)
+{
+	return s_spill_fname ? 128 * (size_t)(s_pcg_count - s_base_count) : 0;
+}
+
+bool record_set_window(int frames)
+{
+	// Only XOBJ frames look patterns up.
+	s_window = (s_param.mode == CONV_MODE_XOBJ) ? frames : 0;
+	s_pool_count = 0;
+	s_pool_free = -1;
+	s_hot_count = 0;
+	s_hot_min = 0;
+	memset(s_global_sketch, 0, sizeof(s_global_sketch));
+	s_global_zeros = WINDOW_SKETCH_BITS;
+	if (s_window <= 0 || s_spill_fname) return true;
+
+	// A shared memory output has no directory to keep the spill file in.
+	if (is_shm_name(s_param.outname))
+	{
+		if (!spill_open_temp(&s_spill, s_window_spill_fname,
+		                     sizeof(s_window_spill_fname),
+		                     128 * SPILL_INITIAL_PATTERNS))
+		{
+			printf("Couldn't create a temporary spill file.\n");
+			return false;
+		}
+		pcg_use_spill(s_window_spill_fname);
+		return true;
+	}
+	snprintf(s_window_spill_fname, sizeof(s_window_spill_fname), "%s.spill",
+	         s_param.outname);
+	return record_set_spill(s_window_spill_fname);
+}
+
+int record_get_window(void)
+{
+	return s_window;
+}
+
+int record_get_global_pcg_count(void)
+{
+	// Patterns are counted by the sketch bit their hash sets, so those sharing
+	// a bit count once. How many there are follows from the bits left clear.
+	int count = PCG_PT_MAX_COUNT;
+	if (s_global_zeros > 0)
+	{
+		const double bits = WINDOW_SKETCH_BITS;
+		count = (int)lround(-bits * log(s_global_zeros / bits));
+	}
+	count += s_base_count;
+	return (count < PCG_PT_MAX_COUNT) ? count : PCG_PT_MAX_COUNT;
+}
+
+void record_set_index_output(bool enable)
+{
+	s_param.index = enable;
+}
+
+// Derives the sidecar index path from a bank path by swapping the extension.
+static void index_fname(char *buf, size_t len, const char *bank_fname)
+{
+	const char *dot = strrchr(bank_fname, '.');
+	const char *slash = strrchr(bank_fname, '/');
+	if (!dot || (slash && dot < slash)) dot = bank_fname + strlen(bank_fname);
+	snprintf(buf, len, "%.*s.PXI", (int)(dot - bank_fname), bank_fname);
+}
+
+// Takes pattern hashes for the base bank from its sidecar index, if there is
+// one that agrees with the bank. Returns false if the index can't be used.
+static bool load_base_index(const char *bank_fname)
+{
+	char fname_buffer[256];
+	index_fname(fname_buffer, sizeof(fname_buffer), bank_fname);
+	size_t size;
+	const uint8_t *index = map_file(fname_buffer, &size);
+	if (!index) return false;
+	bool ret = false;
+	if (size < PCG_INDEX_HEADER_BYTES ||
+	    memcmp(index, PCG_INDEX_MAGIC, 4) != 0 ||
+	    get_uint32be(index + 4) != s_base_count ||
+	    size < PCG_INDEX_HEADER_BYTES + (s_base_count * PCG_INDEX_ENTRY_BYTES))
+	{
+		printf("Ignoring stale or invalid index %s.\n", fname_buffer);
+		goto done;
+	}
+	const uint8_t *entry = index + PCG_INDEX_HEADER_BYTES;
+	for (int i = 0; i < s_base_count; i++)
+	{
+		pcg_table_insert(i, get_uint32be(entry));
+		entry += PCG_INDEX_ENTRY_BYTES;
+	}
+	ret = true;
+done:
+	unmap_file(index, size);
+	return ret;
+}
+
+bool record_load_base(const char *fname, bool link)
+{
+	s_base_map = map_file(fname, &s_base_map_size);
+	if (!s_base_map)
+	{
+		printf("Couldn't open base bank %s.\n", fname);
+		return false;
+	}
+
+	// A bundle is located through its header; other files are raw PCG data.
+	size_t pcg_offs = 0;
+	size_t pcg_bytes = s_base_map_size;
+	const size_t len = strlen(fname);
+	if (len >= 4 && strcasecmp(fname + len - 4, ".XSB") == 0)
+	{
+		if (s_base_map_size < sizeof(XSBHeader))
+		{
+			printf("Base bank %s is too small for an XSB header.\n", fname);
+			goto error;
+		}
+		const XSBHeader *header = (const XSBHeader *)s_base_map;
+		pcg_offs = get_uint32be((const uint8_t *)&header->pcg_offs);
+		pcg_bytes = 128 * get_uint16be((const uint8_t *)&header->pcg_count);
+		if (pcg_offs + pcg_bytes > s_base_map_size)
+		{
+			printf("Base bank %s is truncated.\n", fname);
+			goto error;
+		}
+	}
+	if (pcg_bytes / 128 > PCG_PT_MAX_COUNT)
+	{
+		printf("Base bank %s has too many patterns.\n", fname);
+		goto error;
+	}
+
+	s_base_pcg = s_base_map + pcg_offs;
+	s_base_count = pcg_bytes / 128;
+	s_base_link = link;
+	s_pcg_count = s_base_count;
+
+	// Without an index every base pattern has to be read and hashed.
+	if (!load_base_index(fname))
+	{
+		for (int i = 0; i < s_base_count; i++)
+		{
+			pcg_table_insert(i, pcg_hash(pcg_ptr(i)));
+		}
+	}
+	printf("Base bank: %d patterns from %s (%s)\n", s_base_count, fname,
+	       link ? "linked" : "appended");
+	return true;
+
+error:
+	unmap_file(s_base_map, s_base_map_size);
+	s_base_map = NULL;
+	return false;
+}
+
+static void write_pcg_dat(FILE *f)
+{
+	if (!s_base_link) fwrite(s_base_pcg, 128, s_base_count, f);
+	const size_t bytes = 128 * (size_t)(s_pcg_count - s_base_count);
+	if (!s_spill_fname)
+	{
+		fwrite(s_pcg_dat, 1, bytes, f);
+		return;
+	}
+
+	// Spilled data is let go of as it is written out, rather than being
+	// brought back in all at once.
+	for (size_t offs = 0; offs < bytes; offs += SPILL_RELEASE_BYTES)
+	{
+		const size_t len = (bytes - offs < SPILL_RELEASE_BYTES) ?
+		                   bytes - offs : SPILL_RELEASE_BYTES;
+		fwrite(&s_pcg_dat[offs], 1, len, f);
+		spill_release(&s_spill, offs, len);
+	}
+}
+
+static void write_pcg_index(FILE *f)
+{
+	const int first = pcg_first_written();
+	uint8_t buf[PCG_INDEX_HEADER_BYTES];
+	memcpy(buf, PCG_INDEX_MAGIC, 4);
+	set_uint32be(buf + 4, s_pcg_count - first);
+	fwrite(buf, 1, sizeof(buf), f);
+	for (int i = first; i < s_pcg_count; i++)
+	{
+		set_uint32be(buf, pcg_get_hash(i));
+		set_uint32be(buf + 4, pcg_canonical_hash(pcg_ptr(i)));
+		fwrite(buf, 1, sizeof(buf), f);
+	}
+}
+
+// REF and FRM entries are only converted to big-endian here, on the way out.
+static void write_ref_dat(FILE *f)
+{
+	for (int i = 0; i < s_ref.count; i++)
+	{
+		uint8_t ref[8];
+		set_uint16be(ref, s_ref.sp_count[i]);
+		set_uint32be(ref + 2, 8 * s_ref.first[i]);
+		set_uint16be(ref + 6, 0);  // Reserved / padding.
+		fwrite(ref, 1, sizeof(ref), f);
+	}
+}
+
+static void write_frm_dat(FILE *f)
+{
+	for (uint32_t i = 0; i < s_frm.count; i++)
+	{
+		uint8_t frm[8];
+		set_int16be(frm, s_frm.vx[i]);
+		set_int16be(frm + 2, s_frm.vy[i]);
+		set_int16be(frm + 4, s_frm.pt[i]);
+		set_uint16be(frm + 6, s_frm.rv[i]);
+		fwrite(frm, 1, sizeof(frm), f);
+	}
+}
+
+bool record_write(const char *outname)
 {
 	bool ret = false;
 	if (s_pcg_dat <= 0)
@@ -122,69 +629,117 @@ bool record_complete(void)
 	char fname_buffer[256];
 	if (s_param.bundle)
 	{
-		snprintf(fname_buffer, sizeof(fname_buffer), "%s.XSB", s_param.outname);
-		FILE *f = fopen(fname_buffer, "wb");
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.XSB", outname);
+		FILE *f = output_open(fname_buffer);
 		if (!f) goto fwberror;
 
 		XSBHeader header;
 		// Header fields have their endianness reversed for 68000 use.
 		set_uint16be((uint8_t *)&header.type, (s_param.mode == CONV_MODE_XOBJ) ? 0 : 1);
-		set_uint16be((uint8_t *)&header.ref_count, s_ref_count);
-		set_uint16be((uint8_t *)&header.frm_bytes, s_frm_offs);
-		set_uint16be((uint8_t *)&header.pcg_count, s_pcg_count);
+		set_uint16be((uint8_t *)&header.ref_count, s_ref.count);
+		set_uint16be((uint8_t *)&header.frm_bytes, 8 * s_frm.count);
+		set_uint16be((uint8_t *)&header.pcg_count, record_get_pcg_written_count());
 		for (int i = 0; i < 16; i++)
 		{
 			set_uint16be((uint8_t *)&header.pal[i], s_pal_dat[i]);
 		}
 		const uint32_t ref_offs = sizeof(XSBHeader);
-		const uint32_t frm_offs = ref_offs + 8 * s_ref_count;
-		const uint32_t pcg_offs = frm_offs + s_frm_offs;
+		const uint32_t frm_offs = ref_offs + 8 * s_ref.count;
+		const uint32_t pcg_offs = frm_offs + 8 * s_frm.count;
 		set_uint32be((uint8_t *)&header.ref_offs, ref_offs);
 		set_uint32be((uint8_t *)&header.frm_offs, frm_offs);
 		set_uint32be((uint8_t *)&header.pcg_offs, pcg_offs);
 		fwrite(&header, sizeof(header), 1, f);
 
-		// Data blobs are written as-is as they already respected endianness.
 		if (s_param.mode == CONV_MODE_XOBJ)
 		{
-			fwrite(s_ref_dat, 8, s_ref_count, f);
-			fwrite(s_frm_dat, 1, s_frm_offs, f);
+			write_ref_dat(f);
+			write_frm_dat(f);
 		}
-		fwrite(s_pcg_dat, 128, s_pcg_count, f);
-		fclose(f);
+		write_pcg_dat(f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
 	}
 	else
 	{
-		snprintf(fname_buffer, sizeof(fname_buffer), (s_param.mode == CONV_MODE_XOBJ) ? "%s.XSP" : "%s.SP", s_param.outname);
-		FILE *f = fopen(fname_buffer, "wb");
+		snprintf(fname_buffer, sizeof(fname_buffer), (s_param.mode == CONV_MODE_XOBJ) ? "%s.XSP" : "%s.SP", outname);
+		FILE *f = output_open(fname_buffer);
 		if (!f) goto fwberror;
-		fwrite(s_pcg_dat, 128, s_pcg_count, f);
-		fclose(f);
+		write_pcg_dat(f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
 
-		snprintf(fname_buffer, sizeof(fname_buffer), "%s.PAL", s_param.outname);
-		f = fopen(fname_buffer, "wb");
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.PAL", outname);
+		f = output_open(fname_buffer);
 		if (!f) goto fwberror;
 		for (int i = 0; i < ARRAYSIZE(s_pal_dat); i++)
 		{
 			fputc(s_pal_dat[i] >> 8, f);
 			fputc(s_pal_dat[i] & 0xFF, f);
 		}
-		fclose(f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
 
 		if (s_param.mode == CONV_MODE_XOBJ)
 		{
-			snprintf(fname_buffer, sizeof(fname_buffer), "%s.REF", s_param.outname);
-			f = fopen(fname_buffer, "wb");
+			snprintf(fname_buffer, sizeof(fname_buffer), "%s.REF", outname);
+			f = output_open(fname_buffer);
 			if (!f) goto fwberror;
-			fwrite(s_ref_dat, 8, s_ref_count, f);
-			fclose(f);
+			write_ref_dat(f);
+			if (!output_close(f, fname_buffer)) goto fwberror;
 
-			snprintf(fname_buffer, sizeof(fname_buffer), "%s.FRM", s_param.outname);
-			f = fopen(fname_buffer, "wb");
+			snprintf(fname_buffer, sizeof(fname_buffer), "%s.FRM", outname);
+			f = output_open(fname_buffer);
 			if (!f) goto fwberror;
-			fwrite(s_frm_dat, 1, s_frm_offs, f);
-			fclose(f);
+			write_frm_dat(f);
+			if (!output_close(f, fname_buffer)) goto fwberror;
+		}
+	}
+
+	// The BOX table is emitted separately even when bundling, so that the
+	// XSB layout expected by XSPman is left untouched.
+	if (s_param.box && s_param.mode == CONV_MODE_XOBJ)
+	{
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.BOX", outname);
+		FILE *f = output_open(fname_buffer);
+		if (!f) goto fwberror;
+		fwrite(s_box_dat, 16, s_box_count, f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
+	}
+
+	if (s_param.msk && s_param.mode == CONV_MODE_XOBJ)
+	{
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.MSK", outname);
+		FILE *f = output_open(fname_buffer);
+		if (!f) goto fwberror;
+		const uint32_t table_bytes = 4 * s_msk_count;
+		for (int i = 0; i < s_msk_count; i++)
+		{
+			uint8_t offs[4];
+			set_uint32be(offs, table_bytes + s_msk_offs[i]);
+			fwrite(offs, 1, sizeof(offs), f);
 		}
+		fwrite(s_msk_dat, 1, s_msk_bytes, f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
+	}
+
+	if (s_param.fade_steps > 0)
+	{
+		snprintf(fname_buffer, sizeof(fname_buffer), "%s.FAD", outname);
+		FILE *f = output_open(fname_buffer);
+		if (!f) goto fwberror;
+		fputc(s_param.fade_steps >> 8, f);
+		fputc(s_param.fade_steps & 0xFF, f);
+		write_fade_ramp(f, FADE_BLACK, s_param.fade_steps);
+		write_fade_ramp(f, FADE_WHITE, s_param.fade_steps);
+		write_fade_ramp(f, FADE_NEGATIVE, s_param.fade_steps);
+		if (!output_close(f, fname_buffer)) goto fwberror;
+	}
+
+	if (s_param.index)
+	{
+		index_fname(fname_buffer, sizeof(fname_buffer), outname);
+		FILE *f = output_open(fname_buffer);
+		if (!f) goto fwberror;
+		write_pcg_index(f);
+		if (!output_close(f, fname_buffer)) goto fwberror;
 	}
 	ret = true;
 
@@ -192,51 +747,333 @@ bool record_complete(void)
 
 fwberror:
 	ret = false;
-	printf("Couldn't open %s for writing.\n", fname_buffer);
+	printf("Couldn't write %s.\n", fname_buffer);
 
 done:
-	free(s_pcg_dat);
-	free(s_ref_dat);
-	free(s_frm_dat);
 	return ret;
 }
 
+bool record_complete(void)
+{
+	const bool ret = record_write(s_param.outname);
+	record_discard();
+	return ret;
+}
+
+void record_discard(void)
+{
+	if (s_spill_fname)
+	{
+		spill_close(&s_spill);
+		remove(s_spill_fname);
+		s_spill_fname = NULL;
+	}
+	else
+	{
+		free(s_pcg_dat);
+	}
+	s_pcg_dat = NULL;
+	free(s_pool);
+	free(s_pool_table);
+	s_pool = NULL;
+	s_pool_table = NULL;
+	s_pool_capacity = 0;
+	free(s_box_dat);
+	free(s_msk_offs);
+	free(s_msk_dat);
+	unmap_file(s_base_map, s_base_map_size);
+	s_base_map = NULL;
+}
+
+//
+// Dedupe window
+//
+
+// Entries that have left the window can't be matched, even before they are
+// evicted.
+static bool pool_expired(const WindowEntry *entry)
+{
+	return !entry->hot && s_ref.count - entry->last_frame >= s_window;
+}
+
+static void pool_table_insert(int e)
+{
+	const uint32_t mask = 2 * s_pool_capacity - 1;
+	uint32_t slot = s_pool[e].hash & mask;
+	while (s_pool_table[slot] >= 0) slot = (slot + 1) & mask;
+	s_pool_table[slot] = e;
+}
+
+// Entries probed past the one removed are shifted back into the gap, so that
+// lookups don't need to step over removed slots.
+static void pool_table_remove(int e)
+{
+	const uint32_t mask = 2 * s_pool_capacity - 1;
+	uint32_t hole = s_pool[e].hash & mask;
+	while (s_pool_table[hole] != e) hole = (hole + 1) & mask;
+	for (uint32_t slot = (hole + 1) & mask; s_pool_table[slot] >= 0;
+	     slot = (slot + 1) & mask)
+	{
+		const uint32_t home = s_pool[s_pool_table[slot]].hash & mask;
+		if (((slot - home) & mask) < ((slot - hole) & mask)) continue;
+		s_pool_table[hole] = s_pool_table[slot];
+		hole = slot;
+	}
+	s_pool_table[hole] = -1;
+}
+
+// Returns how many entries were evicted.
+static int pool_evict(void)
+{
+	int evicted = 0;
+	for (int e = 0; e < s_pool_count; e++)
+	{
+		WindowEntry *entry = &s_pool[e];
+		if (!entry->live || !pool_expired(entry)) continue;
+		pool_table_remove(e);
+		entry->live = false;
+		entry->idx = s_pool_free;
+		s_pool_free = e;
+		evicted++;
+	}
+	return evicted;
+}
+
+static bool pool_grow(void)
+{
+	const int capacity = s_pool_capacity ? 2 * s_pool_capacity :
+	                     WINDOW_POOL_INITIAL;
+	WindowEntry *pool = realloc(s_pool, sizeof(WindowEntry) * capacity);
+	if (!pool) return false;
+	s_pool = pool;
+	int32_t *table = malloc(sizeof(int32_t) * 2 * capacity);
+	if (!table) return false;
+	free(s_pool_table);
+	s_pool_table = table;
+	s_pool_capacity = capacity;
+	memset(s_pool_table, 0xFF, sizeof(int32_t) * 2 * capacity);
+	for (int e = 0; e < s_pool_count; e++)
+	{
+		if (s_pool[e].live) pool_table_insert(e);
+	}
+	return true;
+}
+
+// Takes a free entry, evicting what has left the window once all are in use.
+// The pool grows if that frees too few. Returns -1 if it can't.
+static int pool_alloc(void)
+{
+	if (s_pool_free < 0 && s_pool_count == s_pool_capacity)
+	{
+		const int evicted = pool_evict();
+		if (evicted <= s_pool_capacity / 4 && !pool_grow() && evicted == 0)
+		{
+			return -1;
+		}
+	}
+	if (s_pool_free < 0) return s_pool_count++;
+	const int e = s_pool_free;
+	s_pool_free = s_pool[e].idx;
+	return e;
+}
+
+static int pool_find(uint32_t hash, const uint8_t *src)
+{
+	if (s_pool_capacity == 0) return -1;
+	const uint32_t mask = 2 * s_pool_capacity - 1;
+	for (uint32_t slot = hash & mask; s_pool_table[slot] >= 0;
+	     slot = (slot + 1) & mask)
+	{
+		const WindowEntry *entry = &s_pool[s_pool_table[slot]];
+		if (entry->hash == hash && !pool_expired(entry) &&
+		    memcmp(entry->dat, src, 128) == 0)
+		{
+			return s_pool_table[slot];
+		}
+	}
+	return -1;
+}
+
+// Returns the live entry for pattern idx, adding one if it has none.
+static int pool_use(int idx, uint32_t hash, const uint8_t *src)
+{
+	if (s_pool_capacity > 0)
+	{
+		const uint32_t mask = 2 * s_pool_capacity - 1;
+		for (uint32_t slot = hash & mask; s_pool_table[slot] >= 0;
+		     slot = (slot + 1) & mask)
+		{
+			if (s_pool[s_pool_table[slot]].idx == idx) return s_pool_table[slot];
+		}
+	}
+	const int e = pool_alloc();
+	if (e < 0) return -1;
+	WindowEntry *entry = &s_pool[e];
+	entry->idx = idx;
+	entry->hash = hash;
+	entry->uses = 0;
+	entry->live = true;
+	entry->hot = false;
+	memcpy(entry->dat, src, 128);
+	pool_table_insert(e);
+	return e;
+}
+
 //
 // Data commit functions
 //
 
+static uint32_t frm_run_hash(uint32_t first, uint16_t sp_count)
+{
+	const int16_t *fields[3] = {&s_frm.vx[first], &s_frm.vy[first],
+	                            &s_frm.pt[first]};
+	uint32_t hash = FNV1A32_INIT;
+	for (int f = 0; f < ARRAYSIZE(fields); f++)
+	{
+		hash = fnv1a32(hash, fields[f], sizeof(int16_t) * sp_count);
+	}
+	return hash;
+}
+
+static bool frm_runs_equal(uint32_t a, uint32_t b, uint16_t sp_count)
+{
+	const size_t bytes = sizeof(int16_t) * sp_count;
+	return memcmp(&s_frm.vx[a], &s_frm.vx[b], bytes) == 0 &&
+	       memcmp(&s_frm.vy[a], &s_frm.vy[b], bytes) == 0 &&
+	       memcmp(&s_frm.pt[a], &s_frm.pt[b], bytes) == 0 &&
+	       memcmp(&s_frm.rv[a], &s_frm.rv[b], bytes) == 0;
+}
+
+// Looks the run of sp_count entries from first up in the FRM pool. If it is
+// already there, the new copy is dropped and the first entry of the pooled run
+// is returned; otherwise the run is added to the pool and first is returned.
+static uint32_t frm_pool_run(uint16_t sp_count, uint32_t first)
+{
+	// Only the run just recorded can be dropped again.
+	if (s_param.no_dedupe || sp_count == 0 || first + sp_count != s_frm.count) return first;
+
+	const uint32_t hash = frm_run_hash(first, sp_count);
+	uint32_t slot = hash % FRM_POOL_TABLE_SIZE;
+	while (s_frm_pool[slot].sp_count != 0)
+	{
+		const FrmRun *pooled = &s_frm_pool[slot];
+		if (pooled->hash == hash && pooled->sp_count == sp_count &&
+		    frm_runs_equal(pooled->first, first, sp_count))
+		{
+			s_frm.count = first;
+			s_frm_pooled++;
+			return pooled->first;
+		}
+		slot = (slot + 1) % FRM_POOL_TABLE_SIZE;
+	}
+	s_frm_pool[slot].hash = hash;
+	s_frm_pool[slot].first = first;
+	s_frm_pool[slot].sp_count = sp_count;
+	return first;
+}
+
 // Commits a metasprite to the REF_DAT file.
 // sp_count: hardware sprites used in metasprite
 // frm_offs: offset within FRM_DAT file for this metasprite
 void record_ref_dat(uint16_t sp_count, uint32_t frm_offs)
 {
-	if (s_ref_count >= PCG_REF_MAX_COUNT) return;
-	uint8_t *ref = &s_ref_dat[s_ref_count * 8];
-	set_uint16be(ref, sp_count);
-	set_uint32be(ref + 2, frm_offs);
-	set_uint16be(ref + 6, 0);  // Reserved / padding.
-	s_ref_count++;
+	if (s_ref.count >= PCG_REF_MAX_COUNT) return;
+	s_ref.sp_count[s_ref.count] = sp_count;
+	s_ref.first[s_ref.count] = frm_pool_run(sp_count, frm_offs / 8);
+	s_ref.count++;
+}
+
+void record_repeat_ref(void)
+{
+	if (s_ref.count <= 0 || s_ref.count >= PCG_REF_MAX_COUNT) return;
+	s_ref.sp_count[s_ref.count] = s_ref.sp_count[s_ref.count - 1];
+	s_ref.first[s_ref.count] = s_ref.first[s_ref.count - 1];
+	s_ref.count++;
+	if (s_box_count > 0)
+	{
+		memcpy(&s_box_dat[s_box_count * 16], &s_box_dat[(s_box_count - 1) * 16],
+		       16);
+		s_box_count++;
+	}
+	if (s_msk_count > 0)
+	{
+		s_msk_offs[s_msk_count] = s_msk_offs[s_msk_count - 1];
+		s_msk_count++;
+	}
+}
+
+void record_box_dat(const FrameBox *opaque, const FrameBox *sprites)
+{
+	if (s_box_count >= PCG_REF_MAX_COUNT) return;
+	uint8_t *box = &s_box_dat[s_box_count * 16];
+	set_framebox(box, opaque);
+	set_framebox(box + 8, sprites);
+	s_box_count++;
+}
+
+void record_msk_dat(int16_t x, int16_t y, uint16_t words, uint16_t rows,
+                    const uint8_t *dat)
+{
+	if (s_msk_count >= PCG_REF_MAX_COUNT) return;
+	if (!dat) words = rows = 0;
+	const size_t dat_bytes = 2 * words * rows;
+	const size_t needed = s_msk_bytes + 8 + dat_bytes;
+	if (needed > s_msk_capacity)
+	{
+		size_t capacity = s_msk_capacity ? s_msk_capacity : 65536;
+		while (capacity < needed) capacity *= 2;
+		uint8_t *grown = realloc(s_msk_dat, capacity);
+		if (!grown)
+		{
+			// The entry is still recorded, empty, to stay in step with REF.
+			printf("Couldn't grow MSK data buffer.\n");
+			if (dat_bytes > 0) record_msk_dat(x, y, 0, 0, NULL);
+			return;
+		}
+		s_msk_dat = grown;
+		s_msk_capacity = capacity;
+	}
+	uint8_t *msk = &s_msk_dat[s_msk_bytes];
+	set_int16be(msk, x);
+	set_int16be(msk + 2, y);
+	set_uint16be(msk + 4, words);
+	set_uint16be(msk + 6, rows);
+	if (dat_bytes > 0) memcpy(msk + 8, dat, dat_bytes);
+	s_msk_offs[s_msk_count] = s_msk_bytes;
+	s_msk_bytes = needed;
+	s_msk_count++;
 }
 
 void record_frm_dat(int16_t vx, int16_t vy, int16_t pt, uint16_t rv)
 {
-	if (s_frm_offs >= PCG_FRM_MAX_COUNT) return;
-	uint8_t *frm = &s_frm_dat[s_frm_offs];
-	set_int16be(frm, vx);
-	set_int16be(frm + 2, vy);
-	set_int16be(frm + 4, pt);
-	set_uint16be(frm + 6, rv);
+	if (s_frm.count >= ARRAYSIZE(s_frm_vx)) return;
+	s_frm.vx[s_frm.count] = vx;
+	s_frm.vy[s_frm.count] = vy;
+	s_frm.pt[s_frm.count] = pt;
+	s_frm.rv[s_frm.count] = rv;
 //	printf("frm: %04d %04d %04d %04d \t$%04X%04X%04X%04X\n", vx, vy, pt, rv, vx, vy, pt, rv);
-	s_frm_offs += 8;
+	s_frm.count++;
 }
 
 // src points to a 128 byte chunk of PCG data
-void record_pcg_dat(const uint8_t *src)
+bool record_pcg_dat(const uint8_t *src)
 {
-	if (s_pcg_count >= PCG_PT_MAX_COUNT) return;
-	memcpy(&s_pcg_dat[s_pcg_count * 128], src, 128);
+	if (s_pcg_count >= PCG_PT_MAX_COUNT) return false;
+	if (!pcg_reserve(s_pcg_count - s_base_count + 1)) return false;
+	const size_t end = 128 * (size_t)(s_pcg_count - s_base_count + 1);
+	memcpy(&s_pcg_dat[end - 128], src, 128);
 //	fwrite(src, 1, 128, sf_pcg_out);
+	if (s_window <= 0)
+	{
+		pcg_table_insert(s_pcg_count, pcg_hash(src));
+	}
+	else if (end - s_spill_released >= SPILL_RELEASE_BYTES)
+	{
+		spill_release(&s_spill, s_spill_released, SPILL_RELEASE_BYTES);
+		s_spill_released += SPILL_RELEASE_BYTES;
+	}
 	s_pcg_count++;
+	return true;
 }
 
 void record_pal_dat(int idx, uint16_t val)
@@ -245,13 +1082,293 @@ void record_pal_dat(int idx, uint16_t val)
 	s_pal_dat[idx] = val;
 }
 
-// TODO: Consider storing hashes of the tiles alongside this
 int record_find_pcg_dat(const uint8_t *src)
 {
-	for (int i = 0; i < s_pcg_count; i++)
+	// Without deduplication, a base bank is still reused as asked.
+	if (s_param.no_dedupe && s_base_count == 0) return -1;
+	const int limit = s_param.no_dedupe ? s_base_count : s_pcg_count;
+	const uint32_t hash = pcg_hash(src);
+	uint32_t slot = hash % PCG_HASH_TABLE_SIZE;
+	while (s_pcg_table[slot] != 0)
 	{
-		const uint8_t *candidate = &s_pcg_dat[i * 128];
-		if (memcmp(candidate, src, 128) == 0) return i;
+		const int idx = s_pcg_table[slot] - 1;
+		if (idx < limit && s_pcg_hash[idx] == hash &&
+		    memcmp(pcg_ptr(idx), src, 128) == 0)
+		{
+			return idx;
+		}
+		slot = (slot + 1) % PCG_HASH_TABLE_SIZE;
+	}
+	// Under a window, only base patterns are in the table.
+	if (s_window > 0 && !s_param.no_dedupe)
+	{
+		const int e = pool_find(hash, src);
+		if (e >= 0) return s_pool[e].idx;
 	}
 	return -1;
 }
+
+int record_merge_flipped_pcg(uint64_t deadline_us, bool *cut_short)
+{
+	*cut_short = false;
+	if (s_pcg_count == 0) return 0;
+	int32_t *remap = malloc(sizeof(int32_t) * s_pcg_count);
+	uint16_t *flip = malloc(sizeof(uint16_t) * s_pcg_count);
+	if (!remap || !flip)
+	{
+		printf("Couldn't allocate pattern remap table.\n");
+		free(remap);
+		free(flip);
+		return 0;
+	}
+
+	// Each pattern is looked up mirrored before anything is moved, so the
+	// dictionary still matches the data. A pattern found to mirror one that was
+	// itself dropped combines both flips.
+	static const uint16_t k_flips[3] = {FRM_RV_HFLIP, FRM_RV_VFLIP,
+	                                    FRM_RV_HFLIP | FRM_RV_VFLIP};
+	int kept = 0;
+	for (int i = 0; i < s_pcg_count; i++)
+	{
+		remap[i] = -1;
+		flip[i] = 0;
+		if (i >= s_base_count && !*cut_short)
+		{
+			*cut_short = deadline_us != 0 && time_us() >= deadline_us;
+		}
+		const bool mergeable = i >= s_base_count && !*cut_short;
+		for (int f = 0; mergeable && f < ARRAYSIZE(k_flips); f++)
+		{
+			uint8_t mirrored[128];
+			pcg_flip(pcg_ptr(i), mirrored, k_flips[f] & FRM_RV_HFLIP,
+			         k_flips[f] & FRM_RV_VFLIP);
+			const int j = record_find_pcg_dat(mirrored);
+			if (j < 0 || j >= i) continue;
+			remap[i] = remap[j];
+			flip[i] = flip[j] ^ k_flips[f];
+			break;
+		}
+		if (remap[i] < 0) remap[i] = kept++;
+	}
+
+	const int dropped = s_pcg_count - kept;
+	if (dropped > 0)
+	{
+		for (uint32_t i = 0; i < s_frm.count; i++)
+		{
+			const int pt = s_frm.pt[i];
+			if (pt < 0 || pt >= s_pcg_count) continue;
+			s_frm.rv[i] ^= flip[pt];
+			s_frm.pt[i] = remap[pt];
+		}
+
+		// Kept patterns only ever move down, so they are moved in order. Those
+		// dropped map to an index below the next kept one.
+		memset(s_pcg_table, 0, sizeof(s_pcg_table));
+		int dst = 0;
+		for (int i = 0; i < s_pcg_count; i++)
+		{
+			if (remap[i] != dst) continue;
+			if (dst != i)
+			{
+				memcpy(&s_pcg_dat[(dst - s_base_count) * 128],
+				       &s_pcg_dat[(i - s_base_count) * 128], 128);
+			}
+			pcg_table_insert(dst, s_pcg_hash[i]);
+			dst++;
+		}
+		s_pcg_count = kept;
+	}
+	free(remap);
+	free(flip);
+	return dropped;
+}
+
+void record_shift_origin(int dx, int dy)
+{
+	// Positions after the first of a run are relative to the sprite before, so
+	// only first entries move. Frames that share a run move it once.
+	uint8_t *moved = calloc(s_frm.count + 1, 1);
+	if (!moved)
+	{
+		printf("Couldn't allocate FRM shift table.\n");
+		return;
+	}
+	for (int i = 0; i < s_ref.count; i++)
+	{
+		const uint32_t first = s_ref.first[i];
+		if (s_ref.sp_count[i] == 0 || moved[first]) continue;
+		moved[first] = 1;
+		s_frm.vx[first] -= dx;
+		s_frm.vy[first] -= dy;
+	}
+	free(moved);
+
+	// Empty frames keep their all-zero boxes and masks.
+	for (int i = 0; i < 2 * s_box_count; i++)
+	{
+		uint8_t *box = &s_box_dat[i * 8];
+		if (get_uint16be(box) == get_uint16be(box + 4)) continue;
+		set_int16be(box, (int16_t)get_uint16be(box) - dx);
+		set_int16be(box + 2, (int16_t)get_uint16be(box + 2) - dy);
+		set_int16be(box + 4, (int16_t)get_uint16be(box + 4) - dx);
+		set_int16be(box + 6, (int16_t)get_uint16be(box + 6) - dy);
+	}
+
+	// Repeated frames share masks, so the data is walked rather than the
+	// offset table.
+	for (size_t offs = 0; offs + 8 <= s_msk_bytes; )
+	{
+		uint8_t *msk = &s_msk_dat[offs];
+		if (get_uint16be(msk + 6) > 0)
+		{
+			set_int16be(msk, (int16_t)get_uint16be(msk) - dx);
+			set_int16be(msk + 2, (int16_t)get_uint16be(msk + 2) - dy);
+		}
+		offs += 8 + (2 * get_uint16be(msk + 4) * get_uint16be(msk + 6));
+	}
+}
+
+// Saved state begins with the counts below, followed by the palette, then
+// each array in turn, in host byte order.
+typedef struct RecordState
+{
+	uint32_t pcg_count;
+	uint32_t frm_count;
+	uint32_t ref_count;
+	uint32_t box_count;
+	uint32_t msk_count;
+	uint32_t msk_bytes;
+} RecordState;
+
+bool record_save_state(FILE *f)
+{
+	if (s_base_count > 0) return false;
+	const RecordState state = {s_pcg_count, s_frm.count, s_ref.count,
+	                           s_box_count, s_msk_count, s_msk_bytes};
+	fwrite(&state, sizeof(state), 1, f);
+	fwrite(s_pal_dat, sizeof(s_pal_dat), 1, f);
+	fwrite(s_pcg_dat, 128, s_pcg_count, f);
+	fwrite(s_frm.vx, sizeof(int16_t), s_frm.count, f);
+	fwrite(s_frm.vy, sizeof(int16_t), s_frm.count, f);
+	fwrite(s_frm.pt, sizeof(int16_t), s_frm.count, f);
+	fwrite(s_frm.rv, sizeof(uint16_t), s_frm.count, f);
+	fwrite(s_ref.sp_count, sizeof(uint16_t), s_ref.count, f);
+	fwrite(s_ref.first, sizeof(uint32_t), s_ref.count, f);
+	fwrite(s_box_dat, 16, s_box_count, f);
+	fwrite(s_msk_offs, sizeof(uint32_t), s_msk_count, f);
+	fwrite(s_msk_dat, 1, s_msk_bytes, f);
+	return !ferror(f);
+}
+
+// Copies count elements of size bytes from the saved state at *buf to dst,
+// unless fewer than that remain.
+static bool take_state(void *dst, size_t size, size_t count,
+                       const uint8_t **buf, size_t *remaining)
+{
+	const size_t bytes = size * count;
+	if (bytes > *remaining) return false;
+	memcpy(dst, *buf, bytes);
+	*buf += bytes;
+	*remaining -= bytes;
+	return true;
+}
+
+bool record_restore_state(const uint8_t *buf, size_t size)
+{
+	RecordState state;
+	if (!take_state(&state, sizeof(state), 1, &buf, &size)) return false;
+	if (state.pcg_count > PCG_PT_MAX_COUNT ||
+	    state.frm_count > ARRAYSIZE(s_frm_vx) ||
+	    state.ref_count > PCG_REF_MAX_COUNT ||
+	    state.box_count > PCG_REF_MAX_COUNT ||
+	    state.msk_count > PCG_REF_MAX_COUNT)
+	{
+		return false;
+	}
+	if (!pcg_reserve(state.pcg_count)) return false;
+	if (state.msk_bytes > 0)
+	{
+		uint8_t *msk = realloc(s_msk_dat, state.msk_bytes);
+		if (!msk) return false;
+		s_msk_dat = msk;
+		s_msk_capacity = state.msk_bytes;
+	}
+	if (!take_state(s_pal_dat, sizeof(s_pal_dat), 1, &buf, &size) ||
+	    !take_state(s_pcg_dat, 128, state.pcg_count, &buf, &size) ||
+	    !take_state(s_frm.vx, sizeof(int16_t), state.frm_count, &buf, &size) ||
+	    !take_state(s_frm.vy, sizeof(int16_t), state.frm_count, &buf, &size) ||
+	    !take_state(s_frm.pt, sizeof(int16_t), state.frm_count, &buf, &size) ||
+	    !take_state(s_frm.rv, sizeof(uint16_t), state.frm_count, &buf, &size) ||
+	    !take_state(s_ref.sp_count, sizeof(uint16_t), state.ref_count, &buf, &size) ||
+	    !take_state(s_ref.first, sizeof(uint32_t), state.ref_count, &buf, &size) ||
+	    !take_state(s_box_dat, 16, state.box_count, &buf, &size) ||
+	    !take_state(s_msk_offs, sizeof(uint32_t), state.msk_count, &buf, &size) ||
+	    !take_state(s_msk_dat, 1, state.msk_bytes, &buf, &size))
+	{
+		return false;
+	}
+
+	s_pcg_count = 0;
+	memset(s_pcg_table, 0, sizeof(s_pcg_table));
+	for (uint32_t i = 0; i < state.pcg_count; i++)
+	{
+		pcg_table_insert(i, pcg_hash(pcg_ptr(i)));
+		s_pcg_count++;
+	}
+	s_frm.count = state.frm_count;
+	s_ref.count = state.ref_count;
+	s_box_count = state.box_count;
+	s_msk_count = state.msk_count;
+	s_msk_bytes = state.msk_bytes;
+	return true;
+}
+
+bool record_use_pcg(int idx, const uint8_t *src)
+{
+	if (s_window <= 0 || idx < s_base_count || idx >= s_pcg_count) return true;
+	const uint32_t hash = pcg_hash(src);
+	const uint32_t bit = (hash ^ (hash >> 16)) % WINDOW_SKETCH_BITS;
+	if (!(s_global_sketch[bit / 8] & (1 << (bit % 8))))
+	{
+		s_global_sketch[bit / 8] |= 1 << (bit % 8);
+		s_global_zeros--;
+	}
+
+	const int e = pool_use(idx, hash, src);
+	if (e < 0)
+	{
+		printf("Couldn't grow dedupe window pool.\n");
+		return false;
+	}
+	WindowEntry *entry = &s_pool[e];
+	entry->last_frame = s_ref.count;
+	entry->uses++;
+
+	// The most used patterns are kept in a small set, which replaces its least
+	// used member once another pattern overtakes it.
+	if (entry->hot)
+	{
+		if (e != s_hot[s_hot_min]) return true;
+	}
+	else if (s_hot_count < WINDOW_HOT_COUNT)
+	{
+		entry->hot = true;
+		s_hot[s_hot_count++] = e;
+	}
+	else if (entry->uses > s_pool[s_hot[s_hot_min]].uses)
+	{
+		s_pool[s_hot[s_hot_min]].hot = false;
+		entry->hot = true;
+		s_hot[s_hot_min] = e;
+	}
+	else
+	{
+		return true;
+	}
+	for (int i = 0; i < s_hot_count; i++)
+	{
+		if (s_pool[s_hot[i]].uses < s_pool[s_hot[s_hot_min]].uses) s_hot_min = i;
+	}
+	return true;
+}
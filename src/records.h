@@ -4,12 +4,20 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "types.h"
 
 #define PCG_PT_MAX_COUNT 32768
 #define PCG_REF_MAX_COUNT (32768/8)
 #define PCG_FRM_MAX_COUNT 32768
 
+// Most used patterns that stay in a dedupe window (see record_set_window).
+#define WINDOW_HOT_COUNT 256
+
+// FRM rv bits, as in the sprite attribute word.
+#define FRM_RV_HFLIP 0x4000
+#define FRM_RV_VFLIP 0x8000
+
 typedef struct XSBHeader
 {
 	uint16_t type;
@@ -22,6 +30,39 @@ typedef struct XSBHeader
 	uint32_t pcg_offs;
 } XSBHeader;
 
+// Extents of a frame in pixels, relative to the frame origin. Right and bottom
+// edges are exclusive. An empty frame has all fields set to zero.
+typedef struct FrameBox
+{
+	int16_t left;
+	int16_t top;
+	int16_t right;
+	int16_t bottom;
+} FrameBox;
+
+// REF and FRM entries are held in native form, one array per field, until
+// record_complete() serializes them to big-endian files. Passes that renumber
+// patterns, reorder sprites, or share runs may rewrite them in place.
+//
+// FRM entries in file order. As in the file, positions are relative to the
+// previous sprite of the same frame.
+typedef struct FrmTable
+{
+	int16_t *vx;
+	int16_t *vy;
+	int16_t *pt;
+	uint16_t *rv;
+	uint32_t count;
+} FrmTable;
+
+// REF entries: the sprite count of each frame, and its first FRM entry.
+typedef struct RefTable
+{
+	uint16_t *sp_count;
+	uint32_t *first;
+	int count;
+} RefTable;
+
 // Prepares file handles/buffers for the files indicated by outname.
 // If not bundling:
 // <outname>.xsp or <outname>.sp depending on mode
@@ -30,21 +71,140 @@ typedef struct XSBHeader
 //
 // If bundling:
 // <outname>.xsb for consumption by XSPman. See XSBHeader type
+// outname may name shared memory instead; see output_open().
 // Returns true if initialization was successful.
 bool record_init(const char *outname, ConvMode mode, bool bundle);
 
+// Enables emission of <outname>.BOX alongside the other files (XSP only).
+// For every REF entry, the file holds two big-endian FrameBox records:
+// the tight bounds of the opaque pixels, followed by the area covered by
+// the hardware sprites that compose the frame.
+void record_set_box_output(bool enable);
+
+// Enables emission of <outname>.MSK alongside the other files (XSP only).
+// The file begins with a table of big-endian 32-bit offsets, one per REF
+// entry, measured from the start of the file. Each offset points at a mask:
+//     int16_t x, y;     Top-left of the mask relative to the origin
+//     uint16_t words;   Row length in 16-bit words
+//     uint16_t rows;    Row count
+//     uint16_t dat[];   1bpp opaque mask, MSB leftmost
+void record_set_msk_output(bool enable);
+bool record_get_msk_output(void);
+
+// Enables emission of <outname>.FAD, holding palette ramps precomputed from
+// the PAL data in the same X68000 GRB-I word format. The file begins with a
+// big-endian uint16_t step count N, then three ramps of N palettes each:
+// fade to black, fade to white, and a flash that fades to the negative of
+// each color. Palette k (1 to N) of a ramp is k/N of the way to its target,
+// and index 0 is left transparent throughout. 0 disables the output.
+void record_set_fade_steps(int steps);
+
+// Enables emission of a PCG hash index next to the pattern data, named after
+// outname with the extension .PXI. It holds the magic "PXI1", a big-endian
+// uint32_t pattern count, then for each pattern a big-endian uint32_t
+// pcg_hash() followed by a uint32_t pcg_canonical_hash(). A later run can
+// seed its dictionary from the index without hashing the bank again.
+void record_set_index_output(bool enable);
+
+// Keeps PCG data in the file fname, mapped, instead of in memory, so that the
+// kernel pages it out as needed. Only pattern hashes and the dictionary's
+// table stay resident. The file is written front to back as patterns are
+// added, and removed once the records are complete or discarded.
+// Call right after record_init. Returns false if the file can't be created.
+bool record_set_spill(const char *fname);
+
+// Bytes of PCG data held in the spill file, or 0 if there is none.
+size_t record_get_spill_bytes(void);
+
+// Enables lookups of identical patterns and FRM runs (the default). When
+// disabled, record_find_pcg_dat() only finds patterns of the base bank (see
+// record_load_base()), and every REF entry keeps its own FRM data.
+void record_set_dedupe(bool enable);
+
+// Limits pattern lookups to a window: patterns used by one of the last frames
+// REF entries, and the WINDOW_HOT_COUNT patterns used most so far. Others are
+// evicted, and are added anew if they come back. 0 (the default) looks up every
+// pattern. Base bank patterns are always looked up.
+// Only the patterns in the window are held in memory; the PCG data goes to the
+// spill file (see record_set_spill), and is let go of as it is written. Unless
+// one was set, it is <outname>.spill, or a temporary file if the output is in
+// shared memory. Call after record_set_spill. Returns false if the spill file
+// can't be created.
+bool record_set_window(int frames);
+int record_get_window(void);
+
+// Notes that pattern idx, whose data is src, is used by the frame being
+// recorded, for the window. Returns false if it can't be tracked.
+bool record_use_pcg(int idx, const uint8_t *src);
+
+// Estimated PCG count that global dedupe would have had, from the distinct
+// patterns used while a window was set. They are counted in fixed memory, to
+// within about a percent up to PCG_PT_MAX_COUNT.
+int record_get_global_pcg_count(void);
+
+// Seeds the PCG dictionary with the patterns of an existing bank, so that they
+// are reused rather than duplicated. fname is an XSP/SP file or an XSB bundle.
+// If a sidecar index is found next to it, pattern hashes are taken from it.
+// If link is false, the base patterns are copied to the start of the output
+// bank and new patterns are appended after them.
+// If link is true, the base bank is expected to be resident on the target
+// ahead of this one; its patterns are referenced but not emitted, and new
+// patterns are numbered from the end of the base bank.
+// Call after record_init. Returns false if the bank could not be used.
+bool record_load_base(const char *fname, bool link);
+
 // Commits file data and frees buffers.
 bool record_complete(void);
 
-// Records a REF entry.
+// Writes the files for outname as record_init() names them, keeping the data
+// for further changes and writes. Finish with record_complete() or
+// record_discard().
+bool record_write(const char *outname);
+
+// Moves the frame origin right by dx and down by dy, by rewriting the first
+// FRM entry of every frame, and the BOX and MSK positions. Patterns and the
+// rest of the FRM data don't depend on the origin.
+void record_shift_origin(int dx, int dy);
+
+// Saves the recorded PCG, REF, FRM, BOX, MSK, and PAL data to f in host byte
+// order, for record_restore_state() to put back in a later run. Returns false
+// if nothing was saved, as when a base bank is in use.
+bool record_save_state(FILE *f);
+
+// Replaces the recorded data with the size bytes at buf, as saved by
+// record_save_state(). Call after record_init(). Returns false if the data is
+// incomplete.
+bool record_restore_state(const uint8_t *buf, size_t size);
+
+// Frees buffers without writing anything.
+void record_discard(void);
+
+// Records a REF entry. If the sp_count FRM entries recorded from frm_offs are
+// identical to those of an earlier REF entry, they are dropped, and the entry
+// points at the earlier run instead.
 void record_ref_dat(uint16_t sp_count, uint32_t frm_offs);
 
+// Records the bounding boxes for the REF entry about to be recorded.
+void record_box_dat(const FrameBox *opaque, const FrameBox *sprites);
+
+// Records the collision mask for the REF entry about to be recorded.
+// dat holds words * rows 16-bit words, already in big-endian order. If dat is
+// NULL, an empty entry is recorded.
+void record_msk_dat(int16_t x, int16_t y, uint16_t words, uint16_t rows,
+                    const uint8_t *dat);
+
+// Records a REF entry identical to the last one, sharing its FRM data, along
+// with copies of its BOX and MSK entries.
+void record_repeat_ref(void);
+
 // Records an FRM entry.
 void record_frm_dat(int16_t vx, int16_t vy, int16_t pt, uint16_t rv);
 
 // Records a PCG entry.
 // src points to a 128 byte chunk of PCG tile data.
-void record_pcg_dat(const uint8_t *src);
+// Returns false if the pattern couldn't be stored, as when the spill file can't
+// grow, or the PCG area is full.
+bool record_pcg_dat(const uint8_t *src);
 
 // Sets the palette.
 void record_pal_dat(int idx, uint16_t val);
@@ -55,8 +215,26 @@ void record_pal_dat(int idx, uint16_t val);
 // src points to a 128 byte chunk of PCG tile data.
 int record_find_pcg_dat(const uint8_t *src);
 
+// Drops every pattern that is a mirror image of an earlier one, renumbering
+// the rest, and rewrites FRM entries to draw the earlier pattern flipped in its
+// place. Base bank patterns are kept. Stops early, setting *cut_short, once
+// deadline_us has passed (0 for no deadline). Returns the patterns dropped.
+int record_merge_flipped_pcg(uint64_t deadline_us, bool *cut_short);
+
+// Returns the 128 bytes of pattern idx, or NULL if there is no such pattern.
+const uint8_t *record_get_pcg_dat(int idx);
+
+// Patterns recorded, including those of a base bank.
 int record_get_pcg_count(void);
+// Patterns that are written out: those of a linked base bank (-l) are not.
+int record_get_pcg_written_count(void);
 int record_get_frm_offs(void);
 int record_get_ref_count(void);
+int record_get_frm_pooled(void);
+FrmTable *record_get_frm_table(void);
+RefTable *record_get_ref_table(void);
+
+// Returns the pcg_hash() of pattern idx.
+uint32_t record_get_pcg_hash(int idx);
 
 #endif  // RECORDS_H
@@ -0,0 +1,134 @@
+#include "sheetcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lodepng.h"
+#include "mapfile.h"
+#include "records.h"
+#include "util.h"
+
+#define SHEET_CACHE_MAGIC "PXC1"
+#define SHEET_CACHE_VERSION 1
+#define SHEET_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct SheetCacheHeader
+{
+	char magic[4];
+	uint32_t byte_order;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t key;
+	int32_t png_w;
+	int32_t png_h;
+	int32_t frame_w;
+	int32_t frame_h;
+	int32_t origin_x;
+	int32_t origin_y;
+	// Saved records follow; see record_save_state().
+} SheetCacheHeader;
+
+static const uint8_t *s_map;
+static size_t s_map_size;
+
+uint64_t sheet_cache_key(const char *const *fnames, int count,
+                         const char *options)
+{
+	uint64_t hash = FNV1A64_INIT;
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t *dat;
+		size_t size;
+		if (lodepng_load_file(&dat, &size, fnames[i]) != 0) return 0;
+		hash = fnv1a64(hash, dat, size);
+		free(dat);
+		// Keeps "ab" + "c" apart from "a" + "bc".
+		hash = fnv1a64(hash, &size, sizeof(size));
+	}
+	hash = fnv1a64(hash, options, strlen(options));
+	return hash ? hash : 1;
+}
+
+bool sheet_cache_open(const char *fname, uint64_t key, SheetCacheInfo *info)
+{
+	sheet_cache_close();
+	s_map = map_file(fname, &s_map_size);
+	if (!s_map) return false;
+	const SheetCacheHeader *header = (const SheetCacheHeader *)s_map;
+	if (s_map_size < sizeof(SheetCacheHeader) ||
+	    memcmp(header->magic, SHEET_CACHE_MAGIC, 4) != 0 ||
+	    header->byte_order != SHEET_CACHE_BYTE_ORDER ||
+	    header->version != SHEET_CACHE_VERSION || header->key != key)
+	{
+		sheet_cache_close();
+		return false;
+	}
+	info->png_w = header->png_w;
+	info->png_h = header->png_h;
+	info->frame_w = header->frame_w;
+	info->frame_h = header->frame_h;
+	info->origin_x = header->origin_x;
+	info->origin_y = header->origin_y;
+	return true;
+}
+
+bool sheet_cache_restore(int origin_x, int origin_y)
+{
+	if (!s_map) return false;
+	const SheetCacheHeader *header = (const SheetCacheHeader *)s_map;
+	if (!record_restore_state(s_map + sizeof(SheetCacheHeader),
+	                          s_map_size - sizeof(SheetCacheHeader)))
+	{
+		printf("Sheet cache entry is incomplete.\n");
+		return false;
+	}
+	record_shift_origin(origin_x - header->origin_x, origin_y - header->origin_y);
+	return true;
+}
+
+bool sheet_cache_save(const char *fname, uint64_t key,
+                      const SheetCacheInfo *info)
+{
+	SheetCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SHEET_CACHE_MAGIC, 4);
+	header.byte_order = SHEET_CACHE_BYTE_ORDER;
+	header.version = SHEET_CACHE_VERSION;
+	header.key = key;
+	header.png_w = info->png_w;
+	header.png_h = info->png_h;
+	header.frame_w = info->frame_w;
+	header.frame_h = info->frame_h;
+	header.origin_x = info->origin_x;
+	header.origin_y = info->origin_y;
+
+	// The old cache may still be mapped, so the new one is written aside and
+	// moved over it once complete.
+	char tmp_fname[256];
+	snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", fname);
+	FILE *f = fopen(tmp_fname, "wb");
+	if (!f)
+	{
+		printf("Couldn't write sheet cache %s.\n", tmp_fname);
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	bool ok = record_save_state(f);
+	ok = !ferror(f) && ok;
+	fclose(f);
+	if (!ok || rename(tmp_fname, fname) != 0)
+	{
+		printf("Couldn't write sheet cache %s.\n", fname);
+		remove(tmp_fname);
+		return false;
+	}
+	return true;
+}
+
+void sheet_cache_close(void)
+{
+	unmap_file(s_map, s_map_size);
+	s_map = NULL;
+	s_map_size = 0;
+}
@@ -0,0 +1,50 @@
+// Conversion results kept apart from the frame origin.
+//
+// Which sprites a frame is cut into, and their patterns, don't depend on the
+// origin; only the first FRM entry of each frame and the BOX and MSK positions
+// do. A sheet cache holds everything recorded for one set of inputs and
+// options, along with the origin it was recorded for. A later run with the same
+// inputs and options restores the records from it and moves them to its own
+// origin, without decoding or cutting anything.
+//
+// Entries are keyed by a hash of every input file and a string of the options
+// that affect conversion. Like a snapshot, the file is in host byte order, and
+// one from another build or machine is ignored and replaced.
+#ifndef SHEETCACHE_H
+#define SHEETCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct SheetCacheInfo
+{
+	int png_w;
+	int png_h;
+	int frame_w;
+	int frame_h;
+	int origin_x;
+	int origin_y;
+} SheetCacheInfo;
+
+// Hashes the contents of count input files, followed by options.
+// Returns 0 if an input could not be read.
+uint64_t sheet_cache_key(const char *const *fnames, int count,
+                         const char *options);
+
+// Maps the cache fname, and returns true if it holds an entry for key, filling
+// in info. Records are then restored by sheet_cache_restore().
+bool sheet_cache_open(const char *fname, uint64_t key, SheetCacheInfo *info);
+
+// Restores the records from the entry found by sheet_cache_open(), and moves
+// them to the given origin. Call after record_init().
+bool sheet_cache_restore(int origin_x, int origin_y);
+
+// Writes the current records to fname under key, replacing what was there.
+// Call before the records are written out.
+bool sheet_cache_save(const char *fname, uint64_t key,
+                      const SheetCacheInfo *info);
+
+// Unmaps the cache.
+void sheet_cache_close(void);
+
+#endif  // SHEETCACHE_H
@@ -0,0 +1,311 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapfile.h"
+#include "records.h"
+#include "util.h"
+
+#define SNAPSHOT_MAGIC "PXS1"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct SnapshotHeader
+{
+	char magic[4];
+	uint32_t byte_order;
+	uint32_t version;
+	uint32_t pattern_count;  // 128 bytes each, right after the header.
+	uint32_t table_size;  // Frame table entries, a power of two.
+	uint32_t sprite_count;  // Sprite entries, after the frame table.
+} SnapshotHeader;
+
+// Open addressing frame table, indexed by the low bits of the key.
+typedef struct SnapshotEntry
+{
+	uint64_t key;
+	uint32_t first;  // First sprite entry.
+	uint16_t count;
+	uint16_t used;
+} SnapshotEntry;
+
+typedef struct SnapshotSprite
+{
+	int16_t x;
+	int16_t y;
+	uint16_t pt;
+	uint16_t reserved;
+} SnapshotSprite;
+
+// Snapshot from the previous run.
+static const uint8_t *s_map;
+static size_t s_map_size;
+static const SnapshotHeader *s_header;
+static const uint8_t *s_patterns;
+static const SnapshotEntry *s_table;
+static const SnapshotSprite *s_sprites;
+
+// Frames recorded during this run.
+typedef struct FrameRecord
+{
+	uint64_t key;
+	uint32_t first;
+	uint16_t count;
+} FrameRecord;
+
+static const char *s_fname;
+static FrameRecord *s_frames;
+static int s_frame_count;
+static int s_frame_capacity;
+static SnapshotSprite *s_new_sprites;
+static uint32_t s_new_sprite_count;
+static uint32_t s_new_sprite_capacity;
+static int s_replayed;
+
+static bool check_header(size_t size)
+{
+	if (size < sizeof(SnapshotHeader)) return false;
+	const SnapshotHeader *header = (const SnapshotHeader *)s_map;
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 ||
+	    header->byte_order != SNAPSHOT_BYTE_ORDER ||
+	    header->version != SNAPSHOT_VERSION)
+	{
+		return false;
+	}
+	const uint32_t table_size = header->table_size;
+	if (table_size == 0 || (table_size & (table_size - 1)) != 0) return false;
+	const uint64_t expected = sizeof(SnapshotHeader) +
+	                          (128 * (uint64_t)header->pattern_count) +
+	                          (sizeof(SnapshotEntry) * (uint64_t)table_size) +
+	                          (sizeof(SnapshotSprite) * (uint64_t)header->sprite_count);
+	return expected == size;
+}
+
+bool snapshot_open(const char *fname)
+{
+	s_fname = fname;
+	s_frame_count = 0;
+	s_new_sprite_count = 0;
+	s_replayed = 0;
+	s_header = NULL;
+	s_map = map_file(fname, &s_map_size);
+	if (!s_map)
+	{
+		printf("Snapshot: starting cold, no usable %s\n", fname);
+		return true;
+	}
+	if (!check_header(s_map_size))
+	{
+		printf("Snapshot: %s is not from this version; it will be replaced\n",
+		       fname);
+		unmap_file(s_map, s_map_size);
+		s_map = NULL;
+		return true;
+	}
+
+	s_header = (const SnapshotHeader *)s_map;
+	s_patterns = s_map + sizeof(SnapshotHeader);
+	s_table = (const SnapshotEntry *)(s_patterns + (128 * s_header->pattern_count));
+	s_sprites = (const SnapshotSprite *)(s_table + s_header->table_size);
+	printf("Snapshot: %u patterns from %s\n", s_header->pattern_count, fname);
+	return true;
+}
+
+bool snapshot_active(void)
+{
+	return s_fname != NULL;
+}
+
+uint64_t snapshot_frame_key(const uint8_t *imgdat, int iw,
+                            int sx, int sy, int sw, int sh, int level)
+{
+	const int dims[3] = {sw, sh, level};
+	uint64_t hash = fnv1a64(FNV1A64_INIT, dims, sizeof(dims));
+	for (int y = sy; y < sy + sh; y++)
+	{
+		hash = fnv1a64(hash, &imgdat[sx + (y * iw)], sw);
+	}
+	return hash;
+}
+
+bool snapshot_find_frame(uint64_t key, SnapshotFrame *frame)
+{
+	if (!s_header) return false;
+	const uint32_t mask = s_header->table_size - 1;
+	for (uint32_t slot = key & mask; s_table[slot].used; slot = (slot + 1) & mask)
+	{
+		const SnapshotEntry *entry = &s_table[slot];
+		if (entry->key != key) continue;
+
+		// Entries are only trusted as far as the file reaches.
+		if ((uint64_t)entry->first + entry->count > s_header->sprite_count)
+		{
+			return false;
+		}
+		const SnapshotSprite *sprites = &s_sprites[entry->first];
+		for (int i = 0; i < entry->count; i++)
+		{
+			if (sprites[i].pt >= s_header->pattern_count) return false;
+		}
+		frame->sprites = (const uint8_t *)sprites;
+		frame->count = entry->count;
+		return true;
+	}
+	return false;
+}
+
+void snapshot_frame_sprite(const SnapshotFrame *frame, int idx,
+                           int *x, int *y, const uint8_t **pattern)
+{
+	const SnapshotSprite *sprite = &((const SnapshotSprite *)frame->sprites)[idx];
+	*x = sprite->x;
+	*y = sprite->y;
+	*pattern = &s_patterns[128 * sprite->pt];
+}
+
+void snapshot_begin_frame(uint64_t key)
+{
+	if (!s_fname) return;
+	if (s_frame_count >= s_frame_capacity)
+	{
+		const int capacity = s_frame_capacity ? s_frame_capacity * 2 : 256;
+		FrameRecord *frames = realloc(s_frames, sizeof(FrameRecord) * capacity);
+		if (!frames)
+		{
+			printf("Couldn't allocate snapshot frames; none will be saved.\n");
+			s_fname = NULL;
+			return;
+		}
+		s_frames = frames;
+		s_frame_capacity = capacity;
+	}
+	FrameRecord *frame = &s_frames[s_frame_count++];
+	frame->key = key;
+	frame->first = s_new_sprite_count;
+	frame->count = 0;
+}
+
+void snapshot_add_sprite(int x, int y, int pt)
+{
+	if (!s_fname || s_frame_count <= 0) return;
+	if (s_new_sprite_count >= s_new_sprite_capacity)
+	{
+		const uint32_t capacity = s_new_sprite_capacity ?
+		                          s_new_sprite_capacity * 2 : 1024;
+		SnapshotSprite *sprites = realloc(s_new_sprites,
+		                                  sizeof(SnapshotSprite) * capacity);
+		if (!sprites)
+		{
+			printf("Couldn't allocate snapshot sprites; none will be saved.\n");
+			s_fname = NULL;
+			return;
+		}
+		s_new_sprites = sprites;
+		s_new_sprite_capacity = capacity;
+	}
+	SnapshotSprite *sprite = &s_new_sprites[s_new_sprite_count++];
+	sprite->x = x;
+	sprite->y = y;
+	sprite->pt = pt;
+	sprite->reserved = 0;
+	s_frames[s_frame_count - 1].count++;
+}
+
+void snapshot_note_replay(void)
+{
+	s_replayed++;
+}
+
+int snapshot_get_replayed(void)
+{
+	return s_replayed;
+}
+
+int snapshot_get_frame_count(void)
+{
+	return s_frame_count;
+}
+
+bool snapshot_save(void)
+{
+	if (!s_fname) return false;
+
+	// The table is kept at most half full.
+	uint32_t table_size = 16;
+	while (table_size < 2 * (uint32_t)s_frame_count) table_size *= 2;
+	SnapshotEntry *table = calloc(table_size, sizeof(SnapshotEntry));
+	if (!table)
+	{
+		printf("Couldn't allocate snapshot frame table.\n");
+		return false;
+	}
+	for (int i = 0; i < s_frame_count; i++)
+	{
+		const FrameRecord *frame = &s_frames[i];
+		uint32_t slot = frame->key & (table_size - 1);
+		while (table[slot].used && table[slot].key != frame->key)
+		{
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (table[slot].used) continue;  // Identical frames share an entry.
+		table[slot].key = frame->key;
+		table[slot].first = frame->first;
+		table[slot].count = frame->count;
+		table[slot].used = 1;
+	}
+
+	SnapshotHeader header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.version = SNAPSHOT_VERSION;
+	header.pattern_count = record_get_pcg_count();
+	header.table_size = table_size;
+	header.sprite_count = s_new_sprite_count;
+
+	// The old snapshot may still be mapped, so the new one is written aside
+	// and moved over it once complete.
+	char tmp_fname[256];
+	snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", s_fname);
+	FILE *f = fopen(tmp_fname, "wb");
+	if (!f)
+	{
+		printf("Couldn't write snapshot %s.\n", tmp_fname);
+		free(table);
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	for (uint32_t i = 0; i < header.pattern_count; i++)
+	{
+		fwrite(record_get_pcg_dat(i), 128, 1, f);
+	}
+	fwrite(table, sizeof(SnapshotEntry), table_size, f);
+	fwrite(s_new_sprites, sizeof(SnapshotSprite), s_new_sprite_count, f);
+	const bool ok = !ferror(f);
+	fclose(f);
+	free(table);
+	if (!ok || rename(tmp_fname, s_fname) != 0)
+	{
+		printf("Couldn't write snapshot %s.\n", s_fname);
+		remove(tmp_fname);
+		return false;
+	}
+	return true;
+}
+
+void snapshot_close(void)
+{
+	unmap_file(s_map, s_map_size);
+	s_map = NULL;
+	s_header = NULL;
+	free(s_frames);
+	s_frames = NULL;
+	s_frame_count = 0;
+	s_frame_capacity = 0;
+	free(s_new_sprites);
+	s_new_sprites = NULL;
+	s_new_sprite_count = 0;
+	s_new_sprite_capacity = 0;
+	s_fname = NULL;
+}
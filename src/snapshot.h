@@ -0,0 +1,65 @@
+// Warm state carried between runs: the pattern dictionary, and the sprites
+// chopped from every frame, keyed by a hash of the frame's pixels.
+//
+// A frame that was converted by an earlier run is replayed from the snapshot
+// instead of being searched for sprites and clipped into tiles again, and its
+// patterns are taken from the snapshot's copy of the dictionary. The result is
+// identical to a cold conversion.
+//
+// The snapshot file is laid out to be used in place: it is mapped at startup,
+// and only the header is checked. Frame entries and patterns are read as they
+// are looked up. The file is in host byte order, and carries a version and a
+// byte order mark; one from another build or machine is ignored and replaced.
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A frame found in the snapshot, to be replayed sprite by sprite.
+typedef struct SnapshotFrame
+{
+	const uint8_t *sprites;
+	int count;
+} SnapshotFrame;
+
+// Maps the snapshot fname, if there is one, and arranges for a new one to be
+// written there by snapshot_save(). A missing or unusable file is not an error;
+// every frame is then converted cold. Returns false if nothing can be recorded.
+bool snapshot_open(const char *fname);
+
+// Returns true if a snapshot was opened, so frames should be keyed.
+bool snapshot_active(void);
+
+// Hashes the pixels of a frame of sw x sh pixels at sx, sy in imgdat.
+// Frames cut at different optimization levels are told apart by level.
+uint64_t snapshot_frame_key(const uint8_t *imgdat, int iw,
+                            int sx, int sy, int sw, int sh, int level);
+
+// Looks up a frame by key. Returns false if it isn't in the snapshot.
+bool snapshot_find_frame(uint64_t key, SnapshotFrame *frame);
+
+// Gets sprite idx of a frame found by snapshot_find_frame(): the top-left of
+// the sprite relative to the frame, and its 128 bytes of pattern data.
+void snapshot_frame_sprite(const SnapshotFrame *frame, int idx,
+                           int *x, int *y, const uint8_t **pattern);
+
+// Records the sprites chopped from a frame, for the next snapshot. Call
+// snapshot_begin_frame(), then snapshot_add_sprite() once per sprite, with its
+// position relative to the frame and its index in the current PCG data.
+void snapshot_begin_frame(uint64_t key);
+void snapshot_add_sprite(int x, int y, int pt);
+
+// Notes that a frame was replayed, for the statistics.
+void snapshot_note_replay(void);
+int snapshot_get_replayed(void);
+int snapshot_get_frame_count(void);
+
+// Writes the frames recorded during this run and the current PCG data as the
+// new snapshot, replacing the old one. Call before record_complete().
+bool snapshot_save(void);
+
+// Unmaps the old snapshot and frees the recorded frames.
+void snapshot_close(void);
+
+#endif  // SNAPSHOT_H
@@ -2,6 +2,52 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint16_t get_uint16be(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+uint32_t get_uint32be(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+void set_uint16be(uint8_t *buf, uint16_t val)
+{
+	buf[0] = (val >> 8) & 0xFF;
+	buf[1] = val & 0xFF;
+}
+
+void set_uint32be(uint8_t *buf, uint32_t val)
+{
+	set_uint16be(buf, (val >> 16) & 0xFFFF);
+	set_uint16be(buf + 2, val & 0xFFFF);
+}
+
+uint32_t fnv1a32(uint32_t hash, const void *dat, size_t len)
+{
+	const uint8_t *src = dat;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= src[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+uint64_t fnv1a64(uint64_t hash, const void *dat, size_t len)
+{
+	const uint8_t *src = dat;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= src[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
 
 void render_region(const uint8_t *imgdat, int iw, int ih,
                    int sx, int sy, int sw, int sh)
@@ -67,3 +113,102 @@ void clip_8x8_tile(uint8_t *imgdat, int iw, int sx, int sy,
 		}
 	}
 }
+
+bool find_opaque_bounds(const uint8_t *imgdat, int iw,
+                        int sx, int sy, int sw, int sh,
+                        int *left, int *top, int *right, int *bottom)
+{
+	*left = sx + sw;
+	*top = sy + sh;
+	*right = sx;
+	*bottom = sy;
+	for (int y = sy; y < sy + sh; y++)
+	{
+		const uint8_t *line = &imgdat[y * iw];
+		for (int x = sx; x < sx + sw; x++)
+		{
+			if (line[x] == 0) continue;
+			if (x < *left) *left = x;
+			if (x >= *right) *right = x + 1;
+			if (y < *top) *top = y;
+			*bottom = y + 1;
+		}
+	}
+	return *right > *left;
+}
+
+int mask_row_words(int width)
+{
+	return (width + 15) / 16;
+}
+
+void pack_mask_1bpp(const uint8_t *imgdat, int iw,
+                    int left, int top, int right, int bottom, uint8_t *out)
+{
+	const int row_bytes = mask_row_words(right - left) * 2;
+	memset(out, 0, row_bytes * (bottom - top));
+	for (int y = top; y < bottom; y++)
+	{
+		const uint8_t *line = &imgdat[y * iw];
+		for (int x = left; x < right; x++)
+		{
+			if (line[x] == 0) continue;
+			const int bit = x - left;
+			out[bit / 8] |= 0x80 >> (bit % 8);
+		}
+		out += row_bytes;
+	}
+}
+
+uint64_t time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+uint16_t rgb_to_x68k(uint8_t r, uint8_t g, uint8_t b)
+{
+	return (((r >> 3) & 0x1F) << 6) |
+	       (((g >> 3) & 0x1F) << 11) |
+	       (((b >> 3) & 0x1F) << 1);
+}
+
+static uint8_t pcg_get_px(const uint8_t *pcg, int x, int y)
+{
+	const uint8_t b = pcg[((x / 8) * 64) + ((y / 8) * 32) + ((y % 8) * 4) + ((x % 8) / 2)];
+	return (x % 2) ? (b & 0xF) : (b >> 4);
+}
+
+void pcg_flip(const uint8_t *src, uint8_t *dst, bool hflip, bool vflip)
+{
+	for (int y = 0; y < PCG_TILE_PX; y++)
+	{
+		const int sy = vflip ? (PCG_TILE_PX - 1 - y) : y;
+		for (int x = 0; x < PCG_TILE_PX; x += 2)
+		{
+			const int sx0 = hflip ? (PCG_TILE_PX - 1 - x) : x;
+			const int sx1 = hflip ? (PCG_TILE_PX - 2 - x) : x + 1;
+			dst[((x / 8) * 64) + ((y / 8) * 32) + ((y % 8) * 4) + ((x % 8) / 2)] =
+			    (pcg_get_px(src, sx0, sy) << 4) | pcg_get_px(src, sx1, sy);
+		}
+	}
+}
+
+uint32_t pcg_hash(const uint8_t *src)
+{
+	return fnv1a32(FNV1A32_INIT, src, 128);
+}
+
+uint32_t pcg_canonical_hash(const uint8_t *src)
+{
+	uint32_t ret = pcg_hash(src);
+	for (int i = 1; i < 4; i++)
+	{
+		uint8_t flipped[128];
+		pcg_flip(src, flipped, i & 1, i & 2);
+		const uint32_t hash = pcg_hash(flipped);
+		if (hash < ret) ret = hash;
+	}
+	return ret;
+}
@@ -1,10 +1,27 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "types.h"
 
+#define ARRAYSIZE(x) (sizeof(x) / sizeof(x[0]))
+
+// Motorola 68000, and therefore XSP, uses big-endian data.
+uint16_t get_uint16be(const uint8_t *buf);
+uint32_t get_uint32be(const uint8_t *buf);
+void set_uint16be(uint8_t *buf, uint16_t val);
+void set_uint32be(uint8_t *buf, uint32_t val);
+
+// FNV-1a, continued from hash over len bytes of dat. A fresh hash starts from
+// FNV1A32_INIT or FNV1A64_INIT.
+#define FNV1A32_INIT 0x811C9DC5
+#define FNV1A64_INIT 0xCBF29CE484222325ULL
+uint32_t fnv1a32(uint32_t hash, const void *dat, size_t len);
+uint64_t fnv1a64(uint64_t hash, const void *dat, size_t len);
+
 // Small utility functions used in sprite extraction. Arguments are concise,
 // so a generalized description has been provided below:
 // imgdat: uint8_t array of sprite sheet bitmap data; one pixel is one byte.
@@ -23,4 +40,39 @@ void render_region(const uint8_t *imgdat, int iw, int ih,
 // Data exceeding sw and sh is excluded.
 void clip_8x8_tile(uint8_t *imgdat, int iw, int sx, int sy,
                    int limx, int limy, uint8_t *out);
+
+// Finds the smallest rectangle within the sprite frame that contains all of
+// its non-transparent pixels. Bounds are in imgdat coordinates; right and
+// bottom are exclusive. Returns false if the frame is empty.
+bool find_opaque_bounds(const uint8_t *imgdat, int iw,
+                        int sx, int sy, int sw, int sh,
+                        int *left, int *top, int *right, int *bottom);
+
+// Packs the opaque pixels within the given rectangle of imgdat as a 1bpp mask,
+// most significant bit first. Each row is padded out to a whole number of
+// 16-bit words, which are stored big-endian. out must hold
+// mask_row_words(right - left) * 2 * (bottom - top) bytes.
+int mask_row_words(int width);
+void pack_mask_1bpp(const uint8_t *imgdat, int iw,
+                    int left, int top, int right, int bottom, uint8_t *out);
+// Monotonic time in microseconds, for reporting how long each phase takes.
+uint64_t time_us(void);
+
+// Converts an 8-bit per channel color to the X68000's GGGGGRRRRRBBBBBI format.
+uint16_t rgb_to_x68k(uint8_t r, uint8_t g, uint8_t b);
+
+// PCG pattern data is 128 bytes: four 8x8 4bpp tiles, ordered top-left,
+// bottom-left, top-right, bottom-right.
+
+// Writes a mirrored copy of the PCG pattern src into dst.
+void pcg_flip(const uint8_t *src, uint8_t *dst, bool hflip, bool vflip);
+
+// Hash of a PCG pattern's data, by 32-bit FNV-1a.
+uint32_t pcg_hash(const uint8_t *src);
+
+// Hash that is identical for a PCG pattern and its mirrored variants: the
+// lowest of pcg_hash() for the pattern as given, H-flipped, V-flipped, and
+// flipped in both directions.
+uint32_t pcg_canonical_hash(const uint8_t *src);
+
 #endif  // UTIL_H